@@ -0,0 +1,391 @@
+/* certwatch_bench - Microbenchmarks for mod_certwatch's parsing functions
+ * Written by Rob Stradling
+ * Copyright (C) 2015-2026 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Times the functions in certwatch_parse.c over realistic inputs, and
+  reports the time and throughput per call:
+
+	certwatch_bench [-t seconds] [name ...]
+
+  Each benchmark runs for at least the given time (default 0.5s); naming
+  some benchmarks runs only those whose names contain one of the names */
+
+#define _POSIX_C_SOURCE	200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "certwatch_parse.h"
+
+
+/* Typedef for a bump allocator, which stands in for an APR pool and is
+  emptied before each call */
+typedef struct tBenchArena {
+	char* m_base;
+	size_t m_used;
+	size_t m_size;
+} tBenchArena;
+
+
+/* Typedef for a benchmark */
+typedef struct tBench {
+	const char* m_name;
+	void (*m_setup)(void);
+	size_t (*m_run)(void);		/* Returns the bytes processed */
+} tBench;
+
+
+static tBenchArena g_arena;
+static char* g_input = NULL;
+static size_t g_inputSize = 0;
+static char* g_scratch = NULL;
+static const char* g_outputPath = NULL;
+static volatile size_t g_sink;		/* Defeats dead code elimination */
+
+
+/******************************************************************************
+ * bench_alloc()                                                              *
+ *   A tCertWatchAlloc that allocates from the arena.                         *
+ ******************************************************************************/
+static void* bench_alloc(
+	void* const v_arena,
+	const size_t v_size
+)
+{
+	tBenchArena* t_arena = (tBenchArena*)v_arena;
+	void* t_result;
+
+	if ((t_arena->m_size - t_arena->m_used) < v_size)
+		return NULL;
+	t_result = t_arena->m_base + t_arena->m_used;
+	t_arena->m_used += (v_size + 15) & ~(size_t)15;
+
+	return t_result;
+}
+
+
+/******************************************************************************
+ * bench_setInput()                                                           *
+ *   Replaces the benchmark's input.                                          *
+ *                                                                            *
+ * IN:	v_size - the size of the input (in bytes).                            *
+ *                                                                            *
+ * Returns:	the (uninitialized) input buffer.                             *
+ ******************************************************************************/
+static char* bench_setInput(
+	const size_t v_size
+)
+{
+	free(g_input);
+	free(g_scratch);
+	g_input = malloc(v_size + 1);
+	g_scratch = malloc(v_size + 1);
+	g_input[v_size] = '\0';
+	g_inputSize = v_size;
+	g_outputPath = NULL;
+
+	return g_input;
+}
+
+
+/* Inputs for certwatch_parse_makeParamArrays() */
+static void setup_query_short(void)
+{
+	const char* t_query = "q=example.com&output=json&exclude=expired";
+
+	strcpy(bench_setInput(strlen(t_query)), t_query);
+}
+
+static void setup_query_identity(void)
+{
+	/* A long identity query, as sent by monitoring tools that look up
+	  many names at once */
+	char* t_to = bench_setInput(8192);
+	int i;
+
+	t_to += sprintf(t_to, "identity=");
+	for (i = 0; (t_to - g_input) < 4060; i++)
+		t_to += sprintf(t_to, "%%25.subdomain%04d.example.com+", i);
+	strcpy(t_to, "&match=ILIKE&deduplicate=Y");
+	g_inputSize = strlen(g_input);
+	g_outputPath = "/json";
+}
+
+static void setup_query_percent(void)
+{
+	/* Every byte percent-encoded (e.g. a PEM certificate) */
+	static const char t_hex[] = "0123456789ABCDEF";
+	char* t_to = bench_setInput(65536);
+	int i;
+
+	t_to += sprintf(t_to, "cert=");
+	for (i = 0; (t_to - g_input) <= (65536 - 3); i++) {
+		*(t_to++) = '%';
+		*(t_to++) = t_hex[(i * 7) & 0x0F];
+		*(t_to++) = t_hex[(i * 3 + 2) & 0x0F];
+	}
+	*t_to = '\0';
+	g_inputSize = strlen(g_input);
+}
+
+static void setup_query_many(void)
+{
+	/* Many short parameters */
+	char* t_to = bench_setInput(65536);
+	int i;
+
+	for (i = 0; (t_to - g_input) < 65500; i++)
+		t_to += sprintf(t_to, "%sP%d=v+%d", i ? "&" : "", i, i);
+	g_inputSize = strlen(g_input);
+}
+
+static size_t run_makeParamArrays(void)
+{
+	char* t_names;
+	char* t_values;
+	const char* t_firstName;
+
+	g_arena.m_used = 0;
+	certwatch_parse_makeParamArrays(
+		bench_alloc, &g_arena, g_outputPath, g_input, &t_names,
+		&t_values, &t_firstName
+	);
+	g_sink += (size_t)t_values;
+
+	return g_inputSize;
+}
+
+
+/* Inputs for certwatch_parse_escapeArrayString() */
+static void setup_escape(void)
+{
+	char* t_to = bench_setInput(1048576);
+	size_t i;
+
+	for (i = 0; i < g_inputSize; i++)
+		t_to[i] = ((i % 61) == 0) ? '"' : ((i % 97) == 0)
+				? '\\' : ('a' + (i % 26));
+}
+
+static size_t run_escape(void)
+{
+	g_arena.m_used = 0;
+	g_sink += (size_t)certwatch_parse_escapeArrayString(
+		bench_alloc(&g_arena, (g_inputSize * 2) + 2), g_input
+	);
+
+	return g_inputSize;
+}
+
+
+/* Inputs for the request body reader, which receives a multi-MB POST body
+  in HUGE_STRING_LEN chunks, with or without a Content-Length */
+#define C_BENCH_CHUNK		8192
+
+static void setup_body(void)
+{
+	memset(bench_setInput(8388608), 'x', 8388608);
+}
+
+static size_t run_body(
+	const size_t v_capacity
+)
+{
+	tCertWatchBody t_body;
+	size_t i;
+
+	g_arena.m_used = 0;
+	certwatch_body_init(&t_body, bench_alloc, &g_arena, v_capacity, 0);
+	for (i = 0; i < g_inputSize; i += C_BENCH_CHUNK)
+		certwatch_body_append(
+			&t_body, g_input + i,
+			((g_inputSize - i) < C_BENCH_CHUNK)
+				? (g_inputSize - i) : C_BENCH_CHUNK
+		);
+	g_sink += t_body.m_size;
+
+	return g_inputSize;
+}
+
+static size_t run_body_chunked(void)
+{
+	return run_body(C_BENCH_CHUNK);
+}
+
+static size_t run_body_sized(void)
+{
+	return run_body(g_inputSize);
+}
+
+
+/* Inputs for the [BEGIN_HEADERS] block parser */
+static void setup_response(
+	const int v_closed
+)
+{
+	char* t_to = bench_setInput(4194304);
+	int i;
+
+	memset(g_input, 'x', g_inputSize);
+	t_to += sprintf(t_to, C_HTTP_HEADERS);
+	for (i = 0; i < 16; i++)
+		t_to += sprintf(
+			t_to, "X-Certwatch-Header-%d: value %d; max-age=%d\n",
+			i, i, i * 60
+		);
+	t_to += sprintf(
+		t_to, "Content-Type: text/html; charset=UTF-8\n%s",
+		v_closed ? C_HTTP_HEADERS_CLOSE : ""
+	);
+	*t_to = 'x';
+}
+
+static void setup_response_headers(void)
+{
+	setup_response(1);
+}
+
+static void setup_response_unclosed(void)
+{
+	setup_response(0);
+}
+
+static size_t run_response(void)
+{
+	char* t_lines;
+	char* t_endOfHeaders;
+	char* t_name;
+	char* t_value;
+
+	if (!certwatch_findHeaders(
+			g_input, g_inputSize, &t_lines, &t_endOfHeaders)) {
+		g_sink++;
+		return C_HTTP_HEADERS_MAX;
+	}
+
+	/* The header lines are modified in place, so parse a copy of them */
+	memcpy(g_scratch, t_lines, t_endOfHeaders - t_lines);
+	t_endOfHeaders = g_scratch + (t_endOfHeaders - t_lines);
+	*t_endOfHeaders = '\0';
+	t_lines = g_scratch;
+	while (certwatch_nextHeader(
+			&t_lines, t_endOfHeaders, &t_name, &t_value))
+		g_sink += (size_t)t_value;
+
+	return t_endOfHeaders - g_scratch;
+}
+
+
+static const tBench g_benches[] = {
+	{ "makeParamArrays/short", setup_query_short, run_makeParamArrays },
+	{ "makeParamArrays/identity", setup_query_identity,
+		run_makeParamArrays },
+	{ "makeParamArrays/percent64k", setup_query_percent,
+		run_makeParamArrays },
+	{ "makeParamArrays/many64k", setup_query_many, run_makeParamArrays },
+	{ "escapeArrayString/1m", setup_escape, run_escape },
+	{ "body/8m-chunked", setup_body, run_body_chunked },
+	{ "body/8m-sized", setup_body, run_body_sized },
+	{ "headers/4m-response", setup_response_headers, run_response },
+	{ "headers/4m-unclosed", setup_response_unclosed, run_response }
+};
+
+
+/******************************************************************************
+ * bench_now()                                                                *
+ *                                                                            *
+ * Returns:	the monotonic clock, in nanoseconds.                          *
+ ******************************************************************************/
+static uint64_t bench_now(void)
+{
+	struct timespec t_now;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_now);
+
+	return ((uint64_t)t_now.tv_sec * 1000000000) + t_now.tv_nsec;
+}
+
+
+/******************************************************************************
+ * main()                                                                     *
+ ******************************************************************************/
+int main(
+	int argc,
+	char** argv
+)
+{
+	uint64_t t_minTime = 500000000;
+	uint64_t t_startedAt;
+	uint64_t t_elapsed;
+	uint64_t t_iterations;
+	uint64_t t_batch;
+	double t_bytes;
+	size_t i;
+	int t_option;
+	int j;
+
+	while ((t_option = getopt(argc, argv, "t:")) != -1) {
+		if (t_option != 't') {
+			fprintf(stderr,
+				"Usage: %s [-t seconds] [name ...]\n", argv[0]);
+			return 2;
+		}
+		t_minTime = (uint64_t)(atof(optarg) * 1000000000);
+	}
+
+	/* Enough for the largest input's arrays or copy */
+	g_arena.m_size = 64 * 1048576;
+	g_arena.m_base = malloc(g_arena.m_size);
+
+	printf("%-28s %12s %12s %10s\n", "benchmark", "iterations", "ns/op",
+		"MB/s");
+	for (i = 0; i < (sizeof(g_benches) / sizeof(*g_benches)); i++) {
+		for (j = optind; j < argc; j++)
+			if (strstr(g_benches[i].m_name, argv[j]))
+				break;
+		if ((optind < argc) && (j == argc))
+			continue;
+
+		g_benches[i].m_setup();
+		(void)g_benches[i].m_run();	/* Warm up */
+
+		/* Double the number of calls until they take long enough */
+		t_iterations = 0;
+		t_bytes = 0;
+		t_batch = 1;
+		t_startedAt = bench_now();
+		do {
+			uint64_t k;
+			for (k = 0; k < t_batch; k++)
+				t_bytes += g_benches[i].m_run();
+			t_iterations += t_batch;
+			t_batch *= 2;
+			t_elapsed = bench_now() - t_startedAt;
+		} while (t_elapsed < t_minTime);
+
+		printf("%-28s %12llu %12.1f %10.1f\n", g_benches[i].m_name,
+			(unsigned long long)t_iterations,
+			(double)t_elapsed / t_iterations,
+			(t_bytes / 1048576) / (t_elapsed / 1e9));
+	}
+
+	return 0;
+}
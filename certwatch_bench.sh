@@ -0,0 +1,185 @@
+#!/bin/bash
+# certwatch_bench.sh - End-to-end benchmark for mod_certwatch
+# Written by Rob Stradling
+# Copyright (C) 2015-2026 Sectigo Limited
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Starts a throwaway PostgreSQL cluster with the stand-in web_apis()
+# functions from certwatch_bench.sql and a throwaway httpd that loads the
+# freshly built module, then drives each scenario with ab and reports
+# requests/s, latency percentiles and how many worker threads were busy
+# (sampled from mod_status).  Run it (as an unprivileged user) after "make",
+# e.g. "make bench".
+#
+# /async/ inherits the same configuration and adds "CertWatchAsync On",
+# so that get-slow-async can be compared with get-slow-query: on the event
+# MPM, suspended requests shouldn't occupy worker threads while their queries
+# run.
+#
+# BENCH_REQUESTS, BENCH_CONCURRENCY, BENCH_HTTP_PORT and BENCH_PG_PORT
+# override the defaults below; any extra arguments are added to the
+# <Location> block (e.g. "CertWatchFraming On", or "CertWatchCompression
+# zstd br gzip" for the *-gzip/*-br/*-zstd scenarios to compress).
+
+set -e
+
+REQUESTS=${BENCH_REQUESTS:-5000}
+CONCURRENCY=${BENCH_CONCURRENCY:-32}
+HTTP_PORT=${BENCH_HTTP_PORT:-18089}
+PG_PORT=${BENCH_PG_PORT:-54329}
+SRCDIR=$(cd "$(dirname "$0")" && pwd)
+MODULE=$SRCDIR/.libs/mod_certwatch.so
+
+APXS=${APXS:-apxs}
+HTTPD=$($APXS -q SBINDIR)/$($APXS -q TARGET)
+LIBEXECDIR=$($APXS -q LIBEXECDIR)
+PGBINDIR=$(pg_config --bindir)
+
+if [ "$(id -u)" = "0" ]; then
+	echo "$0: PostgreSQL won't run as root; run this as another user" >&2
+	exit 1
+fi
+for t_file in "$MODULE" "$HTTPD" "$PGBINDIR/initdb" "$(command -v ab)" \
+		"$(command -v curl)"; do
+	if [ ! -x "$t_file" ] && [ ! -f "$t_file" ]; then
+		echo "$0: $t_file not found (run make first?)" >&2
+		exit 1
+	fi
+done
+
+WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/certwatch_bench.XXXXXX")
+cleanup() {
+	if [ -f "$WORKDIR/httpd.pid" ]; then
+		kill "$(cat "$WORKDIR/httpd.pid")" 2>/dev/null
+	fi
+	"$PGBINDIR/pg_ctl" -D "$WORKDIR/pg" -m immediate stop >/dev/null 2>&1
+	sleep 1
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+
+# Start PostgreSQL, listening only on a Unix socket in $WORKDIR
+"$PGBINDIR/initdb" -D "$WORKDIR/pg" -A trust -U postgres >/dev/null
+"$PGBINDIR/pg_ctl" -D "$WORKDIR/pg" -l "$WORKDIR/pg.log" -w \
+	-o "-k $WORKDIR -c listen_addresses='' -p $PG_PORT -c max_connections=200" \
+	start >/dev/null
+"$PGBINDIR/psql" -q -h "$WORKDIR" -p "$PG_PORT" -U postgres \
+	-v ON_ERROR_STOP=1 -f "$SRCDIR/certwatch_bench.sql" postgres
+
+
+# Start httpd
+{
+	echo "ServerRoot $WORKDIR"
+	echo "ServerName 127.0.0.1"
+	echo "Listen 127.0.0.1:$HTTP_PORT"
+	echo "PidFile $WORKDIR/httpd.pid"
+	echo "ErrorLog $WORKDIR/error_log"
+	echo "Mutex file:$WORKDIR default"
+	for t_module in mpm_event unixd authz_core status; do
+		if [ -f "$LIBEXECDIR/mod_$t_module.so" ]; then
+			echo "LoadModule ${t_module}_module $LIBEXECDIR/mod_$t_module.so"
+		fi
+	done
+	echo "LoadModule certwatch_module $MODULE"
+	echo "<Location />"
+	echo "	SetHandler certwatch"
+	echo "	ConnInfo \"host=$WORKDIR port=$PG_PORT dbname=postgres user=postgres\""
+	for t_directive in "$@"; do
+		echo "	$t_directive"
+	done
+	echo "</Location>"
+	echo "<Location /async/>"
+	echo "	CertWatchAsync On"
+	echo "</Location>"
+	echo "<Location /server-status>"
+	echo "	SetHandler server-status"
+	echo "</Location>"
+} > "$WORKDIR/httpd.conf"
+"$HTTPD" -f "$WORKDIR/httpd.conf" -k start
+for i in $(seq 50); do
+	if [ -f "$WORKDIR/httpd.pid" ]; then
+		break
+	fi
+	sleep 0.1
+done
+
+
+# Make the inputs for the POST scenario: a 1MB body, every byte of which is
+# percent-encoded
+head -c 349525 /dev/urandom | od -An -v -tx1 | tr -d ' \n' \
+	| sed 's/\(..\)/%\1/g; s/^/cert=/' > "$WORKDIR/post_body"
+IDENTITY="identity=$(for i in $(seq 100); do echo -n "%25.sub$i.example.com+"; done)"
+
+
+# sample_workers: appends mod_status's count of busy worker threads (less the
+# one serving mod_status) to $WORKDIR/busy.out every 100ms, until killed
+sample_workers() {
+	while true; do
+		curl -s "$URL/server-status?auto" \
+			| awk '/^BusyWorkers:/ { print $2 - 1 }' >> "$WORKDIR/busy.out"
+		sleep 0.1
+	done
+}
+
+# run_scenario <name> <ab options...> <URL>
+run_scenario() {
+	local t_name=$1
+	local t_sampler
+	shift
+	: > "$WORKDIR/busy.out"
+	sample_workers &
+	t_sampler=$!
+	ab -q -r -n "$REQUESTS" -c "$CONCURRENCY" "$@" > "$WORKDIR/ab.out" 2>&1 || {
+		kill "$t_sampler"
+		wait "$t_sampler" 2>/dev/null
+		echo "$t_name: ab failed" >&2
+		cat "$WORKDIR/ab.out" >&2
+		return
+	}
+	kill "$t_sampler"
+	wait "$t_sampler" 2>/dev/null
+	awk -v name="$t_name" '
+		FNR == NR		{ busy += $1; samples++
+					  if ($1 > maxBusy) maxBusy = $1
+					  next }
+		/^Requests per second:/	{ rps = $4 }
+		/^Failed requests:/	{ failed = $3 }
+		/^Non-2xx responses:/	{ non2xx = $3 }
+		/^ *50%/		{ p50 = $2 }
+		/^ *90%/		{ p90 = $2 }
+		/^ *99%/		{ p99 = $2 }
+		/^ *100%/		{ max = $2 }
+		END {
+			printf "%-18s %10s %8s %8s %8s %8s %8d %6.1f %6d\n",
+				name, rps, p50, p90, p99, max, failed + non2xx,
+				samples ? busy / samples : 0, maxBusy
+		}' "$WORKDIR/busy.out" "$WORKDIR/ab.out"
+}
+
+URL=http://127.0.0.1:$HTTP_PORT
+printf "%-18s %10s %8s %8s %8s %8s %8s %6s %6s\n" "scenario" "req/s" \
+	"p50 ms" "p90 ms" "p99 ms" "max ms" "errors" "busy" "max"
+run_scenario get-small "$URL/?q=example.com"
+run_scenario get-identity "$URL/json?$IDENTITY"
+run_scenario get-1mb "$URL/?q=example.com&size=1048576"
+for t_coding in gzip br zstd; do
+	run_scenario get-1mb-$t_coding -H "Accept-Encoding: $t_coding" \
+		"$URL/?q=example.com&size=1048576"
+done
+run_scenario get-slow-query "$URL/?q=example.com&sleep=20"
+run_scenario get-slow-async "$URL/async/?q=example.com&sleep=20"
+run_scenario post-1mb -p "$WORKDIR/post_body" \
+	-T application/x-www-form-urlencoded "$URL/"
@@ -0,0 +1,128 @@
+-- certwatch_bench.sql - Stand-in web_apis() functions for certwatch_bench.sh
+-- Written by Rob Stradling
+-- Copyright (C) 2015-2026 Sectigo Limited
+--
+-- This program is free software: you can redistribute it and/or modify
+-- it under the terms of the GNU General Public License as published by
+-- the Free Software Foundation, either version 3 of the License, or
+-- (at your option) any later version.
+--
+-- This program is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+-- Each function returns a body of "size" bytes (default 4096) after
+-- sleeping for "sleep" milliseconds (default 0), so that the benchmark
+-- measures mod_certwatch rather than certwatch_db's queries.
+
+CREATE OR REPLACE FUNCTION bench_param(
+	paramNames		text[],
+	paramValues		text[],
+	paramName		text,
+	defaultValue	text
+) RETURNS text
+AS $$
+	SELECT coalesce(paramValues[array_position(paramNames, paramName)],
+					defaultValue);
+$$ LANGUAGE sql IMMUTABLE;
+
+
+CREATE OR REPLACE FUNCTION bench_body(
+	paramNames		text[],
+	paramValues		text[]
+) RETURNS text
+AS $$
+DECLARE
+	t_sleep		double precision := bench_param(
+						paramNames, paramValues, 'sleep', '0'
+					)::double precision;
+BEGIN
+	IF t_sleep > 0 THEN
+		PERFORM pg_sleep(t_sleep / 1000);
+	END IF;
+	RETURN repeat('x', bench_param(paramNames, paramValues, 'size', '4096')::integer);
+END;
+$$ LANGUAGE plpgsql;
+
+
+CREATE OR REPLACE FUNCTION web_apis(
+	paramFunction	text,
+	paramNames		text[],
+	paramValues		text[]
+) RETURNS text
+AS $$
+	SELECT '[BEGIN_HEADERS]' || chr(10)
+			|| 'Content-Type: text/plain; charset=UTF-8' || chr(10)
+			|| 'Cache-Control: max-age=60' || chr(10)
+			|| '[END_HEADERS]' || chr(10)
+			|| bench_body(paramNames, paramValues);
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION web_apis_test(
+	paramFunction	text,
+	paramNames		text[],
+	paramValues		text[]
+) RETURNS text
+AS $$
+	SELECT web_apis(paramFunction, paramNames, paramValues);
+$$ LANGUAGE sql;
+
+
+CREATE OR REPLACE FUNCTION web_apis_stream(
+	paramFunction	text,
+	paramNames		text[],
+	paramValues		text[]
+) RETURNS SETOF text
+AS $$
+DECLARE
+	t_body		text := bench_body(paramNames, paramValues);
+	i			integer;
+BEGIN
+	RETURN NEXT '[BEGIN_HEADERS]' || chr(10)
+			|| 'Content-Type: text/plain; charset=UTF-8' || chr(10)
+			|| '[END_HEADERS]' || chr(10);
+	FOR i IN 0..((length(t_body) - 1) / 65536) LOOP
+		RETURN NEXT substr(t_body, (i * 65536) + 1, 65536);
+	END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION web_apis_stream_test(
+	paramFunction	text,
+	paramNames		text[],
+	paramValues		text[]
+) RETURNS SETOF text
+AS $$
+	SELECT web_apis_stream(paramFunction, paramNames, paramValues);
+$$ LANGUAGE sql;
+
+
+DROP TYPE IF EXISTS web_apis_framed_result CASCADE;
+CREATE TYPE web_apis_framed_result AS (
+	headers		text[],
+	body		bytea
+);
+
+CREATE OR REPLACE FUNCTION web_apis_framed(
+	paramFunction	text,
+	paramNames		text[],
+	paramValues		text[]
+) RETURNS web_apis_framed_result
+AS $$
+	SELECT ARRAY['Content-Type: text/plain; charset=UTF-8',
+					'Cache-Control: max-age=60'],
+			convert_to(bench_body(paramNames, paramValues), 'UTF8');
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION web_apis_framed_test(
+	paramFunction	text,
+	paramNames		text[],
+	paramValues		text[]
+) RETURNS web_apis_framed_result
+AS $$
+	SELECT web_apis_framed(paramFunction, paramNames, paramValues);
+$$ LANGUAGE sql;
@@ -0,0 +1,68 @@
+/* certwatch_capture.h - Traffic capture file format for mod_certwatch
+ * Written by Rob Stradling
+ * Copyright (C) 2015-2026 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CERTWATCH_CAPTURE_H
+#define CERTWATCH_CAPTURE_H
+
+
+/* A capture file starts with C_CAPTURE_MAGIC, which is followed by any
+  number of records.  Every integer is big-endian.  Each record is:
+
+	u32	length of the rest of the record
+	u64	request time (microseconds since the epoch)
+	u8	method (C_CAPTURE_METHOD_*)
+	u8	reserved (0)
+	u16	HTTP status
+	u64	response body bytes sent
+	u32	time spent in each phase (microseconds; 0 = not reached), in
+		the order queue, connect, execute, headers, output, total
+	then, for each of the URI, the function name, the parameter name
+	array, the parameter value array and the Accept header:
+	u32	length
+	...	bytes (not NUL-terminated)
+
+  The parameter arrays are exactly as passed to web_apis() (PostgreSQL array
+  strings, with every element quoted), or empty if there were none.
+
+  Each child appends whole records with a single write(), so records from
+  different children never interleave */
+#define C_CAPTURE_MAGIC			"CWCAP\0\0\1"
+#define C_CAPTURE_MAGIC_SIZE		8
+
+#define C_CAPTURE_METHOD_GET		0
+#define C_CAPTURE_METHOD_POST		1
+
+#define C_CAPTURE_PHASES		6
+#define C_CAPTURE_PHASE_TOTAL		5
+
+#define C_CAPTURE_STRING_URI		0
+#define C_CAPTURE_STRING_FUNCTION	1
+#define C_CAPTURE_STRING_NAMES		2
+#define C_CAPTURE_STRING_VALUES		3
+#define C_CAPTURE_STRING_ACCEPT		4
+#define C_CAPTURE_STRINGS		5
+
+/* Size of a record's fixed fields, including its length */
+#define C_CAPTURE_FIXED_SIZE		(4 + 8 + 1 + 1 + 2 + 8		\
+					+ (4 * C_CAPTURE_PHASES))
+
+/* Largest record that is captured */
+#define C_CAPTURE_RECORD_MAX		8192
+
+
+#endif
@@ -0,0 +1,355 @@
+/* certwatch_check - Equivalence tests for mod_certwatch's parsing functions
+ * Written by Rob Stradling
+ * Copyright (C) 2015-2026 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compares the single-pass parameter array builder in certwatch_parse.c with
+  the original implementation (the strcspn() / ap_unescape_url() /
+  apr_psprintf() loop, reproduced below without httpd or APR) over random
+  URL-encoded inputs, and reports the first input on which they differ:
+
+	certwatch_check [-n inputs] [-s seed]
+
+  Exits with status 0 if every input agrees */
+
+#define _POSIX_C_SOURCE	200809L
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "certwatch_parse.h"
+
+
+/* Bump allocator for the new implementation, emptied before each input */
+static char* g_arena = NULL;
+static size_t g_arenaUsed = 0;
+static size_t g_arenaSize = 0;
+
+
+/******************************************************************************
+ * check_alloc()                                                              *
+ *   A tCertWatchAlloc that allocates from the arena.                         *
+ ******************************************************************************/
+static void* check_alloc(
+	void* const v_baton,
+	const size_t v_size
+)
+{
+	void* t_result;
+
+	(void)v_baton;
+	if ((g_arenaSize - g_arenaUsed) < v_size)
+		return NULL;
+	t_result = g_arena + g_arenaUsed;
+	g_arenaUsed += (v_size + 15) & ~(size_t)15;
+
+	return t_result;
+}
+
+
+/******************************************************************************
+ * ref_unescapeUrl()                                                          *
+ *   ap_unescape_url(), as the original implementation called it: each valid  *
+ * %XX sequence is decoded (a %00 truncates the string) and each invalid one  *
+ * is left as it is.                                                          *
+ ******************************************************************************/
+static void ref_unescapeUrl(
+	char* const v_url
+)
+{
+	char* t_to = v_url;
+	const char* t_from;
+
+	for (t_from = v_url; *t_from; t_to++, t_from++) {
+		if ((*t_from == '%') && isxdigit((unsigned char)t_from[1])
+				&& isxdigit((unsigned char)t_from[2])) {
+			char t_hex[3] = { t_from[1], t_from[2], '\0' };
+			*t_to = (char)strtol(t_hex, NULL, 16);
+			t_from += 2;
+		}
+		else
+			*t_to = *t_from;
+	}
+	*t_to = '\0';
+}
+
+
+/******************************************************************************
+ * ref_append()                                                               *
+ *   Appends ",<escaped string>" to an array string, as the original          *
+ * implementation's escapeArrayString() and apr_psprintf("%s,%s") did.        *
+ ******************************************************************************/
+static void ref_append(
+	char** const v_array,
+	const char* v_from
+)
+{
+	size_t t_length = strlen(*v_array);
+	char* t_to;
+
+	*v_array = realloc(*v_array, t_length + (strlen(v_from) * 2) + 4);
+	t_to = *v_array + t_length;
+	*(t_to++) = ',';
+	*(t_to++) = '"';
+	for (; *v_from; v_from++) {
+		if ((*v_from == '\\') || (*v_from == '"'))
+			*(t_to++) = '\\';
+		*(t_to++) = *v_from;
+	}
+	*(t_to++) = '"';
+	*t_to = '\0';
+}
+
+
+/******************************************************************************
+ * ref_makeParamArrays()                                                      *
+ *   The original certwatch_makeParamArrays().                                *
+ *                                                                            *
+ * IN:	v_outputPath - the path, if it specifies the output format; or NULL.  *
+ * 	v_urlEncodedData - the URL-encoded data (which is modified).          *
+ *                                                                            *
+ * OUT:	v_nameArray, v_valueArray - the array strings (which the caller       *
+ * 		must free), or NULL if there are no parameters.               *
+ ******************************************************************************/
+static void ref_makeParamArrays(
+	const char* const v_outputPath,
+	char* const v_urlEncodedData,
+	char** v_nameArray,
+	char** v_valueArray
+)
+{
+	char* t_nextArgName = v_urlEncodedData;
+	char* t_argName;
+	char* t_argValue;
+	char* t_offset;
+	const char* t_output;
+	size_t t_length;
+
+	*v_nameArray = calloc(1, 1);
+	*v_valueArray = calloc(1, 1);
+
+	while (t_nextArgName) {
+		t_argName = t_nextArgName;
+		t_length = strcspn(t_argName, "=&");
+		if (!t_length)
+			break;		/* No more parameters */
+
+		t_argValue = t_argName + t_length;
+		if (*t_argValue == '=') {
+			*(t_argValue++) = '\0';
+			t_nextArgName = strchr(t_argValue, '&');
+			if (t_nextArgName)
+				*(t_nextArgName++) = '\0';
+		}
+		else if (*t_argValue == '&') {
+			t_nextArgName = t_argValue + 1;
+			*t_argValue = '\0';
+		}
+		else
+			t_nextArgName = NULL;
+
+		for (t_offset = t_argName; *t_offset; t_offset++)
+			if (*t_offset == '+')
+				*t_offset = ' ';
+		for (t_offset = t_argValue; *t_offset; t_offset++)
+			if (*t_offset == '+')
+				*t_offset = ' ';
+
+		ref_unescapeUrl(t_argName);
+		ref_unescapeUrl(t_argValue);
+		for (t_offset = t_argName; *t_offset; t_offset++)
+			*t_offset = tolower((unsigned char)*t_offset);
+
+		ref_append(v_nameArray, t_argName);
+		ref_append(v_valueArray, t_argValue);
+	}
+
+	if (v_outputPath) {
+		t_output = v_outputPath + 1;
+		if (!strncmp(t_output, "_ROB_IS_TESTING_/", 17))
+			t_output += 17;
+		ref_append(v_nameArray, "output");
+		ref_append(v_valueArray, t_output);
+	}
+
+	if (**v_nameArray) {
+		/* Replace the leading commas with braces */
+		t_length = strlen(*v_nameArray);
+		**v_nameArray = '{';
+		*v_nameArray = realloc(*v_nameArray, t_length + 2);
+		strcpy(*v_nameArray + t_length, "}");
+		t_length = strlen(*v_valueArray);
+		**v_valueArray = '{';
+		*v_valueArray = realloc(*v_valueArray, t_length + 2);
+		strcpy(*v_valueArray + t_length, "}");
+	}
+	else {
+		free(*v_nameArray);
+		free(*v_valueArray);
+		*v_nameArray = NULL;
+		*v_valueArray = NULL;
+	}
+}
+
+
+/******************************************************************************
+ * check_randomInput()                                                        *
+ *   Makes a random URL-encoded string that is dense in the characters that   *
+ * the parser treats specially, including valid and invalid %XX sequences,    *
+ * %00 and bytes >= 0x80.                                                     *
+ *                                                                            *
+ * OUT:	v_to - buffer with room for at least 129 bytes.                       *
+ ******************************************************************************/
+static void check_randomInput(
+	char* v_to
+)
+{
+	static const char* const t_pieces[] = {
+		"=", "&", "+", "%", "\"", "\\", "a", "Q", "z", "0", "f", "F",
+		"%41", "%2b", "%2B", "%26", "%3D", "%22", "%5C", "%5c", "%00",
+		"%e9", "%C3%A9", "%G1", "%4", "\xC3\xA9", "\xFF", " ", "&&",
+		"=="
+	};
+	const size_t t_nPieces = sizeof(t_pieces) / sizeof(*t_pieces);
+	const char* const t_start = v_to;
+	int t_count = rand() % 40;
+	const char* t_piece;
+
+	while (t_count-- > 0) {
+		t_piece = t_pieces[rand() % t_nPieces];
+		if ((v_to - t_start) + strlen(t_piece) > 128)
+			break;
+		v_to = stpcpy(v_to, t_piece);
+	}
+	*v_to = '\0';
+}
+
+
+/******************************************************************************
+ * check_report()                                                             *
+ *   Reports a difference between the implementations.                        *
+ ******************************************************************************/
+static void check_report(
+	const char* const v_what,
+	const char* const v_input,
+	const char* const v_outputPath,
+	const char* const v_expected,
+	const char* const v_actual
+)
+{
+	fprintf(stderr,
+		"%s differs\n  input:    \"%s\"\n  path:     %s\n"
+		"  expected: %s\n  actual:   %s\n",
+		v_what, v_input, v_outputPath ? v_outputPath : "(none)",
+		v_expected ? v_expected : "(NULL)",
+		v_actual ? v_actual : "(NULL)");
+}
+
+
+/******************************************************************************
+ * main()                                                                     *
+ ******************************************************************************/
+int main(
+	int argc,
+	char** argv
+)
+{
+	static const char* const t_paths[] = {
+		NULL, "/json", "/atom", "/_ROB_IS_TESTING_/json", "/a\"b\\c"
+	};
+	long t_inputs = 200000;
+	unsigned int t_seed = 1;
+	char t_input[129];
+	char t_copy[129];
+	char t_escaped[(128 * 2) + 3];
+	char* t_expectedNames;
+	char* t_expectedValues;
+	char* t_names;
+	char* t_values;
+	const char* t_firstName;
+	const char* t_path;
+	char* t_end;
+	long i;
+	int t_option;
+
+	while ((t_option = getopt(argc, argv, "n:s:")) != -1) {
+		if (t_option == 'n')
+			t_inputs = atol(optarg);
+		else if (t_option == 's')
+			t_seed = (unsigned int)atol(optarg);
+		else {
+			fprintf(stderr, "Usage: %s [-n inputs] [-s seed]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+	srand(t_seed);
+
+	g_arenaSize = 65536;
+	g_arena = malloc(g_arenaSize);
+
+	for (i = 0; i < t_inputs; i++) {
+		check_randomInput(t_input);
+		t_path = t_paths[rand() % (sizeof(t_paths) / sizeof(*t_paths))];
+
+		strcpy(t_copy, t_input);
+		ref_makeParamArrays(
+			t_path, t_copy, &t_expectedNames, &t_expectedValues
+		);
+		g_arenaUsed = 0;
+		certwatch_parse_makeParamArrays(
+			check_alloc, NULL, t_path, t_input, &t_names,
+			&t_values, &t_firstName
+		);
+
+		if ((!t_expectedNames != !t_names) || (t_names
+				&& strcmp(t_expectedNames, t_names))) {
+			check_report("name array", t_input, t_path,
+				t_expectedNames, t_names);
+			return 1;
+		}
+		if ((!t_expectedValues != !t_values) || (t_values
+				&& strcmp(t_expectedValues, t_values))) {
+			check_report("value array", t_input, t_path,
+				t_expectedValues, t_values);
+			return 1;
+		}
+		free(t_expectedNames);
+		free(t_expectedValues);
+
+		/* certwatch_parse_escapeArrayString() on its own, over the raw
+		  input */
+		t_expectedNames = calloc(1, 1);
+		ref_append(&t_expectedNames, t_input);
+		t_end = certwatch_parse_escapeArrayString(
+			t_escaped, t_input
+		);
+		*t_end = '\0';
+		if (strcmp(t_expectedNames + 1, t_escaped)) {
+			check_report("escaped string", t_input, NULL,
+				t_expectedNames + 1, t_escaped);
+			return 1;
+		}
+		free(t_expectedNames);
+	}
+
+	printf("certwatch_check: %ld inputs agree\n", t_inputs);
+
+	return 0;
+}
@@ -0,0 +1,453 @@
+/* certwatch_parse.c - Request and response parsing for mod_certwatch
+ * Written by Rob Stradling
+ * Copyright (C) 2015-2026 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "certwatch_parse.h"
+
+
+/******************************************************************************
+ * certwatch_body_init()                                                      *
+ *   Prepares to read a request body.                                         *
+ *                                                                            *
+ * IN:	v_alloc, v_baton - the allocator.                                     *
+ * 	v_capacity - the expected size of the body (in bytes).                *
+ * 	v_maxSize - the largest body that will be accepted (in bytes), or 0   *
+ * 		for no limit.                                                 *
+ *                                                                            *
+ * OUT:	v_body - the empty body.                                              *
+ *                                                                            *
+ * Returns:	C_BODY_OK or C_BODY_NO_MEMORY.                                *
+ ******************************************************************************/
+int certwatch_body_init(
+	tCertWatchBody* const v_body,
+	const tCertWatchAlloc v_alloc,
+	void* const v_baton,
+	const size_t v_capacity,
+	const size_t v_maxSize
+)
+{
+	v_body->m_alloc = v_alloc;
+	v_body->m_baton = v_baton;
+	v_body->m_size = 0;
+	v_body->m_capacity = v_capacity;
+	v_body->m_maxSize = v_maxSize;
+
+	/* Leave room for a NUL-terminator */
+	v_body->m_data = v_alloc(v_baton, v_capacity + 1);
+	if (!v_body->m_data)
+		return C_BODY_NO_MEMORY;
+	v_body->m_data[0] = '\0';
+
+	return C_BODY_OK;
+}
+
+
+/******************************************************************************
+ * certwatch_body_append()                                                    *
+ *   Appends data to a request body.  When the buffer is full, its size is at *
+ * least doubled, so each byte is copied at most a constant number of times. *
+ *                                                                            *
+ * IN:	v_data - the data.                                                    *
+ * 	v_size - the size of v_data (in bytes).                               *
+ *                                                                            *
+ * IN/OUT:	v_body - the body.                                            *
+ *                                                                            *
+ * Returns:	C_BODY_OK, C_BODY_TOO_LARGE or C_BODY_NO_MEMORY.              *
+ ******************************************************************************/
+int certwatch_body_append(
+	tCertWatchBody* const v_body,
+	const char* const v_data,
+	const size_t v_size
+)
+{
+	unsigned char* t_newData;
+
+	/* Enforce the size limit, in case Content-Length was absent or
+	  wrong */
+	if ((v_body->m_maxSize > 0)
+			&& ((v_body->m_size + v_size) > v_body->m_maxSize))
+		return C_BODY_TOO_LARGE;
+
+	/* If necessary, at least double the size of the buffer */
+	if ((v_body->m_size + v_size) > v_body->m_capacity) {
+		v_body->m_capacity *= 2;
+		if (v_body->m_capacity < (v_body->m_size + v_size))
+			v_body->m_capacity = v_body->m_size + v_size;
+		if ((v_body->m_maxSize > 0)
+				&& (v_body->m_capacity > v_body->m_maxSize))
+			v_body->m_capacity = v_body->m_maxSize;
+
+		t_newData = v_body->m_alloc(
+			v_body->m_baton, v_body->m_capacity + 1
+		);
+		if (!t_newData)
+			return C_BODY_NO_MEMORY;
+		memcpy(t_newData, v_body->m_data, v_body->m_size);
+		v_body->m_data = t_newData;
+	}
+
+	/* Append the data */
+	memcpy(v_body->m_data + v_body->m_size, v_data, v_size);
+	v_body->m_size += v_size;
+	v_body->m_data[v_body->m_size] = '\0';
+
+	return C_BODY_OK;
+}
+
+
+/* Character classes used when parsing URL-encoded data */
+#define C_PARAM_END_NAME	0x01	/* "=" or "&" */
+#define C_PARAM_END_VALUE	0x02	/* "&" */
+#define C_PARAM_SPECIAL		0x04	/* "+", "%", " or \ */
+
+static const unsigned char g_paramCharClass[256] = {
+	['&'] = C_PARAM_END_NAME | C_PARAM_END_VALUE,
+	['='] = C_PARAM_END_NAME,
+	['+'] = C_PARAM_SPECIAL,
+	['%'] = C_PARAM_SPECIAL,
+	['"'] = C_PARAM_SPECIAL,
+	['\\'] = C_PARAM_SPECIAL
+};
+
+#define HEX_DIGIT_VALUE(c)	\
+	(((c) >= 'A') ? (((c) & 0xDF) - 'A' + 10) : ((c) - '0'))
+
+
+/******************************************************************************
+ * certwatch_parse_escapeArrayString()                                        *
+ *   Escapes a string for inclusion in an array parameter in a call to        *
+ * PQexecParams().  Puts a " character at each end and prepends each \ and "  *
+ * character with a \ character.                                              *
+ *                                                                            *
+ * IN:	v_to - buffer with room for at least (strlen(v_from) * 2) + 2 bytes.  *
+ * 	v_from - pointer to input string.                                     *
+ *                                                                            *
+ * Returns:	pointer to the byte after the closing " in 'v_to'.            *
+ ******************************************************************************/
+char* certwatch_parse_escapeArrayString(
+	char* v_to,
+	const char* v_from
+)
+{
+	*(v_to++) = '"';
+
+	while (*v_from) {
+		/* If necessary, prepend a \ character */
+		if (((*v_from) == '\\') || ((*v_from) == '"'))
+			*(v_to++) = '\\';
+		/* Copy the source character */
+		*(v_to++) = *(v_from++);
+	}
+
+	*(v_to++) = '"';
+
+	return v_to;
+}
+
+
+/******************************************************************************
+ * certwatch_encodeParam()                                                    *
+ *   Decodes one URL-encoded parameter name or value and appends it, escaped  *
+ * and followed by a comma, to a PostgreSQL array string.  Each input byte is *
+ * examined once: '+' becomes SPACE, %XX sequences are decoded (a %00 ends    *
+ * the string, as it would with ap_unescape_url()), names are lowercased and  *
+ * each " and \ character is prepended with a \ character.                    *
+ *                                                                            *
+ * IN:	v_from - start of the URL-encoded name or value.                      *
+ * 	v_end - end of the URL-encoded data.                                  *
+ * 	v_endClass - character class(es) that terminate this name or value.   *
+ * 	v_toLower - non-zero to lowercase the decoded string.                 *
+ *                                                                            *
+ * IN/OUT:	v_to - output position, which is advanced.                    *
+ *                                                                            *
+ * Returns:	pointer to the character that terminated the name or value.   *
+ ******************************************************************************/
+static const char* certwatch_encodeParam(
+	const char* v_from,
+	const char* const v_end,
+	const unsigned char v_endClass,
+	const int v_toLower,
+	char** const v_to
+)
+{
+	char* t_to = *v_to;
+	int t_truncated = 0;
+
+	*(t_to++) = '"';
+
+	for (; v_from < v_end; v_from++) {
+		unsigned char t_char = (unsigned char)*v_from;
+		const unsigned char t_class = g_paramCharClass[t_char];
+		if (t_class & v_endClass)
+			break;
+
+		if (t_class & C_PARAM_SPECIAL) {
+			if (t_char == '+')
+				t_char = ' ';
+			else if ((t_char == '%') && ((v_end - v_from) > 2)
+					&& isxdigit((unsigned char)v_from[1])
+					&& isxdigit((unsigned char)v_from[2])) {
+				t_char = (HEX_DIGIT_VALUE(v_from[1]) << 4)
+						| HEX_DIGIT_VALUE(v_from[2]);
+				v_from += 2;
+				if (!t_char)
+					t_truncated = 1;
+			}
+		}
+		if (t_truncated)
+			continue;
+
+		if (v_toLower)
+			t_char = tolower(t_char);
+
+		/* If necessary, prepend a \ character */
+		if ((t_char == '\\') || (t_char == '"'))
+			*(t_to++) = '\\';
+		*(t_to++) = (char)t_char;
+	}
+
+	*(t_to++) = '"';
+	*(t_to++) = ',';
+	*v_to = t_to;
+
+	return v_from;
+}
+
+
+/******************************************************************************
+ * certwatch_parse_makeParamArrays()                                          *
+ *   Construct the parameter name/value array strings from the query string.  *
+ * Both arrays are written in a single pass into one buffer that is sized for *
+ * the worst case up front.                                                   *
+ *                                                                            *
+ * IN:	v_alloc, v_baton - the allocator.                                     *
+ * 	v_outputPath - the path, if it specifies the output format; or NULL.  *
+ * 	v_urlEncodedData - the URL-encoded data (e.g. the GET query string).  *
+ *                                                                            *
+ * OUT:	v_nameArray - the parameter name array (PostgreSQL array string).     *
+ * 	v_valueArray - the parameter value array (PostgreSQL array string).   *
+ * 	v_firstName - the first parameter's name (escaped), or NULL.          *
+ ******************************************************************************/
+void certwatch_parse_makeParamArrays(
+	const tCertWatchAlloc v_alloc,
+	void* const v_baton,
+	const char* const v_outputPath,
+	const char* const v_urlEncodedData,
+	char** v_nameArray,
+	char** v_valueArray,
+	const char** v_firstName
+)
+{
+	const char* t_from = v_urlEncodedData;
+	const char* t_end = NULL;
+	const char* t_output = NULL;
+	size_t t_length = 0;
+	size_t t_outputLength = 0;
+	size_t t_maxArrayLength;
+	char* t_names;
+	char* t_values;
+	char* t_nameTo;
+	char* t_valueTo;
+	char* t_firstName;
+
+	/* Initialize the output parameters */
+	*v_nameArray = NULL;
+	*v_valueArray = NULL;
+	*v_firstName = NULL;
+
+	if (v_urlEncodedData) {
+		t_length = strlen(v_urlEncodedData);
+		t_end = v_urlEncodedData + t_length;
+	}
+
+	if (v_outputPath) {
+		t_output = v_outputPath + 1;
+		if (!strncmp(t_output, "_ROB_IS_TESTING_/", 17))
+			t_output += 17;
+		t_outputLength = strlen(t_output);
+	}
+
+	/* Worst case for each array: every character escaped, plus quotes and
+	  a comma for each parameter (each of which, except the last, occupies
+	  at least 2 bytes of input), plus the "output" parameter and braces */
+	t_maxArrayLength = (2 * t_length) + (3 * ((t_length / 2) + 1))
+				+ (2 * t_outputLength) + 16;
+	t_names = v_alloc(v_baton, 2 * t_maxArrayLength);
+	if (!t_names)
+		return;
+	t_values = t_names + t_maxArrayLength;
+	t_nameTo = t_names;
+	t_valueTo = t_values;
+	*(t_nameTo++) = '{';
+	*(t_valueTo++) = '{';
+
+	while (t_from && (t_from < t_end)) {
+		/* An empty name means there are no more parameters */
+		if (g_paramCharClass[(unsigned char)*t_from] & C_PARAM_END_NAME)
+			break;
+
+		/* Add the name to the array string.  All argument name
+		  comparisons are case-insensitive, so convert it to lower
+		  case */
+		t_from = certwatch_encodeParam(
+			t_from, t_end, C_PARAM_END_NAME, 1, &t_nameTo
+		);
+		if (!*v_firstName) {
+			t_firstName = v_alloc(
+				v_baton, t_nameTo - t_names - 3
+			);
+			if (t_firstName) {
+				memcpy(t_firstName, t_names + 2,
+					t_nameTo - t_names - 4);
+				t_firstName[t_nameTo - t_names - 4] = '\0';
+				*v_firstName = t_firstName;
+			}
+		}
+
+		/* Add the value (which may be empty) to the array string */
+		if ((t_from < t_end) && (*t_from == '='))
+			t_from = certwatch_encodeParam(
+				t_from + 1, t_end, C_PARAM_END_VALUE, 0,
+				&t_valueTo
+			);
+		else {
+			memcpy(t_valueTo, "\"\",", 3);
+			t_valueTo += 3;
+		}
+
+		/* Skip the "&" character */
+		if (t_from < t_end)
+			t_from++;
+	}
+
+	if (t_output) {
+		memcpy(t_nameTo, "\"output\",", 9);
+		t_nameTo += 9;
+		t_valueTo = certwatch_parse_escapeArrayString(
+			t_valueTo, t_output
+		);
+		*(t_valueTo++) = ',';
+	}
+
+	/* Replace the trailing commas with closing braces */
+	if (t_nameTo > (t_names + 1)) {
+		*(t_nameTo - 1) = '}';
+		*t_nameTo = '\0';
+		*(t_valueTo - 1) = '}';
+		*t_valueTo = '\0';
+		*v_nameArray = t_names;
+		*v_valueArray = t_values;
+	}
+}
+
+
+/******************************************************************************
+ * certwatch_findHeaders()                                                    *
+ *   Finds the [BEGIN_HEADERS] block at the start of a function's response.   *
+ *                                                                            *
+ * IN:	v_response - the function's response.                                 *
+ * 	v_response_len - the length of v_response (in bytes).                 *
+ *                                                                            *
+ * OUT:	v_lines - the block's header lines.                                   *
+ * 	v_endOfHeaders - the block's closing marker.                          *
+ *                                                                            *
+ * Returns:	1 if a [BEGIN_HEADERS] block was found; otherwise 0.          *
+ ******************************************************************************/
+int certwatch_findHeaders(
+	char* const v_response,
+	const int v_response_len,
+	char** const v_lines,
+	char** const v_endOfHeaders
+)
+{
+	char* t_endOfHeaders;
+	const char* t_limit;
+
+	if (strncmp(v_response, C_HTTP_HEADERS, strlen(C_HTTP_HEADERS)))
+		return 0;
+	*v_lines = v_response + strlen(C_HTTP_HEADERS);
+
+	/* Look for the closing marker one line at a time, so that a response
+	  without one isn't scanned to the end */
+	t_limit = v_response + ((v_response_len < C_HTTP_HEADERS_MAX)
+					? v_response_len : C_HTTP_HEADERS_MAX);
+	for (t_endOfHeaders = *v_lines;
+			strncmp(t_endOfHeaders, C_HTTP_HEADERS_CLOSE,
+				strlen(C_HTTP_HEADERS_CLOSE));
+			t_endOfHeaders++) {
+		t_endOfHeaders = memchr(
+			t_endOfHeaders, '\n', t_limit - t_endOfHeaders
+		);
+		if (!t_endOfHeaders)
+			return 0;
+	}
+	*v_endOfHeaders = t_endOfHeaders;
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_nextHeader()                                                     *
+ *   Isolates the next "Name: value\n" line in a block of header lines.       *
+ *                                                                            *
+ * IN:	v_end - the end of the header lines.                                  *
+ *                                                                            *
+ * IN/OUT:	v_lines - the next header line (which is modified in place),  *
+ * 		which is advanced.                                            *
+ *                                                                            *
+ * OUT:	v_name - the header name.                                             *
+ * 	v_value - the header value.                                           *
+ *                                                                            *
+ * Returns:	1 if a header was isolated; 0 if there are no more.           *
+ ******************************************************************************/
+int certwatch_nextHeader(
+	char** const v_lines,
+	const char* const v_end,
+	char** const v_name,
+	char** const v_value
+)
+{
+	char* t_value;
+	char* t_next;
+
+	if (*v_lines >= v_end)
+		return 0;
+
+	/* Isolate the header name */
+	t_value = strchr(*v_lines, ':');
+	if (!t_value)
+		return 0;
+	*(t_value++) = '\0';
+	while (isspace((unsigned char)*t_value))
+		t_value++;
+
+	/* Isolate the header value */
+	t_next = strchr(t_value, '\n');
+	if (!t_next)
+		return 0;
+	*t_next = '\0';
+
+	*v_name = *v_lines;
+	*v_value = t_value;
+	*v_lines = t_next + 1;
+
+	return 1;
+}
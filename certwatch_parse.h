@@ -0,0 +1,96 @@
+/* certwatch_parse.h - Request and response parsing for mod_certwatch
+ * Written by Rob Stradling
+ * Copyright (C) 2015-2026 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CERTWATCH_PARSE_H
+#define CERTWATCH_PARSE_H
+
+#include <stddef.h>
+
+
+/* These functions depend on neither httpd nor APR, so that they can also be
+  linked into certwatch_bench.  Memory is obtained from a tCertWatchAlloc,
+  which inside httpd allocates from a pool */
+typedef void* (*tCertWatchAlloc)(void* v_baton, size_t v_size);
+
+
+/* Typedef for a request body that is being read */
+#define C_BODY_OK		0
+#define C_BODY_TOO_LARGE	1
+#define C_BODY_NO_MEMORY	2
+
+typedef struct tCertWatchBody {
+	tCertWatchAlloc m_alloc;
+	void* m_baton;
+	unsigned char* m_data;		/* NUL-terminated */
+	size_t m_size;			/* Bytes */
+	size_t m_capacity;		/* Bytes, excluding the NUL */
+	size_t m_maxSize;		/* Bytes; 0 = unlimited */
+} tCertWatchBody;
+
+int certwatch_body_init(
+	tCertWatchBody* v_body,
+	tCertWatchAlloc v_alloc,
+	void* v_baton,
+	size_t v_capacity,
+	size_t v_maxSize
+);
+
+int certwatch_body_append(
+	tCertWatchBody* v_body,
+	const char* v_data,
+	size_t v_size
+);
+
+
+char* certwatch_parse_escapeArrayString(
+	char* v_to,
+	const char* v_from
+);
+
+void certwatch_parse_makeParamArrays(
+	tCertWatchAlloc v_alloc,
+	void* v_baton,
+	const char* v_outputPath,
+	const char* v_urlEncodedData,
+	char** v_nameArray,
+	char** v_valueArray,
+	const char** v_firstName
+);
+
+
+/* A function's response may start with a block of HTTP headers */
+#define C_HTTP_HEADERS		"[BEGIN_HEADERS]\n"
+#define C_HTTP_HEADERS_CLOSE	"[END_HEADERS]\n"
+#define C_HTTP_HEADERS_MAX	65536	/* Longest block that's looked for */
+
+int certwatch_findHeaders(
+	char* v_response,
+	int v_response_len,
+	char** v_lines,
+	char** v_endOfHeaders
+);
+
+int certwatch_nextHeader(
+	char** v_lines,
+	const char* v_end,
+	char** v_name,
+	char** v_value
+);
+
+
+#endif
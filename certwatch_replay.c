@@ -0,0 +1,715 @@
+/* certwatch_replay - Replays a mod_certwatch traffic capture
+ * Written by Rob Stradling
+ * Copyright (C) 2015-2026 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replays the requests in a capture file (see CertWatchCapture) at their
+  original pace, or faster, either against an httpd that runs mod_certwatch
+  or directly against the PostgreSQL database, and reports the throughput and
+  latency percentiles alongside the latencies that were captured:
+
+	certwatch_replay [-s speedup] [-c concurrency] [-n count]
+		(-u http://host[:port] | -d conninfo) capture_file
+
+  Requests are started on schedule (an open loop), whether or not earlier
+  ones have finished, so long as one of the "concurrency" threads is free;
+  how late they start is reported as the schedule lag.  A speedup of 0
+  starts each request as soon as a thread is free */
+
+#define _POSIX_C_SOURCE	200809L
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* PostgreSQL include files */
+#include "libpq-fe.h"
+
+#include "certwatch_capture.h"
+#include "certwatch_parse.h"
+
+
+/* Typedef for a captured request */
+typedef struct tReplayRecord {
+	uint64_t m_time;		/* Microseconds since the epoch */
+	int m_method;			/* C_CAPTURE_METHOD_* */
+	int m_status;
+	uint32_t m_phases[C_CAPTURE_PHASES];	/* Microseconds */
+	char* m_string[C_CAPTURE_STRINGS];	/* C_CAPTURE_STRING_* */
+} tReplayRecord;
+
+
+/* Typedef for the outcome of replaying a request */
+typedef struct tReplayResult {
+	uint64_t m_latency;		/* Microseconds */
+	uint64_t m_lag;			/* Microseconds */
+	int m_status;			/* 0 = failed */
+} tReplayResult;
+
+
+static tReplayRecord* g_records = NULL;
+static tReplayResult* g_results = NULL;
+static size_t g_nRecords = 0;
+static size_t g_next = 0;
+static pthread_mutex_t g_nextMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_startedAt = 0;
+static double g_speedup = 1.0;
+static const char* g_host = NULL;
+static struct addrinfo* g_addrinfo = NULL;
+static const char* g_connInfo = NULL;
+
+
+/******************************************************************************
+ * replay_now()                                                               *
+ *                                                                            *
+ * Returns:	the monotonic clock, in microseconds.                         *
+ ******************************************************************************/
+static uint64_t replay_now(void)
+{
+	struct timespec t_now;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_now);
+
+	return ((uint64_t)t_now.tv_sec * 1000000) + (t_now.tv_nsec / 1000);
+}
+
+
+/******************************************************************************
+ * replay_get32()                                                             *
+ *                                                                            *
+ * IN:	v_from - pointer to a big-endian 32-bit integer.                      *
+ *                                                                            *
+ * Returns:	the integer.                                                  *
+ ******************************************************************************/
+static uint32_t replay_get32(
+	const unsigned char* const v_from
+)
+{
+	return ((uint32_t)v_from[0] << 24) | ((uint32_t)v_from[1] << 16)
+		| ((uint32_t)v_from[2] << 8) | v_from[3];
+}
+
+
+/******************************************************************************
+ * replay_load()                                                              *
+ *   Reads all of the records in a capture file.  A truncated final record    *
+ * (e.g. because httpd is still writing the file) is ignored.                 *
+ *                                                                            *
+ * IN:	v_fileName - the capture file's name.                                 *
+ * 	v_maxRecords - the number of records to read (0 = all).               *
+ *                                                                            *
+ * Returns:	0 on success; -1 on failure.                                  *
+ ******************************************************************************/
+static int replay_load(
+	const char* const v_fileName,
+	const size_t v_maxRecords
+)
+{
+	FILE* t_file = fopen(v_fileName, "rb");
+	unsigned char t_magic[C_CAPTURE_MAGIC_SIZE];
+	unsigned char t_length[4];
+	unsigned char* t_record = NULL;
+	const unsigned char* t_from;
+	const unsigned char* t_end;
+	size_t t_allocated = 0;
+	uint32_t t_recordLength;
+	uint32_t t_stringLength;
+	tReplayRecord* t_replayRecord;
+	int i;
+
+	if (!t_file) {
+		fprintf(stderr, "%s: %s\n", v_fileName, strerror(errno));
+		return -1;
+	}
+	if ((fread(t_magic, 1, sizeof(t_magic), t_file) != sizeof(t_magic))
+			|| memcmp(t_magic, C_CAPTURE_MAGIC, sizeof(t_magic))) {
+		fprintf(stderr, "%s: Not a capture file\n", v_fileName);
+		fclose(t_file);
+		return -1;
+	}
+
+	t_record = malloc(C_CAPTURE_RECORD_MAX);
+	while (((!v_maxRecords) || (g_nRecords < v_maxRecords))
+			&& (fread(t_length, 1, 4, t_file) == 4)) {
+		t_recordLength = replay_get32(t_length);
+		if ((t_recordLength < (C_CAPTURE_FIXED_SIZE - 4))
+				|| (t_recordLength > C_CAPTURE_RECORD_MAX)) {
+			fprintf(stderr, "%s: Corrupt record\n", v_fileName);
+			break;
+		}
+		if (fread(t_record, 1, t_recordLength, t_file)
+				!= t_recordLength)
+			break;
+
+		if (g_nRecords == t_allocated) {
+			t_allocated = t_allocated ? (t_allocated * 2) : 1024;
+			g_records = realloc(
+				g_records, t_allocated * sizeof(*g_records)
+			);
+		}
+		t_replayRecord = &g_records[g_nRecords];
+		memset(t_replayRecord, 0, sizeof(*t_replayRecord));
+
+		t_from = t_record;
+		t_end = t_record + t_recordLength;
+		t_replayRecord->m_time = ((uint64_t)replay_get32(t_from) << 32)
+					| replay_get32(t_from + 4);
+		t_replayRecord->m_method = t_from[8];
+		t_replayRecord->m_status = (t_from[10] << 8) | t_from[11];
+		t_from += 20;		/* Skip the response size */
+		for (i = 0; i < C_CAPTURE_PHASES; i++, t_from += 4)
+			t_replayRecord->m_phases[i] = replay_get32(t_from);
+
+		for (i = 0; i < C_CAPTURE_STRINGS; i++) {
+			if ((t_end - t_from) < 4)
+				break;
+			t_stringLength = replay_get32(t_from);
+			t_from += 4;
+			if (t_stringLength > (size_t)(t_end - t_from))
+				break;
+			t_replayRecord->m_string[i] = malloc(
+				t_stringLength + 1
+			);
+			memcpy(t_replayRecord->m_string[i], t_from,
+				t_stringLength);
+			t_replayRecord->m_string[i][t_stringLength] = '\0';
+			t_from += t_stringLength;
+		}
+		if (i < C_CAPTURE_STRINGS) {
+			fprintf(stderr, "%s: Corrupt record\n", v_fileName);
+			break;
+		}
+
+		g_nRecords++;
+	}
+
+	free(t_record);
+	fclose(t_file);
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * replay_arrayNext()                                                         *
+ *   Extracts the next element from a PostgreSQL array string in which every  *
+ * element is quoted (as made by certwatch_parse_makeParamArrays()).          *
+ *                                                                            *
+ * IN/OUT:	v_from - position in the array string, which is advanced.     *
+ *                                                                            *
+ * OUT:	v_to - the unescaped element (with room for the whole array string). *
+ *                                                                            *
+ * Returns:	1 if an element was extracted; 0 if there are no more.        *
+ ******************************************************************************/
+static int replay_arrayNext(
+	const char** const v_from,
+	char* v_to
+)
+{
+	const char* t_from = *v_from;
+
+	while (*t_from && (*t_from != '"'))
+		t_from++;
+	if (!*(t_from++))
+		return 0;
+
+	while (*t_from && (*t_from != '"')) {
+		if ((*t_from == '\\') && t_from[1])
+			t_from++;
+		*(v_to++) = *(t_from++);
+	}
+	*v_to = '\0';
+	*v_from = *t_from ? (t_from + 1) : t_from;
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * replay_urlEncode()                                                         *
+ *   Appends a URL-encoded string to a buffer.                                *
+ *                                                                            *
+ * IN:	v_from - the string.                                                  *
+ *                                                                            *
+ * IN/OUT:	v_to - output position (with room for 3 bytes per input      *
+ * 		byte), which is advanced.                                     *
+ ******************************************************************************/
+static void replay_urlEncode(
+	const char* v_from,
+	char** const v_to
+)
+{
+	static const char t_hex[] = "0123456789ABCDEF";
+	char* t_to = *v_to;
+
+	for (; *v_from; v_from++) {
+		unsigned char t_char = (unsigned char)*v_from;
+		if ((t_char >= 'a' && t_char <= 'z')
+				|| (t_char >= 'A' && t_char <= 'Z')
+				|| (t_char >= '0' && t_char <= '9')
+				|| strchr("-._~", t_char))
+			*(t_to++) = (char)t_char;
+		else {
+			*(t_to++) = '%';
+			*(t_to++) = t_hex[t_char >> 4];
+			*(t_to++) = t_hex[t_char & 0x0F];
+		}
+	}
+
+	*v_to = t_to;
+}
+
+
+/******************************************************************************
+ * replay_makeBody()                                                          *
+ *   Recreates a POST request's URL-encoded body from its parameter arrays,   *
+ * leaving out the "output" parameters that mod_certwatch added because of    *
+ * the Accept header or the path.                                             *
+ *                                                                            *
+ * IN:	v_record - the captured request.                                      *
+ *                                                                            *
+ * Returns:	the body (which the caller must free).                        *
+ ******************************************************************************/
+static char* replay_makeBody(
+	const tReplayRecord* const v_record
+)
+{
+	const char* t_names = v_record->m_string[C_CAPTURE_STRING_NAMES];
+	const char* t_values = v_record->m_string[C_CAPTURE_STRING_VALUES];
+	const char* t_uri = v_record->m_string[C_CAPTURE_STRING_URI];
+	const char* t_accept = v_record->m_string[C_CAPTURE_STRING_ACCEPT];
+	size_t t_size = (3 * (strlen(t_names) + strlen(t_values))) + 1;
+	char* t_body = malloc(t_size);
+	char* t_name = malloc(t_size);
+	char* t_value = malloc(t_size);
+	char* t_to = t_body;
+	const char* t_from = t_names;
+	int t_skipFirst = !strcmp(t_accept, "application/json");
+	int t_skipLast = (strlen(t_uri) > 1) && !strstr(t_uri, "/?");
+	int t_count = 0;
+	int i;
+
+	while (replay_arrayNext(&t_from, t_name))
+		t_count++;
+
+	for (i = 0; replay_arrayNext(&t_names, t_name)
+			&& replay_arrayNext(&t_values, t_value); i++) {
+		if ((((i == 0) && t_skipFirst)
+					|| ((i == (t_count - 1)) && t_skipLast))
+				&& !strcmp(t_name, "output"))
+			continue;
+		if (t_to > t_body)
+			*(t_to++) = '&';
+		replay_urlEncode(t_name, &t_to);
+		*(t_to++) = '=';
+		replay_urlEncode(t_value, &t_to);
+	}
+	*t_to = '\0';
+
+	free(t_name);
+	free(t_value);
+
+	return t_body;
+}
+
+
+/******************************************************************************
+ * replay_http()                                                              *
+ *   Replays a request against httpd, over a new connection.                  *
+ *                                                                            *
+ * IN:	v_record - the captured request.                                      *
+ *                                                                            *
+ * Returns:	the HTTP status; or 0 on failure.                             *
+ ******************************************************************************/
+static int replay_http(
+	const tReplayRecord* const v_record
+)
+{
+	const char* t_accept = v_record->m_string[C_CAPTURE_STRING_ACCEPT];
+	char* t_body = NULL;
+	char* t_request;
+	char t_response[16384];
+	size_t t_length;
+	size_t t_sent;
+	ssize_t t_result;
+	int t_status = 0;
+	int t_socket;
+
+	if (v_record->m_method == C_CAPTURE_METHOD_POST)
+		t_body = replay_makeBody(v_record);
+
+	t_length = strlen(v_record->m_string[C_CAPTURE_STRING_URI])
+			+ strlen(g_host) + strlen(t_accept)
+			+ (t_body ? strlen(t_body) : 0) + 256;
+	t_request = malloc(t_length);
+	t_length = snprintf(
+		t_request, t_length, "%s %s HTTP/1.0\r\nHost: %s\r\n%s%s%s",
+		t_body ? "POST" : "GET",
+		v_record->m_string[C_CAPTURE_STRING_URI], g_host,
+		*t_accept ? "Accept: " : "", t_accept,
+		*t_accept ? "\r\n" : ""
+	);
+	if (t_body)
+		t_length += sprintf(
+			t_request + t_length,
+			"Content-Type: application/x-www-form-urlencoded\r\n"
+			"Content-Length: %zu\r\n\r\n%s", strlen(t_body), t_body
+		);
+	else
+		t_length += sprintf(t_request + t_length, "\r\n");
+
+	t_socket = socket(
+		g_addrinfo->ai_family, g_addrinfo->ai_socktype,
+		g_addrinfo->ai_protocol
+	);
+	if ((t_socket < 0) || (connect(
+			t_socket, g_addrinfo->ai_addr, g_addrinfo->ai_addrlen
+		) != 0))
+		goto label_return;
+
+	for (t_sent = 0; t_sent < t_length; t_sent += t_result) {
+		t_result = send(
+			t_socket, t_request + t_sent, t_length - t_sent, 0
+		);
+		if (t_result <= 0)
+			goto label_return;
+	}
+
+	/* Read the whole response, and parse the status line */
+	t_length = 0;
+	do {
+		t_result = recv(
+			t_socket, t_response + t_length,
+			sizeof(t_response) - 1 - t_length, 0
+		);
+		if (t_result < 0)
+			goto label_return;
+		if (t_length < 16)
+			t_length += t_result;
+	} while (t_result > 0);
+	t_response[t_length] = '\0';
+	if (!strncmp(t_response, "HTTP/", 5) && strchr(t_response, ' '))
+		t_status = atoi(strchr(t_response, ' ') + 1);
+
+label_return:
+	if (t_socket >= 0)
+		close(t_socket);
+	free(t_request);
+	free(t_body);
+
+	return t_status;
+}
+
+
+/******************************************************************************
+ * replay_pg()                                                                *
+ *   Replays a request directly against the database, by calling web_apis()   *
+ * (or web_apis_test()) with the captured parameters.                         *
+ *                                                                            *
+ * IN:	v_PGconn - the thread's database connection.                          *
+ * 	v_record - the captured request.                                      *
+ *                                                                            *
+ * Returns:	the status that mod_certwatch would have sent: 404 if there   *
+ *		was no response, the Status header in the response's          *
+ *		[BEGIN_HEADERS] block if there is one, or else 200; or 0 on   *
+ *		failure.                                                      *
+ ******************************************************************************/
+static int replay_pg(
+	PGconn* const v_PGconn,
+	const tReplayRecord* const v_record
+)
+{
+	const char* t_paramValues[3];
+	char* t_response;
+	char* t_lines;
+	char* t_endOfHeaders;
+	char* t_name;
+	char* t_value;
+	PGresult* t_PGresult;
+	int t_status = 0;
+
+	t_paramValues[0] = v_record->m_string[C_CAPTURE_STRING_FUNCTION];
+	t_paramValues[1] = *v_record->m_string[C_CAPTURE_STRING_NAMES]
+			? v_record->m_string[C_CAPTURE_STRING_NAMES] : NULL;
+	t_paramValues[2] = *v_record->m_string[C_CAPTURE_STRING_VALUES]
+			? v_record->m_string[C_CAPTURE_STRING_VALUES] : NULL;
+
+	t_PGresult = PQexecParams(
+		v_PGconn,
+		strncmp(v_record->m_string[C_CAPTURE_STRING_URI],
+				"/_ROB_IS_TESTING_/", 18)
+			? "SELECT web_apis($1,$2,$3)"
+			: "SELECT web_apis_test($1,$2,$3)",
+		3, NULL, t_paramValues, NULL, NULL, 0
+	);
+	if (PQresultStatus(t_PGresult) != PGRES_TUPLES_OK)
+		t_status = 0;
+	else if ((PQntuples(t_PGresult) < 1)
+			|| (PQgetlength(t_PGresult, 0, 0) == 0))
+		t_status = 404;
+	else {
+		/* Look for a Status header in the [BEGIN_HEADERS] block, as
+		  certwatch_applyHeaderLines() would see it */
+		t_status = 200;
+		t_response = PQgetvalue(t_PGresult, 0, 0);
+		if (certwatch_findHeaders(
+				t_response, PQgetlength(t_PGresult, 0, 0),
+				&t_lines, &t_endOfHeaders))
+			while (certwatch_nextHeader(
+					&t_lines, t_endOfHeaders, &t_name,
+					&t_value))
+				if (!strcasecmp(t_name, "Status")
+						&& (atoi(t_value) > 0))
+					t_status = atoi(t_value);
+	}
+	PQclear(t_PGresult);
+
+	return t_status;
+}
+
+
+/******************************************************************************
+ * replay_thread()                                                            *
+ *   Replays requests, each at its scheduled time, until there are none left.*
+ *                                                                            *
+ * Returns:	NULL.                                                         *
+ ******************************************************************************/
+static void* replay_thread(
+	void* const v_unused
+)
+{
+	PGconn* t_PGconn = NULL;
+	struct timespec t_sleep;
+	uint64_t t_due;
+	uint64_t t_now;
+	size_t t_index;
+
+	if (g_connInfo) {
+		t_PGconn = PQconnectdb(g_connInfo);
+		if (PQstatus(t_PGconn) != CONNECTION_OK) {
+			fprintf(stderr, "%s", PQerrorMessage(t_PGconn));
+			PQfinish(t_PGconn);
+			return NULL;
+		}
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&g_nextMutex);
+		t_index = g_next++;
+		pthread_mutex_unlock(&g_nextMutex);
+		if (t_index >= g_nRecords)
+			break;
+
+		t_due = g_startedAt;
+		if (g_speedup > 0)
+			t_due += (uint64_t)((g_records[t_index].m_time
+						- g_records[0].m_time)
+					/ g_speedup);
+		t_now = replay_now();
+		if (t_now < t_due) {
+			t_sleep.tv_sec = (t_due - t_now) / 1000000;
+			t_sleep.tv_nsec = ((t_due - t_now) % 1000000) * 1000;
+			nanosleep(&t_sleep, NULL);
+			t_now = replay_now();
+		}
+		g_results[t_index].m_lag = t_now - t_due;
+
+		g_results[t_index].m_status = t_PGconn
+			? replay_pg(t_PGconn, &g_records[t_index])
+			: replay_http(&g_records[t_index]);
+		g_results[t_index].m_latency = replay_now() - t_now;
+	}
+
+	if (t_PGconn)
+		PQfinish(t_PGconn);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * replay_compare()                                                           *
+ *   qsort() comparison function for latencies.                               *
+ ******************************************************************************/
+static int replay_compare(
+	const void* const v_a,
+	const void* const v_b
+)
+{
+	const uint64_t t_a = *(const uint64_t*)v_a;
+	const uint64_t t_b = *(const uint64_t*)v_b;
+
+	return (t_a > t_b) - (t_a < t_b);
+}
+
+
+/******************************************************************************
+ * replay_printPercentiles()                                                  *
+ *   Sorts some latencies and prints their percentiles, in milliseconds.      *
+ *                                                                            *
+ * IN:	v_label - what the latencies are.                                     *
+ * 	v_latencies - the latencies (in microseconds).                        *
+ * 	v_count - the number of latencies.                                    *
+ ******************************************************************************/
+static void replay_printPercentiles(
+	const char* const v_label,
+	uint64_t* const v_latencies,
+	const size_t v_count
+)
+{
+	static const double t_percentiles[] = { 50, 90, 99, 99.9 };
+	size_t i;
+
+	if (!v_count)
+		return;
+
+	qsort(v_latencies, v_count, sizeof(*v_latencies), replay_compare);
+	printf("%-10s", v_label);
+	for (i = 0; i < (sizeof(t_percentiles) / sizeof(*t_percentiles)); i++)
+		printf(" %10.3f", v_latencies[
+			(size_t)((t_percentiles[i] / 100) * (v_count - 1))
+		] / 1000.0);
+	printf(" %10.3f\n", v_latencies[v_count - 1] / 1000.0);
+}
+
+
+/******************************************************************************
+ * replay_usage()                                                             *
+ ******************************************************************************/
+static int replay_usage(
+	const char* const v_program
+)
+{
+	fprintf(stderr,
+		"Usage: %s [-s speedup] [-c concurrency] [-n count]\n"
+		"\t(-u http://host[:port] | -d conninfo) capture_file\n",
+		v_program
+	);
+
+	return 2;
+}
+
+
+/******************************************************************************
+ * main()                                                                     *
+ ******************************************************************************/
+int main(
+	int argc,
+	char** argv
+)
+{
+	struct addrinfo t_hints;
+	pthread_t* t_threads;
+	uint64_t* t_latencies;
+	uint64_t t_elapsed;
+	char* t_port;
+	int t_concurrency = 16;
+	size_t t_maxRecords = 0;
+	size_t t_nFailed = 0;
+	size_t t_nMismatched = 0;
+	size_t t_count;
+	size_t i;
+	int t_option;
+
+	while ((t_option = getopt(argc, argv, "s:c:n:u:d:")) != -1) {
+		switch (t_option) {
+			case 's':	g_speedup = atof(optarg);	break;
+			case 'c':	t_concurrency = atoi(optarg);	break;
+			case 'n':	t_maxRecords = atol(optarg);	break;
+			case 'u':	g_host = optarg;		break;
+			case 'd':	g_connInfo = optarg;		break;
+			default:	return replay_usage(argv[0]);
+		}
+	}
+	if ((optind != (argc - 1)) || ((!g_host) == (!g_connInfo))
+			|| (g_speedup < 0) || (t_concurrency <= 0))
+		return replay_usage(argv[0]);
+
+	if (g_host) {
+		if (strncmp(g_host, "http://", 7))
+			return replay_usage(argv[0]);
+		g_host = strdup(g_host + 7);
+		g_host = strtok((char*)g_host, "/");
+		if (!g_host)
+			return replay_usage(argv[0]);
+		memset(&t_hints, 0, sizeof(t_hints));
+		t_hints.ai_family = AF_UNSPEC;
+		t_hints.ai_socktype = SOCK_STREAM;
+		t_port = strrchr(g_host, ':');
+		if (getaddrinfo(
+				t_port ? strndup(g_host, t_port - g_host)
+					: g_host,
+				t_port ? (t_port + 1) : "80", &t_hints,
+				&g_addrinfo) != 0) {
+			fprintf(stderr, "%s: Unknown host\n", g_host);
+			return 1;
+		}
+	}
+
+	if (replay_load(argv[optind], t_maxRecords) != 0)
+		return 1;
+	if (!g_nRecords) {
+		fprintf(stderr, "%s: No requests\n", argv[optind]);
+		return 1;
+	}
+
+	/* Replay the requests */
+	g_results = calloc(g_nRecords, sizeof(*g_results));
+	t_threads = calloc(t_concurrency, sizeof(*t_threads));
+	g_startedAt = replay_now();
+	for (i = 0; i < (size_t)t_concurrency; i++)
+		pthread_create(&t_threads[i], NULL, replay_thread, NULL);
+	for (i = 0; i < (size_t)t_concurrency; i++)
+		pthread_join(t_threads[i], NULL);
+	t_elapsed = replay_now() - g_startedAt;
+
+	/* Report the results */
+	for (i = 0; i < g_nRecords; i++)
+		if (!g_results[i].m_status)
+			t_nFailed++;
+		else if (g_results[i].m_status != g_records[i].m_status)
+			t_nMismatched++;
+	printf(
+		"%zu requests in %.3fs (%.1f/s); %zu failed; %zu with a "
+		"different status than captured\n\n",
+		g_nRecords, t_elapsed / 1000000.0,
+		g_nRecords / (t_elapsed / 1000000.0), t_nFailed, t_nMismatched
+	);
+
+	printf("%-10s %10s %10s %10s %10s %10s\n", "(ms)", "p50", "p90",
+		"p99", "p99.9", "max");
+	t_latencies = calloc(g_nRecords, sizeof(*t_latencies));
+	for (i = 0, t_count = 0; i < g_nRecords; i++)
+		if (g_results[i].m_status)
+			t_latencies[t_count++] = g_results[i].m_latency;
+	replay_printPercentiles("replayed", t_latencies, t_count);
+	for (i = 0; i < g_nRecords; i++)
+		t_latencies[i] = g_records[i].m_phases[C_CAPTURE_PHASE_TOTAL];
+	replay_printPercentiles("captured", t_latencies, g_nRecords);
+	for (i = 0; i < g_nRecords; i++)
+		t_latencies[i] = g_results[i].m_lag;
+	replay_printPercentiles("lag", t_latencies, g_nRecords);
+
+	return t_nFailed ? 1 : 0;
+}
@@ -16,46 +16,546 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
+
+/* Compression libraries.  gzip is always available; brotli and zstd are
+  used if the Makefile finds them */
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 /* Apache 2.0 include files */
+#include "apr_date.h"
+#include "apr_global_mutex.h"
 #include "apr_lib.h"
+#include "apr_hash.h"
+#include "apr_portable.h"
+#include "apr_reslist.h"
+#include "apr_sha1.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
 #include "apr_strings.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_pool.h"
+#include "apr_thread_proc.h"
+#include "ap_mpm.h"
+#include "ap_provider.h"
+#include "ap_socache.h"
 #include "httpd.h"
 #include "http_config.h"
 #include "http_log.h"
+#include "http_connection.h"
 #include "http_protocol.h"
+#include "mpm_common.h"
+#include "util_mutex.h"
 
 /* PostgreSQL include files */
 #include "libpq-fe.h"
 
+#include "certwatch_capture.h"
+#include "certwatch_parse.h"
+
 
 #if (AP_SERVER_MAJORVERSION_NUMBER == 2) && (AP_SERVER_MINORVERSION_NUMBER < 4)
 	#define useragent_ip	connection->remote_ip
 #endif
 
 
+/* Content codings that responses may be compressed with */
+#define C_ENCODING_IDENTITY	0
+#define C_ENCODING_GZIP		1
+#define C_ENCODING_BROTLI	2
+#define C_ENCODING_ZSTD		3
+#define C_ENCODING_COUNT	4
+
+static const char* const g_encodingName[C_ENCODING_COUNT] = {
+	"identity", "gzip", "br", "zstd"
+};
+
+
 /* Typedef for per-directory configuration information */
 typedef struct tCertWatchDirConfig {
 	char* m_connInfo;
+	int m_connMin;		/* Idle connections to keep open */
+	int m_connMax;		/* 0 = ThreadsPerChild */
+	int m_connIdleTTL;	/* Seconds */
+	int m_maxBodySize;	/* Bytes; 0 = unlimited */
+	int m_prepare;		/* Use prepared statements? */
+	int m_stream;		/* Use web_apis_stream()? */
+	apr_array_header_t* m_cacheFunctions;	/* NULL = all */
+	int m_cacheMaxObjectSize;	/* Bytes */
+	int m_cacheMaxTTL;		/* Seconds; 0 = don't cache */
+	int m_coalesceWait;		/* Milliseconds */
+	int m_queryTimeout;		/* Seconds; 0 = no timeout */
+	int m_admitWait;		/* Milliseconds */
+	int m_admitRetryAfter;		/* Seconds */
+	apr_array_header_t* m_replicaConnInfos;	/* NULL = no replicas */
+	apr_array_header_t* m_primaryFunctions;	/* NULL = none */
+	int m_replicaMaxLag;		/* Seconds */
+	int m_replicaCheckInterval;	/* Seconds */
+	int m_spoolThreshold;		/* Bytes; 0 = don't spool */
+	char* m_spoolDir;		/* NULL = system temp directory */
+	int m_framed;			/* Use web_apis_framed()? */
+	int m_batchMaxItems;		/* Sub-requests per batch */
+	int m_async;			/* Suspend requests during queries? */
+	int m_shadowSample;		/* Mirror 1 in this many; 0 = none */
+	int m_compress[C_ENCODING_COUNT];	/* C_ENCODING_*, best first */
+	int m_nCompress;		/* 0 = don't compress */
+	int m_compressLevel[C_ENCODING_COUNT];
+	int m_compressMinSize;		/* Bytes */
 } tCertWatchDirConfig;
 
 
+/* Typedef for per-server configuration information */
+typedef struct tCertWatchServerConfig {
+	const ap_socache_provider_t* m_cacheProvider;
+	ap_socache_instance_t* m_cacheInstance;
+	int m_coalesceSlots;	/* 0 = don't coalesce */
+	apr_array_header_t* m_admitLimits;	/* tCertWatchAdmitLimit */
+	int m_metricsSlots;	/* 0 = no metrics */
+	apr_array_header_t* m_metricsApis;	/* const char*; NULL = none */
+	int m_rateSlots;	/* 0 = no rate limiting */
+	apr_uint32_t m_rateRate;	/* Tokens per second */
+	apr_uint32_t m_rateBurst;	/* Tokens */
+	apr_array_header_t* m_rateCosts;	/* tCertWatchRateCost */
+	int m_ratePrefix4;	/* Bits of an IPv4 address to key on */
+	int m_ratePrefix6;	/* Bits of an IPv6 address to key on */
+	const char* m_captureFile;	/* NULL = don't capture */
+	int m_captureSample;	/* Capture 1 in this many requests */
+	int m_captureSlots;	/* Records buffered per child */
+	int m_shadowThreads;	/* Shadow request threads per child */
+	int m_shadowQueue;	/* Shadow requests that may wait */
+} tCertWatchServerConfig;
+
+
+/* Typedef for a pooled PostgreSQL connection */
+typedef struct tCertWatchConn {
+	apr_pool_t* m_pool;
+	PGconn* m_PGconn;
+	unsigned int m_prepared;	/* Bitmask of C_STMT_* */
+	unsigned int m_sent;		/* Bitmask of C_STMT_* run so far */
+	apr_time_t m_idleSince;		/* 0 = never released */
+} tCertWatchConn;
+
+
+/* Typedef for the state of a query that is in progress */
+typedef struct tCertWatchQuery {
+	request_rec* m_request;		/* NULL = no client to watch */
+	tCertWatchConn* m_conn;
+	apr_time_t m_startedAt;
+	apr_time_t m_deadline;		/* 0 = no timeout */
+	int m_clientFd;			/* -1 = not watched */
+	int m_cancelled;		/* C_CANCEL_* */
+} tCertWatchQuery;
+
+#define C_CANCEL_NONE		0
+#define C_CANCEL_TIMEOUT	1
+#define C_CANCEL_CLIENT_GONE	2
+
+
+/* Statements that are prepared once per connection.  The client's IP
+  address and request line are passed as $4 and recorded as
+  application_name (and in the server log's statement parameters), so that
+  the statement text itself never varies.  The setting is local to the
+  statement's transaction, so an idle pooled connection reverts to its own
+  application_name instead of showing the last request's client */
+#define C_STMT_WEB_APIS			0
+#define C_STMT_WEB_APIS_TEST		1
+#define C_STMT_WEB_APIS_STREAM		2
+#define C_STMT_WEB_APIS_STREAM_TEST	3
+#define C_STMT_WEB_APIS_FRAMED		4
+#define C_STMT_WEB_APIS_FRAMED_TEST	5
+#define C_STMT_COUNT			6
+
+/* Each *_TEST statement immediately follows its non-test counterpart */
+#define C_STMT_TEST_OFFSET		1
+
+static const char* const g_stmtName[C_STMT_COUNT] = {
+	"certwatch_web_apis",
+	"certwatch_web_apis_test",
+	"certwatch_web_apis_stream",
+	"certwatch_web_apis_stream_test",
+	"certwatch_web_apis_framed",
+	"certwatch_web_apis_framed_test"
+};
+
+static const char* const g_stmtSQL[C_STMT_COUNT] = {
+	"SELECT web_apis($1,$2,$3)"
+		" FROM set_config('application_name',$4,true)",
+	"SELECT web_apis_test($1,$2,$3)"
+		" FROM set_config('application_name',$4,true)",
+	/* Set-returning variants, which return the response in chunks */
+	"SELECT web_apis_stream($1,$2,$3)"
+		" FROM set_config('application_name',$4,true)",
+	"SELECT web_apis_stream_test($1,$2,$3)"
+		" FROM set_config('application_name',$4,true)",
+	/* Variants that return a (headers text[], body bytea) composite, which
+	  is fetched in binary */
+	"SELECT web_apis_framed($1,$2,$3)"
+		" FROM set_config('application_name',$4,true)",
+	"SELECT web_apis_framed_test($1,$2,$3)"
+		" FROM set_config('application_name',$4,true)"
+};
+
+static const int g_stmtResultFormat[C_STMT_COUNT] = {
+	0, 0, 0, 0, 1, 1
+};
+
+
+/* Typedef for a per-child pool of connections that share a ConnInfo.  The
+  routing state is updated atomically, since it's shared by every thread */
+typedef struct tCertWatchConnPool {
+	const char* m_connInfo;
+	apr_reslist_t* m_reslist;
+	int m_isReplica;
+	volatile apr_uint32_t m_outstanding;	/* Requests in progress */
+	volatile apr_uint32_t m_healthy;	/* 0 = out of rotation */
+	volatile apr_uint32_t m_checking;	/* 1 = health check running */
+	volatile apr_uint64_t m_nextCheck;	/* apr_time_t */
+} tCertWatchConnPool;
+
+
+/* How far a replica is behind the primary, in seconds.  A replica that has
+  replayed everything it has received is treated as current, since the
+  primary may simply have been idle */
+#define C_REPLICA_LAG_SQL						\
+	"SELECT CASE WHEN NOT pg_is_in_recovery()"			\
+		" OR pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn()" \
+		" THEN 0"						\
+		" ELSE coalesce(extract(epoch FROM"			\
+			" now() - pg_last_xact_replay_timestamp()), 0)"	\
+		" END"
+
+/* How long a replica has to answer C_REPLICA_LAG_SQL */
+#define C_REPLICA_CHECK_TIMEOUT	apr_time_from_sec(2)
+
+/* Nodes to try before giving up on a query */
+#define C_ROUTE_ATTEMPTS	3
+
+
+/* Typedef for a request coalescing slot, in shared memory.  A leader whose
+  response can't be shared (it's private, or too big to store) marks its key
+  as unshareable for a while, so that identical requests don't wait for it */
+typedef struct tCertWatchCoalesceSlot {
+	volatile apr_uint64_t m_keyHash;	/* 0 = free */
+	volatile apr_uint64_t m_unshareable;	/* Key hash; 0 = none */
+	volatile apr_uint64_t m_unshareableUntil;	/* apr_time_t */
+} tCertWatchCoalesceSlot;
+
+#define C_COALESCE_UNSHAREABLE_TTL	30	/* Seconds */
+
+
+/* Typedef for a request's coalescing state */
+typedef struct tCertWatchCoalesce {
+	tCertWatchCoalesceSlot* m_slot;
+	apr_uint64_t m_keyHash;
+} tCertWatchCoalesce;
+
+
+/* Typedef for an API's admission control limits */
+typedef struct tCertWatchAdmitLimit {
+	const char* m_apiName;		/* "*" = any other API */
+	apr_uint32_t m_maxActive;
+	apr_uint32_t m_maxQueued;
+} tCertWatchAdmitLimit;
+
+
+/* Typedef for an API's admission control counters, in shared memory.  Each
+  child also keeps its own share of every API's counters, so that when a
+  child dies mid-request the parent can release the slots it held */
+typedef struct tCertWatchAdmitSlot {
+	volatile apr_uint32_t m_active;
+	volatile apr_uint32_t m_queued;
+} tCertWatchAdmitSlot;
+
+
+/* Typedef for an API's rate limiting cost */
+typedef struct tCertWatchRateCost {
+	const char* m_apiName;		/* "*" = any other API */
+	apr_uint32_t m_cost;		/* Tokens; 0 = free */
+} tCertWatchRateCost;
+
+
+/* Typedef for a client's token bucket, in shared memory.  The state packs
+  the time of the last update (in milliseconds, modulo 2^36) above the number
+  of milli-tokens left, so that both change with a single CAS */
+typedef struct tCertWatchRateSlot {
+	volatile apr_uint64_t m_key;	/* 0 = free */
+	volatile apr_uint64_t m_state;	/* 0 = full */
+} tCertWatchRateSlot;
+
+#define C_RATE_TOKEN_BITS	28
+#define C_RATE_TOKEN_MASK	((APR_UINT64_C(1) << C_RATE_TOKEN_BITS) - 1)
+#define C_RATE_TIME_MASK	((APR_UINT64_C(1) << 36) - 1)
+#define C_RATE_MAX_BURST	(C_RATE_TOKEN_MASK / 1000)
+#define C_RATE_PROBES		4	/* Slots that a client may use */
+
+
+/* Typedef for a request's admission control state */
+typedef struct tCertWatchAdmit {
+	tCertWatchAdmitSlot* m_slot;
+	tCertWatchAdmitSlot* m_childSlot;	/* NULL = not tracked */
+	const tCertWatchAdmitLimit* m_limit;
+} tCertWatchAdmit;
+
+
+/* Request phases that are timed */
+#define C_PHASE_QUEUE		0	/* Waiting for admission */
+#define C_PHASE_CONNECT		1	/* Checking out a connection */
+#define C_PHASE_EXECUTE		2	/* Running web_apis() */
+#define C_PHASE_HEADERS		3	/* Parsing the response headers */
+#define C_PHASE_OUTPUT		4	/* Passing the response to the filters */
+#define C_PHASE_TOTAL		5
+/* Shadow requests' execution times, on the production and test functions */
+#define C_PHASE_SHADOW_PRODUCTION	6
+#define C_PHASE_SHADOW_TEST		7
+#define C_PHASE_COUNT		8
+
+static const char* const g_phaseName[C_PHASE_COUNT] = {
+	"queue", "connect", "execute", "headers", "output", "total",
+	"shadow_production", "shadow_test"
+};
+
+
+/* Latency histograms have log-linear buckets (like HdrHistogram's), with 4
+  buckets per doubling (i.e. within 25%) from 1us up to about 2 hours */
+#define C_HISTOGRAM_SUB_BITS	2
+#define C_HISTOGRAM_BUCKETS	128
+
+typedef struct tCertWatchHistogram {
+	volatile apr_uint64_t m_count;
+	volatile apr_uint64_t m_sum;		/* Microseconds */
+	volatile apr_uint64_t m_buckets[C_HISTOGRAM_BUCKETS];
+} tCertWatchHistogram;
+
+
+/* Typedef for an API's metrics, in shared memory.  The slots are named
+  (from CertWatchMetricsApis) before any child starts, since API names come
+  from clients; slot 0 collects every other API */
+#define C_METRICS_SLOT_FREE	0
+#define C_METRICS_SLOT_READY	1
+#define C_METRICS_NAME_SIZE	64
+
+typedef struct tCertWatchMetrics {
+	volatile apr_uint32_t m_state;	/* C_METRICS_SLOT_* */
+	volatile apr_uint32_t m_inFlight;
+	char m_apiName[C_METRICS_NAME_SIZE];
+	volatile apr_uint64_t m_requests;
+	volatile apr_uint64_t m_unavailable;	/* 503s */
+	volatile apr_uint64_t m_rateLimited;	/* 429s */
+	volatile apr_uint64_t m_bytesOut;
+	volatile apr_uint64_t m_shadowFailed;
+	volatile apr_uint64_t m_shadowDropped;	/* Shadow queue was full */
+	tCertWatchHistogram m_phases[C_PHASE_COUNT];
+} tCertWatchMetrics;
+
+
+/* Typedef for a request's own timings, which are also made available to the
+  access log via r->notes */
+typedef struct tCertWatchRequestStats {
+	tCertWatchMetrics* m_metrics;	/* NULL = no shared metrics */
+	apr_interval_time_t m_phases[C_PHASE_COUNT];	/* Microseconds */
+	unsigned int m_recorded;	/* Bitmask of C_PHASE_* */
+	const char* m_function;		/* NULL = not a web_apis() request */
+	const char* m_nameArray;
+	const char* m_valueArray;
+} tCertWatchRequestStats;
+
+static const char* const g_phaseNote[C_PHASE_COUNT] = {
+	"certwatch_queue_us", "certwatch_connect_us", "certwatch_exec_us",
+	"certwatch_headers_us", "certwatch_output_us", NULL, NULL, NULL
+};
+
+
+/* Typedef for the server-wide metrics, in shared memory, which are followed
+  by the per-API metrics */
+typedef struct tCertWatchMetricsHeader {
+	volatile apr_uint64_t m_connectFailures;
+	volatile apr_uint64_t m_retries;
+} tCertWatchMetricsHeader;
+
+
+/* Typedef for a buffered capture record.  A slot may be filled when its
+  sequence number equals the enqueue position, and emptied when it is one
+  more than that (as in Dmitry Vyukov's bounded queue) */
+typedef struct tCertWatchCaptureSlot {
+	volatile apr_uint32_t m_sequence;
+	apr_uint32_t m_length;		/* Bytes */
+	unsigned char m_data[C_CAPTURE_RECORD_MAX];
+} tCertWatchCaptureSlot;
+
+
+/* Typedef for a child's capture ring buffer, which any request thread may
+  add to without locking and which only the writer thread empties */
+#define C_CAPTURE_WRITE_SIZE	65536
+#define C_CAPTURE_IDLE_WAIT	100000	/* Microseconds */
+
+typedef struct tCertWatchCaptureRing {
+	tCertWatchCaptureSlot* m_slots;
+	apr_uint32_t m_mask;		/* Number of slots - 1 */
+	volatile apr_uint32_t m_enqueuePos;
+	apr_uint32_t m_dequeuePos;	/* Writer thread only */
+	volatile apr_uint32_t m_sampleCount;
+	volatile apr_uint32_t m_dropped;
+	volatile apr_uint32_t m_stop;
+	apr_thread_t* m_thread;
+	server_rec* m_server;
+} tCertWatchCaptureRing;
+
+
+/* Typedef for one sub-request of a batch request */
+typedef struct tCertWatchBatchItem {
+	const char* m_line;		/* e.g. "/?id=12345" */
+	const char* m_paramValues[4];
+	PGresult* m_PGresult;		/* NULL = not run */
+} tCertWatchBatchItem;
+
+
+/* Typedef for a request that's mirrored to a test function.  It's
+  allocated (along with copies of its parameters) by malloc(), since it
+  outlives the request */
+typedef struct tCertWatchShadow {
+	const tCertWatchDirConfig* m_dirConfig;
+	const char* m_connInfo;		/* Where the original query ran */
+	int m_isReplica;
+	int m_stmt;			/* C_STMT_* (a test function) */
+	tCertWatchMetrics* m_metrics;
+	apr_uint64_t m_productionUsec;	/* The original query's final attempt */
+	int m_productionWarm;		/* Had it run on that connection before? */
+	const char* m_paramValues[4];
+} tCertWatchShadow;
+
+
+/* Typedef for the state of a request that's being handled by the content
+  handler, which outlives the handler while a suspended request waits for
+  its query */
+typedef struct tCertWatchContext {
+	request_rec* m_request;
+	tCertWatchDirConfig* m_dirConfig;
+	const char* m_paramValues[4];
+	const char* m_apiName;
+	int m_stmt;			/* C_STMT_* */
+	const char* m_requestKey;	/* NULL = not shareable */
+	const char* m_cacheKey;		/* NULL = not cacheable */
+	const char* m_coalesceKey;	/* NULL = not coalescing */
+	tCertWatchCoalesce* m_coalesce;
+	tCertWatchAdmit* m_admit;
+	tCertWatchRequestStats* m_stats;
+	tCertWatchConnPool* m_connPool;
+	tCertWatchConn* m_conn;		/* NULL = none checked out */
+	tCertWatchQuery m_query;
+	PGresult* m_PGresult;
+	apr_time_t m_phaseStart;
+	time_t m_startTime;
+	apr_uint64_t m_executeUsec;	/* The last attempt's query time */
+	int m_executeWarm;		/* Had it run on that connection before? */
+	int m_attempt;
+	int m_streamed;
+	int m_returnCode;		/* From certwatch_streamResponse() */
+	int m_shadow;			/* Mirror to the test function? */
+	int m_encoding;			/* C_ENCODING_* to respond with */
+	apr_pool_t* m_pollPool;		/* For the MPM's poll callback */
+} tCertWatchContext;
+
+
 /* Forward reference for module record */
 module AP_MODULE_DECLARE_DATA certwatch_module;
 
 
+/* Per-child connection pools, keyed by ConnInfo.  These are created lazily
+  (since ConnInfo is a per-directory setting), so access to the hash table is
+  serialized by a mutex */
+static apr_pool_t* g_childPool = NULL;
+static apr_hash_t* g_connPools = NULL;
+static apr_thread_mutex_t* g_connPoolsMutex = NULL;
+
+
+/* Shadow requests run on a per-child thread pool, with connection pools of
+  their own (so that they never hold up a production request's checkout),
+  and are dropped rather than queued without limit */
+static apr_thread_pool_t* g_shadowThreadPool = NULL;
+static apr_hash_t* g_shadowConnPools = NULL;
+static int g_shadowThreads = 0;
+static apr_size_t g_shadowQueue = 0;
+static volatile apr_uint32_t g_shadowCount = 0;
+
+
+/* The response cache, which is shared by all children */
+#define C_CACHE_MUTEX_TYPE	"certwatch-cache"
+static const ap_socache_provider_t* g_cacheProvider = NULL;
+static ap_socache_instance_t* g_cacheInstance = NULL;
+static apr_global_mutex_t* g_cacheMutex = NULL;
+
+
+/* Request coalescing slots, which are shared by all children */
+static apr_shm_t* g_coalesceShm = NULL;
+static tCertWatchCoalesceSlot* g_coalesceSlots = NULL;
+static apr_size_t g_nCoalesceSlots = 0;
+
+
+/* Admission control counters (one per tCertWatchAdmitLimit), which are shared
+  by all children */
+static apr_shm_t* g_admitShm = NULL;
+static tCertWatchAdmitSlot* g_admitSlots = NULL;
+static const apr_array_header_t* g_admitLimits = NULL;
+static volatile apr_uint32_t* g_admitChildren = NULL;	/* PIDs; 0 = free */
+static tCertWatchAdmitSlot* g_admitChildSlots = NULL;
+static int g_nAdmitChildren = 0;
+static tCertWatchAdmitSlot* g_admitMySlots = NULL;	/* This child's */
+
+
+/* Metrics, which are shared by all children */
+static apr_shm_t* g_metricsShm = NULL;
+static tCertWatchMetricsHeader* g_metricsHeader = NULL;
+static tCertWatchMetrics* g_metrics = NULL;
+static apr_size_t g_nMetrics = 0;
+
+/* Rate limiting token buckets, which are shared by all children */
+static apr_shm_t* g_rateShm = NULL;
+static tCertWatchRateSlot* g_rateSlots = NULL;
+static apr_size_t g_nRateSlots = 0;
+static const tCertWatchServerConfig* g_rateConfig = NULL;
+
+/* The traffic capture file, which is shared by all children, and this
+  child's ring buffer of records waiting to be written to it */
+static apr_file_t* g_captureFile = NULL;
+static const tCertWatchServerConfig* g_captureConfig = NULL;
+static tCertWatchCaptureRing* g_captureRing = NULL;
+
+#ifdef AP_MPMQ_CAN_POLL
+/* Can the MPM suspend a request until a socket is readable? */
+static int g_mpmCanPoll = 0;
+#endif
+
+
+/* A setting that a <Location> (or other section) doesn't set itself */
+#define C_DIRCONFIG_UNSET	-1
+
+
 /******************************************************************************
  * certwatch_dirConfig_create()                                               *
- *   Creates the per-directory configuration structure.                       *
+ *   Creates the per-directory configuration structure.  The server's own     *
+ * structure holds the defaults; a section's starts with every setting unset, *
+ * so that certwatch_dirConfig_merge() can tell which ones it overrides.      *
  *                                                                            *
  * IN:	v_pool - pool to use for memory allocation.                           *
+ * 	v_directory - the section's path, or NULL for the server's defaults.  *
  *                                                                            *
  * Returns:	pointer to per-directory config structure.                    *
  ******************************************************************************/
 static void* certwatch_dirConfig_create(
 	apr_pool_t* v_pool,
-	char* v_directory_unused
+	char* v_directory
 )
 {
 	tCertWatchDirConfig* t_certWatchDirConfig;
@@ -65,500 +565,7704 @@ static void* certwatch_dirConfig_create(
 		v_pool, sizeof(*t_certWatchDirConfig)
 	);
 
+	if (v_directory) {
+		t_certWatchDirConfig->m_connMin = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_connMax = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_connIdleTTL = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_maxBodySize = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_prepare = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_stream = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_cacheMaxObjectSize = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_cacheMaxTTL = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_coalesceWait = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_queryTimeout = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_admitWait = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_admitRetryAfter = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_replicaMaxLag = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_replicaCheckInterval =
+			C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_spoolThreshold = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_framed = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_batchMaxItems = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_async = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_shadowSample = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_nCompress = C_DIRCONFIG_UNSET;
+		t_certWatchDirConfig->m_compressMinSize = C_DIRCONFIG_UNSET;
+
+		return (void*)t_certWatchDirConfig;
+	}
+
+	/* Set the connection pool defaults */
+	t_certWatchDirConfig->m_connMin = 1;
+	t_certWatchDirConfig->m_connMax = 0;
+	t_certWatchDirConfig->m_connIdleTTL = 300;
+
+	/* crt.sh query strings are tiny, so cap POST bodies at 1MB */
+	t_certWatchDirConfig->m_maxBodySize = 1048576;
+
+	t_certWatchDirConfig->m_prepare = 1;
+
+	/* Set the response cache defaults */
+	t_certWatchDirConfig->m_cacheMaxObjectSize = 262144;
+	t_certWatchDirConfig->m_cacheMaxTTL = 3600;
+	t_certWatchDirConfig->m_coalesceWait = 10000;
+
+	/* Set the admission control defaults */
+	t_certWatchDirConfig->m_admitWait = 2000;
+	t_certWatchDirConfig->m_admitRetryAfter = 5;
+
+	/* Set the read replica defaults */
+	t_certWatchDirConfig->m_replicaMaxLag = 30;
+	t_certWatchDirConfig->m_replicaCheckInterval = 10;
+
+	t_certWatchDirConfig->m_batchMaxItems = 50;
+
+	/* Compressing a small response costs more than it saves */
+	t_certWatchDirConfig->m_compressMinSize = 1024;
+
 	return (void*)t_certWatchDirConfig;
 }
 
 
 /******************************************************************************
- * certwatch_read_body()                                                      *
- *   Read the request body of this POST or PUT request.                       *
- *                                                                            *
- * IN:	v_request - the request record.                                       *
+ * certwatch_dirConfig_merge()                                                *
+ *   Merges a section's per-directory configuration into that of the          *
+ * enclosing scope, which supplies every setting that the section doesn't set *
+ * itself.                                                                    *
  *                                                                            *
- * OUT:	v_body_data - the request body.                                       *
- * 	v_body_size - the size of v_body_data (in bytes).                     *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ * 	v_base - the enclosing scope's configuration.                         *
+ * 	v_add - the section's configuration.                                  *
  *                                                                            *
- * Returns:	OK = Request body read successfully.                          *
- * 		DECLINED = An error occurred.                                 *
+ * Returns:	pointer to the merged per-directory config structure.         *
  ******************************************************************************/
-static int certwatch_read_body(
-	request_rec* const v_request,
-	unsigned char** const v_body_data,
-	long* v_body_size
+static void* certwatch_dirConfig_merge(
+	apr_pool_t* v_pool,
+	void* v_base,
+	void* v_add
 )
 {
-	/* Initialize the data buffer */
-	*v_body_data = NULL;
-	*v_body_size = 0;
+	const tCertWatchDirConfig* t_base = (tCertWatchDirConfig*)v_base;
+	const tCertWatchDirConfig* t_add = (tCertWatchDirConfig*)v_add;
+	tCertWatchDirConfig* t_merged;
 
-	if ((v_request->method_number == M_POST)
-				|| (v_request->method_number == M_PUT)) {
-		/* Create a bucket brigade */
-		apr_bucket_brigade* t_bucketBrigade = apr_brigade_create(
-			v_request->pool, v_request->connection->bucket_alloc
-		);
-		apr_status_t t_result;
-		int t_seenEOS = 0;
-		do {
-			/* Link to the input filter stack */
-			t_result = ap_get_brigade(
-				v_request->input_filters, t_bucketBrigade,
-				AP_MODE_READBYTES, APR_BLOCK_READ,
-				HUGE_STRING_LEN
-			);
-			if (t_result != APR_SUCCESS) {
-				*v_body_data = NULL;
-				break;
-			}
+	t_merged = (tCertWatchDirConfig*)apr_palloc(v_pool, sizeof(*t_merged));
+	*t_merged = *t_add;
 
-			/* Read the data from the bucket(s) */
-			apr_bucket* t_bucket;
-			for (t_bucket = APR_BRIGADE_FIRST(t_bucketBrigade);
-					t_bucket != APR_BRIGADE_SENTINEL(
-							t_bucketBrigade);
-					t_bucket = APR_BUCKET_NEXT(t_bucket)) {
-				if (APR_BUCKET_IS_EOS(t_bucket)) {
-					t_seenEOS = 1;
-					break;
-				}
-				else if (APR_BUCKET_IS_FLUSH(t_bucket))
-					continue;
+#define C_MERGE_INT(m)							\
+	if (t_merged->m == C_DIRCONFIG_UNSET)				\
+		t_merged->m = t_base->m
+#define C_MERGE_PTR(m)							\
+	if (!t_merged->m)						\
+		t_merged->m = t_base->m
 
-				/* Read the data from this bucket */
-				const char* t_data;
-				apr_size_t t_size;
-				t_result = apr_bucket_read(
-					t_bucket, &t_data, &t_size,
-					APR_BLOCK_READ
-				);
-				if (t_result != APR_SUCCESS) {
-					*v_body_data = NULL;
-					break;
-				}
+	C_MERGE_PTR(m_connInfo);
+	C_MERGE_INT(m_connMin);
+	C_MERGE_INT(m_connMax);
+	C_MERGE_INT(m_connIdleTTL);
+	C_MERGE_INT(m_maxBodySize);
+	C_MERGE_INT(m_prepare);
+	C_MERGE_INT(m_stream);
+	C_MERGE_PTR(m_cacheFunctions);
+	C_MERGE_INT(m_cacheMaxObjectSize);
+	C_MERGE_INT(m_cacheMaxTTL);
+	C_MERGE_INT(m_coalesceWait);
+	C_MERGE_INT(m_queryTimeout);
+	C_MERGE_INT(m_admitWait);
+	C_MERGE_INT(m_admitRetryAfter);
+	C_MERGE_PTR(m_replicaConnInfos);
+	C_MERGE_PTR(m_primaryFunctions);
+	C_MERGE_INT(m_replicaMaxLag);
+	C_MERGE_INT(m_replicaCheckInterval);
+	C_MERGE_INT(m_spoolThreshold);
+	C_MERGE_PTR(m_spoolDir);
+	C_MERGE_INT(m_framed);
+	C_MERGE_INT(m_batchMaxItems);
+	C_MERGE_INT(m_async);
+	C_MERGE_INT(m_shadowSample);
+	C_MERGE_INT(m_compressMinSize);
 
-				/* Create a new APR-allocated buffer */
-				unsigned char* t_body_data = apr_palloc(
-					v_request->pool,
-					*v_body_size + t_size + 1
-				);
-				if (!t_body_data) {
-					*v_body_data = NULL;
-					break;
-				}
+#undef C_MERGE_INT
+#undef C_MERGE_PTR
 
-				/* Concatenate all of the bucket data that we've
-				  read so far */
-				if (*v_body_data)
-					memcpy(t_body_data,
-						*v_body_data,
-						*v_body_size);
-				memcpy(t_body_data + (*v_body_size),
-					t_data, t_size);
-				*v_body_data = t_body_data;
-				*v_body_size += t_size;
-				t_body_data[*v_body_size] = '\0';
-			}
+	/* The list of content codings is inherited (or replaced) as a whole */
+	if (t_merged->m_nCompress == C_DIRCONFIG_UNSET) {
+		t_merged->m_nCompress = t_base->m_nCompress;
+		memcpy(t_merged->m_compress, t_base->m_compress,
+			sizeof(t_merged->m_compress));
+		memcpy(t_merged->m_compressLevel, t_base->m_compressLevel,
+			sizeof(t_merged->m_compressLevel));
+	}
 
-			/* Cleanup the bucket brigade */
-			apr_brigade_cleanup(t_bucketBrigade);
-		} while (!t_seenEOS);
+	return (void*)t_merged;
+}
 
-		/* Destroy the bucket brigade */
-		apr_brigade_destroy(t_bucketBrigade);
 
-		/* Check that some data was read successfully */
-		if (*v_body_data)
-			return OK;
-	}
+/******************************************************************************
+ * certwatch_serverConfig_create()                                            *
+ *   Creates the per-server configuration structure.                          *
+ *                                                                            *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	pointer to per-server config structure.                       *
+ ******************************************************************************/
+static void* certwatch_serverConfig_create(
+	apr_pool_t* v_pool,
+	server_rec* v_server_unused
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig;
 
-	*v_body_size = 0;
+	/* Allocate zeroized memory for per-server config structure */
+	t_certWatchServerConfig = (tCertWatchServerConfig*)apr_pcalloc(
+		v_pool, sizeof(*t_certWatchServerConfig)
+	);
 
-	return DECLINED;
+	t_certWatchServerConfig->m_metricsSlots = 64;
+	t_certWatchServerConfig->m_ratePrefix4 = 32;
+	t_certWatchServerConfig->m_ratePrefix6 = 64;
+	t_certWatchServerConfig->m_captureSample = 1;
+	t_certWatchServerConfig->m_captureSlots = 256;
+	t_certWatchServerConfig->m_shadowThreads = 2;
+	t_certWatchServerConfig->m_shadowQueue = 64;
+
+	return (void*)t_certWatchServerConfig;
 }
 
 
 /******************************************************************************
- * escapeArrayString()                                                        *
- *   Escapes a string for inclusion in an array parameter in a call to        *
- * PQexecParams().  Puts a " character at each end and prepends each \ and "  *
- * character with a \ character.                                              *
+ * certwatch_conn_construct()                                                 *
+ *   Opens a new connection to the PostgreSQL database on behalf of a         *
+ * connection pool.                                                           *
  *                                                                            *
- * IN:	v_from - pointer to input string.                                     *
+ * IN:	v_params - the connection pool.                                       *
+ * 	v_pool_unused - the reslist's pool (not thread-safe, so not used).    *
  *                                                                            *
- * OUT:	v_to - escaped string (using newly allocated memory).                 *
+ * OUT:	v_resource - the new connection.                                      *
  *                                                                            *
- * Returns:	pointer to NULL-terminator at end of 'v_to'.                  *
+ * Returns:	APR_SUCCESS or an APR error code.                             *
  ******************************************************************************/
-static char* escapeArrayString(
-	apr_pool_t* v_pool,
-	char** v_to,
-	const char* v_from
+static apr_status_t certwatch_conn_construct(
+	void** const v_resource,
+	void* const v_params,
+	apr_pool_t* const v_pool_unused
 )
 {
-	char* t_to = apr_palloc(v_pool, (strlen(v_from) * 2) + 4);
-	const char* t_from = v_from;
+	tCertWatchConnPool* t_connPool = (tCertWatchConnPool*)v_params;
+	tCertWatchConn* t_conn;
+	apr_pool_t* t_pool;
+	apr_status_t t_result;
 
-	*v_to = t_to;
-	*(t_to++) = '"';
+	/* Each connection gets its own pool, because constructors may run
+	  concurrently */
+	t_result = apr_pool_create_unmanaged(&t_pool);
+	if (t_result != APR_SUCCESS)
+		return t_result;
 
-	while (*t_from) {
-		/* If necessary, prepend a \ character */
-		if (((*t_from) == '\\') || ((*t_from) == '"'))
-			*(t_to++) = '\\';
-		/* Copy the source character */
-		*(t_to++) = *(t_from++);
+	t_conn = apr_pcalloc(t_pool, sizeof(*t_conn));
+	t_conn->m_pool = t_pool;
+	t_conn->m_PGconn = PQconnectdb(t_connPool->m_connInfo);
+	if (PQstatus(t_conn->m_PGconn) != CONNECTION_OK) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, NULL,
+			"PQconnectdb() failed: %s",
+			PQerrorMessage(t_conn->m_PGconn)
+		);
+		PQfinish(t_conn->m_PGconn);
+		apr_pool_destroy(t_pool);
+		return APR_EGENERAL;
 	}
 
-	*(t_to++) = '"';
-	*t_to = '\0';
+	*v_resource = t_conn;
 
-	return t_to;
+	return APR_SUCCESS;
 }
 
 
 /******************************************************************************
- * certwatch_makeParamArrays()                                                *
- *   Construct the parameter name/value array strings from the query string.  *
+ * certwatch_conn_destruct()                                                  *
+ *   Closes a pooled connection to the PostgreSQL database.                   *
  *                                                                            *
- * IN:	v_request - the request record.                                       *
- * 	v_urlEncodedData - the URL-encoded data (e.g. the GET query string).  *
+ * IN:	v_resource - the connection.                                          *
  *                                                                            *
- * OUT:	v_nameArray - the parameter name array (PostgreSQL array string).     *
- * 	v_valueArray - the parameter value array (PostgreSQL array string).   *
+ * Returns:	APR_SUCCESS.                                                  *
  ******************************************************************************/
-static void certwatch_makeParamArrays(
-	request_rec* const v_request,
-	char* const v_urlEncodedData,
-	char** v_nameArray,
-	char** v_valueArray
+static apr_status_t certwatch_conn_destruct(
+	void* const v_resource,
+	void* const v_params_unused,
+	apr_pool_t* const v_pool_unused
 )
 {
-	char* t_nextArgName = v_urlEncodedData;
-	char* t_argName;
-	char* t_argValue;
-	char* t_offset;
-	char* t_escaped;
-	int t_length;
+	tCertWatchConn* t_conn = (tCertWatchConn*)v_resource;
 
-	/* Initialize the output parameters */
-	*v_nameArray = "";
-	*v_valueArray = "";
+	PQfinish(t_conn->m_PGconn);
+	apr_pool_destroy(t_conn->m_pool);
 
-	while (1) {
-		if (!t_nextArgName)
-			break;		/* No more parameters */
-
-		/* Look for the next "=" or "&" character */
-		t_argName = t_nextArgName;
-		t_length = strcspn(t_argName, "=&");
-		if (!t_length)
-			break;		/* No more parameters */
-
-		t_argValue = t_argName + t_length;
-		if (*t_argValue == '=') {
-			/* "=" character found; NULLify it */
-			*(t_argValue++) = '\0';
-
-			/* Look for the next "&" character; if found, NULLify
-			   it */
-			t_nextArgName = ap_strchr(t_argValue, '&');
-			if (t_nextArgName)
-				*(t_nextArgName++) = '\0';
-		}
-		else if (*t_argValue == '&') {
-			/* No "=" character found (i.e. no value specified) */
-			t_nextArgName = t_argValue + 1;
-			*t_argValue = '\0';
-		}
-		else
-			t_nextArgName = NULL;
+	return APR_SUCCESS;
+}
 
-		/* Replace all + characters with SPACE characters (assume
-		   URL-encoding is being used: is this always right? */
-		for (t_offset = t_argName; *t_offset; t_offset++)
-			if (*t_offset == '+')
-				*t_offset = ' ';
-		for (t_offset = t_argValue; *t_offset; t_offset++)
-			if (*t_offset == '+')
-				*t_offset = ' ';
 
-		/* Unescape the name and value strings */
-		ap_unescape_url(t_argName);
-		ap_unescape_url(t_argValue);
+/******************************************************************************
+ * certwatch_conn_findPool()                                                  *
+ *   Finds (or, on first use in this child, creates) a connection pool in    *
+ * one of this child's tables of connection pools.                            *
+ *                                                                            *
+ * IN:	v_connPools - the table of connection pools.                          *
+ * 	v_connInfo - the connection string.                                   *
+ * 	v_isReplica - non-zero if this is a read replica.                     *
+ * 	v_connMin - idle connections to keep open.                            *
+ * 	v_connMax - maximum connections; 0 = one per worker thread.           *
+ * 	v_connIdleTTL - how long to keep an idle connection (in seconds).     *
+ *                                                                            *
+ * Returns:	pointer to the connection pool, or NULL if an error occurred. *
+ ******************************************************************************/
+static tCertWatchConnPool* certwatch_conn_findPool(
+	apr_hash_t* const v_connPools,
+	const char* const v_connInfo,
+	const int v_isReplica,
+	const int v_connMin,
+	const int v_connMax,
+	const int v_connIdleTTL
+)
+{
+	tCertWatchConnPool* t_connPool;
+	int t_connMax = v_connMax;
+	int t_connMin = v_connMin;
 
-		/* Convert the name to upper case, because all argument name
-		   comparisons are case-insensitive */
-		ap_str_tolower(t_argName);
-		
-		/* Add the name and value to the array strings, escaping the "
-		  and \ characters */
-		(void)escapeArrayString(v_request->pool, &t_escaped, t_argName);
-		*v_nameArray = apr_psprintf(
-			v_request->pool, "%s,%s", *v_nameArray, t_escaped
-		);
-		(void)escapeArrayString(
-			v_request->pool, &t_escaped, t_argValue
-		);
-		*v_valueArray = apr_psprintf(
-			v_request->pool, "%s,%s", *v_valueArray, t_escaped
-		);
-	}
+	if ((!v_connPools) || (!v_connInfo))
+		return NULL;
 
-	if ((strlen(v_request->unparsed_uri) > 1)
-			&& (!strstr(v_request->unparsed_uri, "/?"))) {
-		t_offset = v_request->uri + 1;
-		if (!strncmp(t_offset, "_ROB_IS_TESTING_/", 17))
-			t_offset += 17;
-		*v_nameArray = apr_psprintf(
-			v_request->pool, "%s,\"output\"", *v_nameArray
-		);
-		(void)escapeArrayString(v_request->pool, &t_escaped, t_offset);
-		*v_valueArray = apr_psprintf(
-			v_request->pool, "%s,%s", *v_valueArray, t_escaped
-		);
-	}
+	apr_thread_mutex_lock(g_connPoolsMutex);
 
-	if (strlen(*v_nameArray) > 0) {
-		*v_nameArray = apr_psprintf(
-			v_request->pool, "{%s}", (*v_nameArray) + 1
-		);
-		*v_valueArray = apr_psprintf(
-			v_request->pool, "{%s}", (*v_valueArray) + 1
-		);
-	}
-	else {
-		*v_nameArray = NULL;
-		*v_valueArray = NULL;
+	t_connPool = apr_hash_get(v_connPools, v_connInfo, APR_HASH_KEY_STRING);
+	if (!t_connPool) {
+		/* By default, allow one connection per worker thread */
+		if ((t_connMax <= 0) && (ap_mpm_query(
+				AP_MPMQ_MAX_THREADS, &t_connMax
+			) != APR_SUCCESS))
+			t_connMax = 1;
+		if (t_connMax <= 0)
+			t_connMax = 1;
+		if (t_connMin > t_connMax)
+			t_connMin = t_connMax;
+
+		t_connPool = apr_pcalloc(g_childPool, sizeof(*t_connPool));
+		t_connPool->m_connInfo = apr_pstrdup(g_childPool, v_connInfo);
+		t_connPool->m_isReplica = v_isReplica;
+		t_connPool->m_healthy = 1;
+		if (apr_reslist_create(
+				&t_connPool->m_reslist, t_connMin, t_connMax,
+				t_connMax, apr_time_from_sec(v_connIdleTTL),
+				certwatch_conn_construct,
+				certwatch_conn_destruct, t_connPool,
+				g_childPool) == APR_SUCCESS) {
+			apr_reslist_cleanup_order_set(
+				t_connPool->m_reslist,
+				APR_RESLIST_CLEANUP_FIRST
+			);
+			apr_hash_set(
+				v_connPools, t_connPool->m_connInfo,
+				APR_HASH_KEY_STRING, t_connPool
+			);
+		}
+		else {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, 0, NULL,
+				"apr_reslist_create() failed"
+			);
+			t_connPool = NULL;
+		}
 	}
+
+	apr_thread_mutex_unlock(g_connPoolsMutex);
+
+	return t_connPool;
 }
 
 
 /******************************************************************************
- * certwatch_contentHandler()                                                 *
- *   Handle an HTTP request from a CertWatch client and return an HTTP        *
- * Response.                                                                  *
+ * certwatch_conn_getPool()                                                   *
+ *   Finds (or, on first use in this child, creates) the connection pool for  *
+ * a ConnInfo or ConnInfoReplica.                                             *
  *                                                                            *
- * IN:	v_request - the request record.                                       *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_connInfo - the connection string.                                   *
+ * 	v_isReplica - non-zero if this is a read replica.                     *
  *                                                                            *
- * Returns:	OK, DECLINED or some other Apache HTTP error code.            *
+ * Returns:	pointer to the connection pool, or NULL if an error occurred. *
  ******************************************************************************/
-static int certwatch_contentHandler(
-	request_rec* const v_request
+static tCertWatchConnPool* certwatch_conn_getPool(
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	const char* const v_connInfo,
+	const int v_isReplica
 )
 {
-	PGconn* t_PGconn = NULL;
-	PGresult* t_PGresult = NULL;
-	const char* t_paramValues[3];
-	char* t_requestParams = NULL;
-	char* t_nameArray = NULL;
-	char* t_valueArray = NULL;
-	char* t_response = NULL;
-	char* t_endOfHeaders = NULL;
-	char* t_name;
-	char* t_value;
-	char* t_next;
-	char* t_uri;
-	unsigned char* t_body_data = NULL;
-	long t_body_size = 0;
-	int t_response_len = 0;
-	int t_returnCode = DECLINED;
+	return certwatch_conn_findPool(
+		g_connPools, v_connInfo, v_isReplica,
+		v_certWatchDirConfig->m_connMin,
+		v_certWatchDirConfig->m_connMax,
+		v_certWatchDirConfig->m_connIdleTTL
+	);
+}
 
-	/* Check if we need to handle this request at all */
-	if (strcmp(v_request->handler, "certwatch"))
-		return DECLINED;
 
-	/* Get the per-directory configuration structure */
-	tCertWatchDirConfig* t_certWatchDirConfig =
-		(tCertWatchDirConfig*)ap_get_module_config(
-			v_request->per_dir_config, &certwatch_module
-		);
-	if (!t_certWatchDirConfig)
-		return DECLINED;
+/* How long a connection must have been idle before it's checked for a
+  server that has gone away */
+#define C_CONN_CHECK_IDLE	apr_time_from_msec(100)
 
-	/* Isolate the path component of the URI */
+
+/******************************************************************************
+ * certwatch_conn_isStale()                                                   *
+ *   Determines whether the server has closed an idle connection (e.g. after  *
+ * a database restart), which PQstatus() doesn't notice until the next query  *
+ * fails.  An idle connection has nothing to read unless the server has sent  *
+ * a FATAL error and hung up.                                                 *
+ *                                                                            *
+ * IN:	v_conn - the connection.                                              *
+ *                                                                            *
+ * Returns:	1 if the connection should be reset; otherwise 0.             *
+ ******************************************************************************/
+static int certwatch_conn_isStale(
+	const tCertWatchConn* const v_conn
+)
+{
+	struct pollfd t_pollFd;
+	char t_byte;
+
+	if ((!v_conn->m_idleSince) || ((apr_time_now() - v_conn->m_idleSince)
+						< C_CONN_CHECK_IDLE))
+		return 0;
+
+	t_pollFd.fd = PQsocket(v_conn->m_PGconn);
+	if (t_pollFd.fd < 0)
+		return 1;
+	t_pollFd.events = POLLIN;
+	t_pollFd.revents = 0;
+	if (poll(&t_pollFd, 1, 0) <= 0)
+		return 0;
+
+	/* Anything at all (even the start of an error message) means that the
+	  session is over */
+	return (t_pollFd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		|| (recv(t_pollFd.fd, &t_byte, 1, MSG_PEEK | MSG_DONTWAIT)
+			>= 0)
+		|| ((errno != EAGAIN) && (errno != EWOULDBLOCK));
+}
+
+
+/******************************************************************************
+ * certwatch_conn_acquire()                                                   *
+ *   Checks out a healthy, idle connection from the pool.                     *
+ *                                                                            *
+ * IN:	v_connPool - the connection pool.                                     *
+ *                                                                            *
+ * Returns:	pointer to the connection, or NULL if an error occurred.      *
+ ******************************************************************************/
+static tCertWatchConn* certwatch_conn_acquire(
+	tCertWatchConnPool* const v_connPool
+)
+{
+	tCertWatchConn* t_conn;
+	int t_attempt;
+
+	/* Discard any connection that has failed or that was left mid-
+	  transaction; if every idle connection is broken (e.g. after a database
+	  restart), we'll end up opening a fresh one */
+	for (t_attempt = 0; t_attempt < 3; t_attempt++) {
+		if (apr_reslist_acquire(v_connPool->m_reslist, (void**)&t_conn)
+				!= APR_SUCCESS)
+			return NULL;
+
+		if ((PQstatus(t_conn->m_PGconn) != CONNECTION_OK)
+				|| certwatch_conn_isStale(t_conn)) {
+			/* A reset connection is a new session, so any prepared
+			  statements are gone */
+			PQreset(t_conn->m_PGconn);
+			t_conn->m_prepared = 0;
+			t_conn->m_sent = 0;
+		}
+
+		if ((PQstatus(t_conn->m_PGconn) == CONNECTION_OK)
+				&& (PQtransactionStatus(t_conn->m_PGconn)
+					== PQTRANS_IDLE))
+			return t_conn;
+
+		apr_reslist_invalidate(v_connPool->m_reslist, t_conn);
+	}
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_conn_prepare()                                                   *
+ *   Prepares one of the per-connection statements, if this is its first use *
+ * on this connection.                                                        *
+ *                                                                            *
+ * IN:	v_conn - the connection.                                              *
+ * 	v_stmt - the statement (C_STMT_*).                                    *
+ *                                                                            *
+ * Returns:	NULL on success, or the failed result (which the caller must  *
+ * 		PQclear()).                                                   *
+ ******************************************************************************/
+static PGresult* certwatch_conn_prepare(
+	tCertWatchConn* const v_conn,
+	const int v_stmt
+)
+{
+	PGresult* t_PGresult;
+
+	if (v_conn->m_prepared & (1 << v_stmt))
+		return NULL;
+
+	t_PGresult = PQprepare(
+		v_conn->m_PGconn, g_stmtName[v_stmt], g_stmtSQL[v_stmt], 4,
+		NULL
+	);
+	if (PQresultStatus(t_PGresult) != PGRES_COMMAND_OK)
+		return t_PGresult;
+
+	PQclear(t_PGresult);
+	v_conn->m_prepared |= (1 << v_stmt);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_conn_send()                                                      *
+ *   Sends one of the per-connection statements without waiting for the      *
+ * result, preparing it first if this is its first use on this connection.   *
+ *                                                                            *
+ * IN:	v_conn - the connection.                                              *
+ * 	v_stmt - the statement (C_STMT_*).                                    *
+ * 	v_paramValues - the statement's 4 parameters.                         *
+ * 	v_prepare - non-zero to use a prepared statement.                     *
+ *                                                                            *
+ * Returns:	NULL on success, or the failed result (which the caller must  *
+ * 		PQclear()).                                                   *
+ ******************************************************************************/
+static PGresult* certwatch_conn_send(
+	tCertWatchConn* const v_conn,
+	const int v_stmt,
+	const char* const* const v_paramValues,
+	const int v_prepare
+)
+{
+	PGresult* t_PGresult;
+	int t_sent;
+
+	if (v_prepare) {
+		t_PGresult = certwatch_conn_prepare(v_conn, v_stmt);
+		if (t_PGresult)
+			return t_PGresult;
+		t_sent = PQsendQueryPrepared(
+			v_conn->m_PGconn, g_stmtName[v_stmt], 4, v_paramValues,
+			NULL, NULL, g_stmtResultFormat[v_stmt]
+		);
+	}
+	else
+		t_sent = PQsendQueryParams(
+			v_conn->m_PGconn, g_stmtSQL[v_stmt], 4, NULL,
+			v_paramValues, NULL, NULL, g_stmtResultFormat[v_stmt]
+		);
+
+	if (!t_sent)
+		return PQmakeEmptyPGresult(
+			v_conn->m_PGconn, PGRES_FATAL_ERROR
+		);
+	v_conn->m_sent |= (1 << v_stmt);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_query_begin()                                                    *
+ *   Initializes the state of a query that has just been sent.                *
+ *                                                                            *
+ * IN:	v_request - the request record, or NULL if there's no client.         *
+ * 	v_conn - the connection.                                              *
+ * 	v_timeout - the query timeout (in seconds), or 0 for none.            *
+ *                                                                            *
+ * OUT:	v_query - the query state.                                            *
+ ******************************************************************************/
+static void certwatch_query_begin(
+	tCertWatchQuery* const v_query,
+	request_rec* const v_request,
+	tCertWatchConn* const v_conn,
+	const int v_timeout
+)
+{
+	apr_socket_t* t_socket;
+	apr_os_sock_t t_fd;
+
+	v_query->m_request = v_request;
+	v_query->m_conn = v_conn;
+	v_query->m_startedAt = apr_time_now();
+	v_query->m_deadline = (v_timeout > 0) ?
+		(v_query->m_startedAt + apr_time_from_sec(v_timeout)) : 0;
+	v_query->m_clientFd = -1;
+	v_query->m_cancelled = C_CANCEL_NONE;
+
+	/* Watch the client's socket, if there is one (there isn't for e.g. an
+	  HTTP/2 stream) */
+	if (v_request) {
+		t_socket = ap_get_conn_socket(v_request->connection);
+		if (t_socket
+				&& (apr_os_sock_get(&t_fd, t_socket)
+					== APR_SUCCESS))
+			v_query->m_clientFd = t_fd;
+	}
+}
+
+
+/******************************************************************************
+ * certwatch_query_cancel()                                                   *
+ *   Asks the server to cancel the query, and logs why.                       *
+ *                                                                            *
+ * IN:	v_query - the query state.                                            *
+ * 	v_reason - why the query is being cancelled (C_CANCEL_*).             *
+ ******************************************************************************/
+static void certwatch_query_cancel(
+	tCertWatchQuery* const v_query,
+	const int v_reason
+)
+{
+	char t_error[256];
+	PGcancel* t_PGcancel;
+
+	v_query->m_cancelled = v_reason;
+	t_PGcancel = PQgetCancel(v_query->m_conn->m_PGconn);
+	if (!t_PGcancel || !PQcancel(t_PGcancel, t_error, sizeof(t_error)))
+		ap_log_error(
+			APLOG_MARK, APLOG_WARNING, 0, NULL,
+			"PQcancel() failed: %s",
+			t_PGcancel ? t_error : "PQgetCancel() failed"
+		);
+	if (t_PGcancel)
+		PQfreeCancel(t_PGcancel);
+
+	ap_log_error(
+		APLOG_MARK, APLOG_NOTICE, 0, NULL,
+		"Cancelled query after %" APR_TIME_T_FMT "ms (%s): %s",
+		apr_time_as_msec(apr_time_now() - v_query->m_startedAt),
+		(v_reason == C_CANCEL_TIMEOUT) ? "timed out" : "client gone",
+		v_query->m_request ? v_query->m_request->the_request : ""
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_query_isClientGone()                                             *
+ *   Called when the client's socket is readable, to determine whether the    *
+ * client has closed its connection.                                          *
+ *                                                                            *
+ * IN:	v_query - the query state.                                            *
+ *                                                                            *
+ * Returns:	1 if the client has gone; otherwise 0.                        *
+ ******************************************************************************/
+static int certwatch_query_isClientGone(
+	tCertWatchQuery* const v_query
+)
+{
+	char t_byte;
+	ssize_t t_length = recv(
+		v_query->m_clientFd, &t_byte, 1, MSG_PEEK | MSG_DONTWAIT
+	);
+
+	if (t_length == 0)
+		return 1;
+	else if ((t_length < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)
+			&& (errno != EINTR))
+		return 1;
+
+	/* The client has sent more data (e.g. a pipelined request), which
+	  we mustn't consume; stop watching, since the socket will remain
+	  readable */
+	v_query->m_clientFd = -1;
+	return 0;
+}
+
+
+/******************************************************************************
+ * certwatch_query_getResult()                                                *
+ *   Waits for the next result of a query without blocking in libpq, while   *
+ * watching for the query timeout and for the client going away; in either  *
+ * case, the query is cancelled on the server.                                *
+ *                                                                            *
+ * IN:	v_query - the query state.                                            *
+ *                                                                            *
+ * Returns:	the next result (which the caller must PQclear()), or NULL    *
+ * 		once there are no more.                                       *
+ ******************************************************************************/
+static PGresult* certwatch_query_getResult(
+	tCertWatchQuery* const v_query
+)
+{
+	PGconn* t_PGconn = v_query->m_conn->m_PGconn;
+	struct pollfd t_pollFds[2];
+	int t_timeout;
+	int t_nFds;
+
+	while (PQisBusy(t_PGconn)) {
+		t_pollFds[0].fd = PQsocket(t_PGconn);
+		t_pollFds[0].events = POLLIN;
+		t_pollFds[0].revents = 0;
+		t_nFds = 1;
+
+		if (v_query->m_cancelled)
+			t_timeout = -1;	/* Just wait for the cancellation */
+		else {
+			if (v_query->m_clientFd >= 0) {
+				t_pollFds[1].fd = v_query->m_clientFd;
+#ifdef POLLRDHUP
+				t_pollFds[1].events = POLLIN | POLLRDHUP;
+#else
+				t_pollFds[1].events = POLLIN;
+#endif
+				t_pollFds[1].revents = 0;
+				t_nFds = 2;
+			}
+
+			t_timeout = -1;
+			if (v_query->m_deadline) {
+				apr_time_t t_remaining = v_query->m_deadline
+							- apr_time_now();
+				if (t_remaining <= 0) {
+					certwatch_query_cancel(
+						v_query, C_CANCEL_TIMEOUT
+					);
+					continue;
+				}
+				t_timeout = (int)apr_time_as_msec(
+					t_remaining + 999
+				);
+			}
+		}
+
+		if (poll(t_pollFds, t_nFds, t_timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;	/* Let PQgetResult() block instead */
+		}
+
+		if ((t_nFds == 2) && t_pollFds[1].revents
+				&& certwatch_query_isClientGone(v_query)) {
+			certwatch_query_cancel(v_query, C_CANCEL_CLIENT_GONE);
+			continue;
+		}
+
+		/* If this fails, PQgetResult() will report the error */
+		if (t_pollFds[0].revents && !PQconsumeInput(t_PGconn))
+			break;
+	}
+
+	return PQgetResult(t_PGconn);
+}
+
+
+/******************************************************************************
+ * certwatch_query_collect()                                                  *
+ *   Waits for all of a query's results.                                      *
+ *                                                                            *
+ * IN:	v_query - the query state.                                            *
+ *                                                                            *
+ * Returns:	the last result (which the caller must PQclear()).            *
+ ******************************************************************************/
+static PGresult* certwatch_query_collect(
+	tCertWatchQuery* const v_query
+)
+{
+	PGresult* t_lastPGresult = NULL;
+	PGresult* t_PGresult;
+
+	while ((t_PGresult = certwatch_query_getResult(v_query))) {
+		if (t_lastPGresult)
+			PQclear(t_lastPGresult);
+		t_lastPGresult = t_PGresult;
+	}
+
+	return t_lastPGresult;
+}
+
+
+/******************************************************************************
+ * certwatch_conn_release()                                                   *
+ *   Returns a connection to the pool, or closes it if it is no longer fit    *
+ * for reuse.                                                                 *
+ *                                                                            *
+ * IN:	v_connPool - the connection pool.                                     *
+ * 	v_conn - the connection.                                              *
+ ******************************************************************************/
+static void certwatch_conn_release(
+	tCertWatchConnPool* const v_connPool,
+	tCertWatchConn* const v_conn
+)
+{
+	if ((PQstatus(v_conn->m_PGconn) == CONNECTION_OK)
+			&& (PQtransactionStatus(v_conn->m_PGconn)
+				== PQTRANS_IDLE)
+#ifdef LIBPQ_HAS_PIPELINING
+			&& (PQpipelineStatus(v_conn->m_PGconn)
+				== PQ_PIPELINE_OFF)
+#endif
+			&& (!PQisnonblocking(v_conn->m_PGconn))) {
+		v_conn->m_idleSince = apr_time_now();
+		apr_reslist_release(v_connPool->m_reslist, v_conn);
+	}
+	else
+		apr_reslist_invalidate(v_connPool->m_reslist, v_conn);
+}
+
+
+/******************************************************************************
+ * certwatch_conn_setHealthy()                                                *
+ *   Puts a read replica into, or takes it out of, rotation.                  *
+ *                                                                            *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_connPool - the replica's connection pool.                           *
+ * 	v_healthy - 1 = in rotation; 0 = out of rotation.                     *
+ * 	v_reason - why.                                                       *
+ ******************************************************************************/
+static void certwatch_conn_setHealthy(
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	tCertWatchConnPool* const v_connPool,
+	const apr_uint32_t v_healthy,
+	const char* const v_reason
+)
+{
+	/* Check again after the interval */
+	apr_atomic_set64(
+		&v_connPool->m_nextCheck,
+		apr_time_now() + apr_time_from_sec(
+			v_certWatchDirConfig->m_replicaCheckInterval
+		)
+	);
+
+	if (apr_atomic_xchg32(&v_connPool->m_healthy, v_healthy) != v_healthy)
+		ap_log_error(
+			APLOG_MARK, v_healthy ? APLOG_NOTICE : APLOG_WARNING,
+			0, NULL, "Replica %s rotation (%s): %s",
+			v_healthy ? "returned to" : "taken out of", v_reason,
+			v_connPool->m_connInfo
+		);
+}
+
+
+/******************************************************************************
+ * certwatch_conn_execWithin()                                                *
+ *   Runs a query without blocking in libpq, giving up at a deadline.  A      *
+ * connection that gives up is left busy, so certwatch_conn_release() will    *
+ * close it rather than wait for the query.                                   *
+ *                                                                            *
+ * IN:	v_conn - the connection.                                              *
+ * 	v_sql - the query.                                                    *
+ * 	v_deadline - when to give up.                                         *
+ *                                                                            *
+ * Returns:	the last result (which the caller must PQclear()), or NULL if *
+ * 		the query couldn't be sent or the deadline passed.            *
+ ******************************************************************************/
+static PGresult* certwatch_conn_execWithin(
+	tCertWatchConn* const v_conn,
+	const char* const v_sql,
+	const apr_time_t v_deadline
+)
+{
+	PGconn* t_PGconn = v_conn->m_PGconn;
+	PGresult* t_lastPGresult = NULL;
+	PGresult* t_PGresult;
+	struct pollfd t_pollFd;
+	apr_time_t t_remaining;
+	int t_ready;
+
+	if (!PQsendQuery(t_PGconn, v_sql))
+		return NULL;
+
+	for (;;) {
+		while (PQisBusy(t_PGconn)) {
+			t_remaining = v_deadline - apr_time_now();
+			if (t_remaining <= 0)
+				goto label_timedOut;
+			t_pollFd.fd = PQsocket(t_PGconn);
+			t_pollFd.events = POLLIN;
+			t_pollFd.revents = 0;
+			t_ready = poll(
+				&t_pollFd, 1,
+				(int)apr_time_as_msec(t_remaining + 999)
+			);
+			if ((t_ready < 0) && (errno != EINTR))
+				goto label_timedOut;
+			/* If this fails, PQgetResult() will report the error */
+			if ((t_ready > 0) && !PQconsumeInput(t_PGconn))
+				break;
+		}
+
+		t_PGresult = PQgetResult(t_PGconn);
+		if (!t_PGresult)
+			return t_lastPGresult;
+		if (t_lastPGresult)
+			PQclear(t_lastPGresult);
+		t_lastPGresult = t_PGresult;
+	}
+
+label_timedOut:
+	if (t_lastPGresult)
+		PQclear(t_lastPGresult);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_conn_checkReplica()                                              *
+ *   Checks a read replica's replication lag, if a check is due.  Only one    *
+ * thread per child checks each replica at a time, and a replica that takes   *
+ * too long to answer is taken out of rotation.                               *
+ *                                                                            *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_connPool - the replica's connection pool.                           *
+ * 	v_conn - a connection to the replica.                                 *
+ *                                                                            *
+ * Returns:	1 if the replica is in rotation; otherwise 0.                 *
+ ******************************************************************************/
+static int certwatch_conn_checkReplica(
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	tCertWatchConnPool* const v_connPool,
+	tCertWatchConn* const v_conn
+)
+{
+	PGresult* t_PGresult;
+	char t_reason[64];
+	double t_lag;
+	apr_uint32_t t_healthy = 0;
+
+	apr_time_t t_nextCheck = apr_atomic_read64(&v_connPool->m_nextCheck);
+
+	if ((apr_time_now() < t_nextCheck)
+			|| (apr_atomic_cas32(&v_connPool->m_checking, 1, 0)
+				!= 0))
+		return apr_atomic_read32(&v_connPool->m_healthy);
+
+	t_PGresult = certwatch_conn_execWithin(
+		v_conn, C_REPLICA_LAG_SQL,
+		apr_time_now() + C_REPLICA_CHECK_TIMEOUT
+	);
+	if (!t_PGresult)
+		snprintf(
+			t_reason, sizeof(t_reason), "lag check failed: %s",
+			PQisBusy(v_conn->m_PGconn) ? "timed out"
+				: PQerrorMessage(v_conn->m_PGconn)
+		);
+	else if ((PQresultStatus(t_PGresult) == PGRES_TUPLES_OK)
+			&& (PQntuples(t_PGresult) == 1)) {
+		t_lag = atof(PQgetvalue(t_PGresult, 0, 0));
+		t_healthy = (t_lag <= v_certWatchDirConfig->m_replicaMaxLag);
+		snprintf(t_reason, sizeof(t_reason), "%.1fs behind", t_lag);
+	}
+	else
+		snprintf(
+			t_reason, sizeof(t_reason), "lag check failed: %s",
+			PQresultErrorField(t_PGresult, PG_DIAG_MESSAGE_PRIMARY)
+				? PQresultErrorField(
+					t_PGresult, PG_DIAG_MESSAGE_PRIMARY
+				)
+				: PQerrorMessage(v_conn->m_PGconn)
+		);
+	PQclear(t_PGresult);
+
+	certwatch_conn_setHealthy(
+		v_certWatchDirConfig, v_connPool, t_healthy, t_reason
+	);
+	apr_atomic_set32(&v_connPool->m_checking, 0);
+
+	return t_healthy;
+}
+
+
+/******************************************************************************
+ * certwatch_conn_isPinned()                                                  *
+ *   Determines whether an API must always run on the primary.                *
+ *                                                                            *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_apiName - the API name.                                             *
+ *                                                                            *
+ * Returns:	1 if pinned to the primary; otherwise 0.                      *
+ ******************************************************************************/
+static int certwatch_conn_isPinned(
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	const char* const v_apiName
+)
+{
+	int i;
+
+	if (!v_certWatchDirConfig->m_primaryFunctions)
+		return 0;
+
+	for (i = 0; i < v_certWatchDirConfig->m_primaryFunctions->nelts; i++)
+		if (!strcmp(v_apiName, APR_ARRAY_IDX(
+				v_certWatchDirConfig->m_primaryFunctions, i,
+				const char*)))
+			return 1;
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * certwatch_conn_route()                                                     *
+ *   Chooses which database server should run a query: the read replica      *
+ * (that's in rotation) with the fewest outstanding requests from this       *
+ * child, or else the primary.                                                *
+ *                                                                            *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_apiName - the API name.                                             *
+ * 	v_exclude - a connection pool that has just failed, or NULL.          *
+ *                                                                            *
+ * Returns:	pointer to the connection pool, or NULL if there's none left. *
+ ******************************************************************************/
+static tCertWatchConnPool* certwatch_conn_route(
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	const char* const v_apiName,
+	const tCertWatchConnPool* const v_exclude
+)
+{
+	tCertWatchConnPool* t_connPool;
+	tCertWatchConnPool* t_best = NULL;
+	apr_time_t t_now = apr_time_now();
+	int i;
+
+	if (v_certWatchDirConfig->m_replicaConnInfos
+			&& !certwatch_conn_isPinned(
+				v_certWatchDirConfig, v_apiName)) {
+		for (i = 0; i < v_certWatchDirConfig->m_replicaConnInfos->nelts;
+				i++) {
+			t_connPool = certwatch_conn_getPool(
+				v_certWatchDirConfig,
+				APR_ARRAY_IDX(
+					v_certWatchDirConfig
+						->m_replicaConnInfos,
+					i, const char*
+				), 1
+			);
+			if ((!t_connPool) || (t_connPool == v_exclude))
+				continue;
+
+			/* A replica that's out of rotation gets another chance
+			  once its next health check is due */
+			if ((!apr_atomic_read32(&t_connPool->m_healthy))
+					&& (t_now < (apr_time_t)
+						apr_atomic_read64(
+							&t_connPool->m_nextCheck
+						)))
+				continue;
+
+			if ((!t_best)
+					|| (apr_atomic_read32(
+						&t_connPool->m_outstanding)
+					< apr_atomic_read32(
+						&t_best->m_outstanding)))
+				t_best = t_connPool;
+		}
+		if (t_best)
+			return t_best;
+	}
+
+	t_connPool = certwatch_conn_getPool(
+		v_certWatchDirConfig, v_certWatchDirConfig->m_connInfo, 0
+	);
+
+	return (t_connPool == v_exclude) ? NULL : t_connPool;
+}
+
+
+/******************************************************************************
+ * certwatch_conn_checkOut()                                                  *
+ *   Checks out a connection from the chosen server's pool, taking a read     *
+ * replica out of rotation if it can't be reached or is too far behind.      *
+ *                                                                            *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_connPool - the connection pool.                                     *
+ *                                                                            *
+ * Returns:	pointer to the connection, or NULL if an error occurred.      *
+ ******************************************************************************/
+static tCertWatchConn* certwatch_conn_checkOut(
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	tCertWatchConnPool* const v_connPool
+)
+{
+	tCertWatchConn* t_conn;
+
+	apr_atomic_inc32(&v_connPool->m_outstanding);
+
+	t_conn = certwatch_conn_acquire(v_connPool);
+	if (!t_conn) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, NULL,
+			"certwatch_conn_acquire() failed: %s",
+			v_connPool->m_connInfo
+		);
+		if (g_metricsHeader)
+			apr_atomic_inc64(&g_metricsHeader->m_connectFailures);
+		if (v_connPool->m_isReplica)
+			certwatch_conn_setHealthy(
+				v_certWatchDirConfig, v_connPool, 0,
+				"connection failed"
+			);
+	}
+	else if (v_connPool->m_isReplica && !certwatch_conn_checkReplica(
+			v_certWatchDirConfig, v_connPool, t_conn)) {
+		certwatch_conn_release(v_connPool, t_conn);
+		t_conn = NULL;
+	}
+
+	if (!t_conn)
+		apr_atomic_dec32(&v_connPool->m_outstanding);
+
+	return t_conn;
+}
+
+
+/******************************************************************************
+ * certwatch_conn_checkIn()                                                   *
+ *   Returns a connection that was checked out by certwatch_conn_checkOut().  *
+ *                                                                            *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_connPool - the connection pool.                                     *
+ * 	v_conn - the connection.                                              *
+ ******************************************************************************/
+static void certwatch_conn_checkIn(
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	tCertWatchConnPool* const v_connPool,
+	tCertWatchConn* const v_conn
+)
+{
+	if (v_connPool->m_isReplica
+			&& (PQstatus(v_conn->m_PGconn) != CONNECTION_OK))
+		certwatch_conn_setHealthy(
+			v_certWatchDirConfig, v_connPool, 0, "connection lost"
+		);
+
+	certwatch_conn_release(v_connPool, v_conn);
+	apr_atomic_dec32(&v_connPool->m_outstanding);
+}
+
+
+/******************************************************************************
+ * certwatch_conn_isRetryable()                                               *
+ *   Determines whether a failed query could succeed on another server: if    *
+ * the connection failed, the server is shutting down or starting up, or a  *
+ * replica cancelled the query due to a recovery conflict.                    *
+ *                                                                            *
+ * IN:	v_conn - the connection.                                              *
+ * 	v_PGresult - the query's result.                                      *
+ *                                                                            *
+ * Returns:	1 if retryable; otherwise 0.                                  *
+ ******************************************************************************/
+static int certwatch_conn_isRetryable(
+	tCertWatchConn* const v_conn,
+	const PGresult* const v_PGresult
+)
+{
+	const char* t_sqlState;
+
+	if ((!v_PGresult) || (PQresultStatus(v_PGresult) == PGRES_TUPLES_OK))
+		return 0;
+	else if (PQstatus(v_conn->m_PGconn) != CONNECTION_OK)
+		return 1;
+
+	t_sqlState = PQresultErrorField(v_PGresult, PG_DIAG_SQLSTATE);
+
+	return t_sqlState && ((!strcmp(t_sqlState, "40001"))
+				|| (!strncmp(t_sqlState, "57P0", 4)));
+}
+
+
+/******************************************************************************
+ * certwatch_poolAlloc()                                                      *
+ *   A tCertWatchAlloc that allocates from a pool.                            *
+ *                                                                            *
+ * IN:	v_pool - the pool.                                                    *
+ * 	v_size - the number of bytes to allocate.                             *
+ *                                                                            *
+ * Returns:	pointer to the allocated memory.                              *
+ ******************************************************************************/
+static void* certwatch_poolAlloc(
+	void* const v_pool,
+	const size_t v_size
+)
+{
+	return apr_palloc((apr_pool_t*)v_pool, v_size);
+}
+
+
+/* Largest buffer that is allocated up front for a Content-Length; a bigger
+  body's buffer grows as its data arrives, so that a client can't make us
+  allocate memory just by declaring a huge length */
+#define C_BODY_PREALLOC_MAX	4194304
+
+/******************************************************************************
+ * certwatch_read_body()                                                      *
+ *   Read the request body of this POST or PUT request.  The buffer is sized  *
+ * from the Content-Length header when there is one (up to                    *
+ * C_BODY_PREALLOC_MAX), and otherwise grows geometrically, so each byte is   *
+ * copied at most a constant number of times.                                 *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_maxBodySize - the largest body that will be accepted (in bytes), or *
+ * 			0 for no limit.                                       *
+ *                                                                            *
+ * OUT:	v_body_data - the request body.                                       *
+ * 	v_body_size - the size of v_body_data (in bytes).                     *
+ *                                                                            *
+ * Returns:	OK = Request body read successfully.                          *
+ * 		HTTP_REQUEST_ENTITY_TOO_LARGE = Body exceeds v_maxBodySize.   *
+ * 		DECLINED = An error occurred.                                 *
+ ******************************************************************************/
+static int certwatch_read_body(
+	request_rec* const v_request,
+	const long v_maxBodySize,
+	unsigned char** const v_body_data,
+	long* v_body_size
+)
+{
+	/* Initialize the data buffer */
+	*v_body_data = NULL;
+	*v_body_size = 0;
+
+	if ((v_request->method_number == M_POST)
+				|| (v_request->method_number == M_PUT)) {
+		apr_size_t t_capacity = HUGE_STRING_LEN;
+		int t_returnCode = OK;
+
+		/* If the client told us how big the body is, reject it straight
+		  away if it's too big; otherwise allocate exactly enough space
+		  for it, unless that's more than we're willing to commit to
+		  before any of it has arrived */
+		const char* t_contentLength = apr_table_get(
+			v_request->headers_in, "Content-Length"
+		);
+		if (t_contentLength) {
+			apr_off_t t_length;
+			char* t_end;
+			if ((apr_strtoff(&t_length, t_contentLength, &t_end, 10)
+						== APR_SUCCESS)
+					&& (!*t_end) && (t_length >= 0)) {
+				if ((v_maxBodySize > 0)
+						&& (t_length > v_maxBodySize))
+					return HTTP_REQUEST_ENTITY_TOO_LARGE;
+				t_capacity = (t_length > C_BODY_PREALLOC_MAX)
+						? C_BODY_PREALLOC_MAX
+						: (apr_size_t)t_length;
+			}
+		}
+
+		/* Allocate the initial buffer */
+		tCertWatchBody t_body;
+		if (certwatch_body_init(
+				&t_body, certwatch_poolAlloc, v_request->pool,
+				t_capacity,
+				(v_maxBodySize > 0) ? v_maxBodySize : 0
+			) != C_BODY_OK)
+			return DECLINED;
+
+		/* Create a bucket brigade */
+		apr_bucket_brigade* t_bucketBrigade = apr_brigade_create(
+			v_request->pool, v_request->connection->bucket_alloc
+		);
+		apr_status_t t_result;
+		int t_appended;
+		int t_seenEOS = 0;
+		do {
+			/* Link to the input filter stack */
+			t_result = ap_get_brigade(
+				v_request->input_filters, t_bucketBrigade,
+				AP_MODE_READBYTES, APR_BLOCK_READ,
+				HUGE_STRING_LEN
+			);
+			if (t_result != APR_SUCCESS) {
+				t_returnCode = DECLINED;
+				break;
+			}
+
+			/* Read the data from the bucket(s) */
+			apr_bucket* t_bucket;
+			for (t_bucket = APR_BRIGADE_FIRST(t_bucketBrigade);
+					t_bucket != APR_BRIGADE_SENTINEL(
+							t_bucketBrigade);
+					t_bucket = APR_BUCKET_NEXT(t_bucket)) {
+				if (APR_BUCKET_IS_EOS(t_bucket)) {
+					t_seenEOS = 1;
+					break;
+				}
+				else if (APR_BUCKET_IS_FLUSH(t_bucket))
+					continue;
+
+				/* Read the data from this bucket */
+				const char* t_data;
+				apr_size_t t_size;
+				t_result = apr_bucket_read(
+					t_bucket, &t_data, &t_size,
+					APR_BLOCK_READ
+				);
+				if (t_result != APR_SUCCESS) {
+					t_returnCode = DECLINED;
+					break;
+				}
+
+				/* Append this bucket's data, enforcing the size
+				  limit in case Content-Length was absent or
+				  wrong */
+				t_appended = certwatch_body_append(
+					&t_body, t_data, t_size
+				);
+				if (t_appended != C_BODY_OK) {
+					t_returnCode =
+						(t_appended == C_BODY_TOO_LARGE)
+						? HTTP_REQUEST_ENTITY_TOO_LARGE
+						: DECLINED;
+					break;
+				}
+			}
+
+			/* Cleanup the bucket brigade */
+			apr_brigade_cleanup(t_bucketBrigade);
+		} while ((!t_seenEOS) && (t_returnCode == OK));
+
+		/* Destroy the bucket brigade */
+		apr_brigade_destroy(t_bucketBrigade);
+
+		if (t_returnCode != OK)
+			return t_returnCode;
+
+		/* Check that some data was read successfully */
+		if (t_body.m_size > 0) {
+			*v_body_data = t_body.m_data;
+			*v_body_size = (long)t_body.m_size;
+			return OK;
+		}
+	}
+
+	*v_body_size = 0;
+
+	return DECLINED;
+}
+
+
+/* Typedef for the shared part of a PGRESULT bucket, which lets the output
+  filter chain read a response straight out of libpq's memory */
+typedef struct tCertWatchPGresultBucket {
+	apr_bucket_refcount m_refcount;
+	PGresult* m_PGresult;
+	const char* m_base;
+} tCertWatchPGresultBucket;
+
+
+/******************************************************************************
+ * certwatch_bucket_pgresult_destroy()                                        *
+ *   Destroys a PGRESULT bucket, freeing the PGresult once nothing else       *
+ * refers to it.                                                              *
+ ******************************************************************************/
+static void certwatch_bucket_pgresult_destroy(
+	void* const v_data
+)
+{
+	tCertWatchPGresultBucket* t_PGresultBucket =
+		(tCertWatchPGresultBucket*)v_data;
+
+	if (apr_bucket_shared_destroy(t_PGresultBucket)) {
+		PQclear(t_PGresultBucket->m_PGresult);
+		apr_bucket_free(t_PGresultBucket);
+	}
+}
+
+
+/******************************************************************************
+ * certwatch_bucket_pgresult_read()                                           *
+ *   Reads a PGRESULT bucket.  No copying is required.                        *
+ ******************************************************************************/
+static apr_status_t certwatch_bucket_pgresult_read(
+	apr_bucket* const v_bucket,
+	const char** const v_str,
+	apr_size_t* const v_len,
+	apr_read_type_e v_block_unused
+)
+{
+	tCertWatchPGresultBucket* t_PGresultBucket =
+		(tCertWatchPGresultBucket*)v_bucket->data;
+
+	*v_str = t_PGresultBucket->m_base + v_bucket->start;
+	*v_len = v_bucket->length;
+
+	return APR_SUCCESS;
+}
+
+
+/* The PGresult's lifetime is tied to the bucket rather than to a pool, so
+  setting aside a PGRESULT bucket (e.g. for the event MPM's write completion)
+  requires no work */
+static const apr_bucket_type_t g_bucketTypePGresult = {
+	"PGRESULT", 5, APR_BUCKET_DATA,
+	certwatch_bucket_pgresult_destroy,
+	certwatch_bucket_pgresult_read,
+	apr_bucket_setaside_noop,
+	apr_bucket_shared_split,
+	apr_bucket_shared_copy
+};
+
+
+/******************************************************************************
+ * certwatch_bucket_pgresult_create()                                         *
+ *   Creates a bucket that refers to part of a PGresult's memory.  The bucket *
+ * takes ownership of the PGresult, which is PQclear()ed when the last bucket *
+ * that refers to it is destroyed.                                            *
+ *                                                                            *
+ * IN:	v_PGresult - the result.                                              *
+ * 	v_data - the start of the data, within v_PGresult.                    *
+ * 	v_length - the length of the data (in bytes).                         *
+ * 	v_bucketAlloc - the bucket allocator.                                 *
+ *                                                                            *
+ * Returns:	the new bucket.                                               *
+ ******************************************************************************/
+static apr_bucket* certwatch_bucket_pgresult_create(
+	PGresult* const v_PGresult,
+	const char* const v_data,
+	const apr_size_t v_length,
+	apr_bucket_alloc_t* const v_bucketAlloc
+)
+{
+	apr_bucket* t_bucket = apr_bucket_alloc(
+		sizeof(*t_bucket), v_bucketAlloc
+	);
+	tCertWatchPGresultBucket* t_PGresultBucket = apr_bucket_alloc(
+		sizeof(*t_PGresultBucket), v_bucketAlloc
+	);
+
+	APR_BUCKET_INIT(t_bucket);
+	t_bucket->free = apr_bucket_free;
+	t_bucket->list = v_bucketAlloc;
+
+	t_PGresultBucket->m_PGresult = v_PGresult;
+	t_PGresultBucket->m_base = v_data;
+
+	t_bucket = apr_bucket_shared_make(
+		t_bucket, t_PGresultBucket, 0, v_length
+	);
+	t_bucket->type = &g_bucketTypePGresult;
+
+	return t_bucket;
+}
+
+
+/******************************************************************************
+ * certwatch_spoolResponse()                                                  *
+ *   Copies a large response to an unlinked temporary file, so that the       *
+ * PGresult can be freed straight away rather than held until a slow client   *
+ * has read it all.  The file can then be sent with sendfile() or mmap().     *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_spoolDir - the directory for the file, or NULL for the system       *
+ * 		temporary directory.                                          *
+ * 	v_data - the response body.                                           *
+ * 	v_length - the response body's length.                                *
+ *                                                                            *
+ * OUT:	v_file - the file, which is closed along with the request's pool.    *
+ *                                                                            *
+ * Returns:	APR_SUCCESS or an APR error code.                             *
+ ******************************************************************************/
+static apr_status_t certwatch_spoolResponse(
+	request_rec* const v_request,
+	const char* const v_spoolDir,
+	const char* const v_data,
+	const apr_size_t v_length,
+	apr_file_t** const v_file
+)
+{
+	const char* t_spoolDir = v_spoolDir;
+	char* t_path;
+	apr_status_t t_result;
+
+	if (!t_spoolDir) {
+		t_result = apr_temp_dir_get(&t_spoolDir, v_request->pool);
+		if (t_result != APR_SUCCESS)
+			return t_result;
+	}
+
+	t_path = apr_pstrcat(
+		v_request->pool, t_spoolDir, "/certwatch.XXXXXX", NULL
+	);
+	t_result = apr_file_mktemp(
+		v_file, t_path,
+		APR_FOPEN_CREATE | APR_FOPEN_READ | APR_FOPEN_WRITE
+			| APR_FOPEN_EXCL | APR_FOPEN_BINARY
+			| APR_FOPEN_SENDFILE_ENABLED,
+		v_request->pool
+	);
+	if (t_result != APR_SUCCESS)
+		return t_result;
+
+	/* Unlink the file now, so that it can't be left behind */
+	(void)apr_file_remove(t_path, v_request->pool);
+
+	t_result = apr_file_write_full(*v_file, v_data, v_length, NULL);
+	if (t_result != APR_SUCCESS)
+		apr_file_close(*v_file);
+
+	return t_result;
+}
+
+
+/******************************************************************************
+ * certwatch_applyHeader()                                                    *
+ *   Sets or modifies one HTTP Response header.                               *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_name - the header name.                                             *
+ * 	v_value - the header value.                                           *
+ ******************************************************************************/
+static void certwatch_applyHeader(
+	request_rec* const v_request,
+	const char* const v_name,
+	const char* const v_value
+)
+{
+	if (!strcasecmp(v_name, "Content-Type"))
+		v_request->content_type = apr_pstrdup(v_request->pool, v_value);
+	else if (!strcasecmp(v_name, "Vary"))
+		/* Keep the Vary: Accept-Encoding that compression added */
+		apr_table_merge(v_request->headers_out, v_name, v_value);
+	else
+		apr_table_set(v_request->headers_out, v_name, v_value);
+}
+
+
+/******************************************************************************
+ * certwatch_applyHeaderLines()                                               *
+ *   Sets or modifies the HTTP Response headers as requested by a block of    *
+ * "Name: value\n" lines.                                                     *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_lines - the header lines (which are modified in place).             *
+ * 	v_end - the end of the header lines.                                  *
+ ******************************************************************************/
+static void certwatch_applyHeaderLines(
+	request_rec* const v_request,
+	char* v_lines,
+	const char* const v_end
+)
+{
+	char* t_name;
+	char* t_value;
+
+	while (certwatch_nextHeader(&v_lines, v_end, &t_name, &t_value))
+		certwatch_applyHeader(v_request, t_name, t_value);
+}
+
+
+/******************************************************************************
+ * certwatch_applyHeaders()                                                   *
+ *   If a function's response starts with a [BEGIN_HEADERS] block, set or     *
+ * modify the HTTP Response headers as requested and skip past the block.     *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * IN/OUT:	v_response - the function's response.                         *
+ * 		v_response_len - the length of v_response (in bytes).         *
+ *                                                                            *
+ * OUT:	v_headerLines - if not NULL, a copy of the block's header lines.      *
+ *                                                                            *
+ * Returns:	1 if a [BEGIN_HEADERS] block was found; otherwise 0.          *
+ ******************************************************************************/
+static int certwatch_applyHeaders(
+	request_rec* const v_request,
+	char** const v_response,
+	int* const v_response_len,
+	const char** const v_headerLines
+)
+{
+	char* t_response = *v_response;
+	char* t_lines;
+	char* t_endOfHeaders;
+
+	if (!certwatch_findHeaders(
+			t_response, *v_response_len, &t_lines, &t_endOfHeaders))
+		return 0;
+
+	if (v_headerLines)
+		*v_headerLines = apr_pstrmemdup(
+			v_request->pool, t_lines, t_endOfHeaders - t_lines
+		);
+
+	/* Customize the HTTP headers as requested by the function's response */
+	certwatch_applyHeaderLines(v_request, t_lines, t_endOfHeaders);
+
+	*v_response_len -= (t_endOfHeaders - t_response);
+	*v_response_len -= strlen(C_HTTP_HEADERS_CLOSE);
+	*v_response = t_endOfHeaders + strlen(C_HTTP_HEADERS_CLOSE);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_readInt32()                                                      *
+ *   Reads a network byte order 32-bit integer from a binary result.          *
+ ******************************************************************************/
+static apr_int32_t certwatch_readInt32(
+	const char* const v_data
+)
+{
+	const unsigned char* t_data = (const unsigned char*)v_data;
+
+	return (apr_int32_t)(((apr_uint32_t)t_data[0] << 24)
+				| ((apr_uint32_t)t_data[1] << 16)
+				| ((apr_uint32_t)t_data[2] << 8)
+				| (apr_uint32_t)t_data[3]);
+}
+
+
+/******************************************************************************
+ * certwatch_applyFramedHeaders()                                             *
+ *   Sets or modifies the HTTP Response headers as requested by the binary    *
+ * form of a one-dimensional text[] of "Name: value" elements.               *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_array - the array.                                                  *
+ * 	v_array_len - the length of v_array (in bytes).                       *
+ *                                                                            *
+ * OUT:	v_headerLines - if not NULL, the headers as "Name: value\n" lines.    *
+ *                                                                            *
+ * Returns:	1 if the array was well-formed; otherwise 0.                  *
+ ******************************************************************************/
+static int certwatch_applyFramedHeaders(
+	request_rec* const v_request,
+	const char* const v_array,
+	const apr_int32_t v_array_len,
+	const char** const v_headerLines
+)
+{
+	const char* t_element = v_array + 20;
+	const char* t_end = v_array + v_array_len;
+	apr_array_header_t* t_lines = NULL;
+	apr_int32_t t_nElements;
+	apr_int32_t t_element_len;
+	const char* t_colon;
+	const char* t_value;
+	char* t_name;
+
+	/* Array: number of dimensions, has-nulls flag and element type; then
+	  the dimension's size and lower bound; then each element's length (-1
+	  = NULL) and value */
+	if (v_array_len < 12)
+		return 0;
+	else if (certwatch_readInt32(v_array) == 0)
+		return 1;	/* Empty array */
+	else if ((certwatch_readInt32(v_array) != 1) || (v_array_len < 20))
+		return 0;
+	t_nElements = certwatch_readInt32(v_array + 12);
+
+	if (v_headerLines)
+		t_lines = apr_array_make(
+			v_request->pool, 8, sizeof(const char*)
+		);
+
+	for (; t_nElements > 0; t_nElements--) {
+		if ((t_end - t_element) < 4)
+			return 0;
+		t_element_len = certwatch_readInt32(t_element);
+		t_element += 4;
+		if (t_element_len < 0)
+			continue;	/* NULL */
+		else if (t_element_len > (t_end - t_element))
+			return 0;
+
+		t_colon = memchr(t_element, ':', t_element_len);
+		if (t_colon) {
+			t_name = apr_pstrmemdup(
+				v_request->pool, t_element, t_colon - t_element
+			);
+			for (t_value = t_colon + 1;
+					(t_value < (t_element + t_element_len))
+						&& apr_isspace(*t_value);
+					t_value++);
+			t_value = apr_pstrmemdup(
+				v_request->pool, t_value,
+				(t_element + t_element_len) - t_value
+			);
+			certwatch_applyHeader(v_request, t_name, t_value);
+			if (t_lines)
+				APR_ARRAY_PUSH(t_lines, const char*) =
+					apr_pstrcat(
+						v_request->pool, t_name, ": ",
+						t_value, "\n", NULL
+					);
+		}
+		t_element += t_element_len;
+	}
+
+	if (t_lines)
+		*v_headerLines = apr_array_pstrcat(
+			v_request->pool, t_lines, '\0'
+		);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_applyFramed()                                                    *
+ *   Unpacks web_apis_framed()'s binary (headers text[], body bytea) result,  *
+ * setting or modifying the HTTP Response headers and locating the body      *
+ * without scanning or decoding it.                                           *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_PGresult - the result.                                              *
+ *                                                                            *
+ * OUT:	v_body - the body, in the result's memory.                            *
+ * 	v_body_len - the body's length.                                       *
+ * 	v_headerLines - if not NULL, the headers as "Name: value\n" lines.    *
+ *                                                                            *
+ * Returns:	1 if the result was well-formed; otherwise 0.                 *
+ ******************************************************************************/
+static int certwatch_applyFramed(
+	request_rec* const v_request,
+	PGresult* const v_PGresult,
+	char** const v_body,
+	int* const v_body_len,
+	const char** const v_headerLines
+)
+{
+	char* t_field = PQgetvalue(v_PGresult, 0, 0);
+	const char* t_end = t_field + PQgetlength(v_PGresult, 0, 0);
+	apr_int32_t t_field_len;
+
+	/* Record: number of columns; then each column's type OID, length (-1 =
+	  NULL) and value */
+	if ((PQfformat(v_PGresult, 0) != 1) || ((t_end - t_field) < 12)
+			|| (certwatch_readInt32(t_field) != 2))
+		return 0;
+	t_field_len = certwatch_readInt32(t_field + 8);
+	t_field += 12;
+	if (t_field_len > (t_end - t_field))
+		return 0;
+	else if (t_field_len > 0) {
+		if (!certwatch_applyFramedHeaders(
+				v_request, t_field, t_field_len,
+				v_headerLines))
+			return 0;
+		t_field += t_field_len;
+	}
+
+	if ((t_end - t_field) < 8)
+		return 0;
+	t_field_len = certwatch_readInt32(t_field + 4);
+	t_field += 8;
+	if (t_field_len > (t_end - t_field))
+		return 0;
+
+	*v_body = t_field;
+	*v_body_len = (t_field_len > 0) ? t_field_len : 0;
+
+	return 1;
+}
+
+
+/* Typedef for a response that's being compressed */
+#define C_COMPRESS_BUFFER_SIZE	65536	/* Bytes of output per bucket */
+
+#define C_COMPRESS_CONTINUE	0	/* More input follows */
+#define C_COMPRESS_FLUSH	1	/* Make all the output so far decodable */
+#define C_COMPRESS_FINISH	2	/* End the stream */
+
+typedef struct tCertWatchCompressor {
+	int m_encoding;			/* C_ENCODING_* */
+	z_stream m_zStream;
+#ifdef HAVE_BROTLI
+	BrotliEncoderState* m_brotli;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx* m_zstd;
+#endif
+	apr_bucket_alloc_t* m_bucketAlloc;
+	unsigned char* m_buffer;	/* C_COMPRESS_BUFFER_SIZE bytes */
+} tCertWatchCompressor;
+
+
+/******************************************************************************
+ * certwatch_compress_negotiate()                                             *
+ *   Chooses the content coding for a response from those that are offered,   *
+ * according to the client's Accept-Encoding header.  Of the codings that the *
+ * client likes best, the first one offered wins, unless the client prefers   *
+ * identity to all of them.                                                   *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_certWatchDirConfig - the per-directory configuration.               *
+ *                                                                            *
+ * Returns:	the content coding (C_ENCODING_*).                            *
+ ******************************************************************************/
+static int certwatch_compress_negotiate(
+	request_rec* const v_request,
+	const tCertWatchDirConfig* const v_certWatchDirConfig
+)
+{
+	const char* t_acceptEncoding = apr_table_get(
+		v_request->headers_in, "Accept-Encoding"
+	);
+	double t_q[C_ENCODING_COUNT];
+	double t_qOthers = 0;		/* From "*" */
+	double t_qBest = 0;
+	double t_qThis;
+	char* t_list;
+	char* t_coding;
+	char* t_params;
+	const char* t_qValue;
+	char* t_state;
+	int t_best = C_ENCODING_IDENTITY;
+	int i;
+
+	if (!t_acceptEncoding)
+		return C_ENCODING_IDENTITY;
+
+	/* e.g. "gzip, deflate, br;q=0.9, zstd" */
+	for (i = 0; i < C_ENCODING_COUNT; i++)
+		t_q[i] = -1;
+	t_list = apr_pstrdup(v_request->pool, t_acceptEncoding);
+	for (t_coding = apr_strtok(t_list, ",", &t_state); t_coding;
+			t_coding = apr_strtok(NULL, ",", &t_state)) {
+		t_params = strchr(t_coding, ';');
+		if (t_params)
+			*(t_params++) = '\0';
+		apr_collapse_spaces(t_coding, t_coding);
+
+		t_qThis = 1;
+		if (t_params
+				&& (t_qValue = ap_strcasestr(t_params, "q=")))
+			t_qThis = atof(t_qValue + 2);
+
+		if (!strcmp(t_coding, "*"))
+			t_qOthers = t_qThis;
+		else if (!strcasecmp(t_coding, "x-gzip"))
+			t_q[C_ENCODING_GZIP] = t_qThis;
+		else
+			for (i = 0; i < C_ENCODING_COUNT; i++)
+				if (!strcasecmp(t_coding, g_encodingName[i]))
+					t_q[i] = t_qThis;
+	}
+
+	for (i = 0; i < v_certWatchDirConfig->m_nCompress; i++) {
+		int t_encoding = v_certWatchDirConfig->m_compress[i];
+		t_qThis = (t_q[t_encoding] >= 0) ? t_q[t_encoding] : t_qOthers;
+		if (t_qThis > t_qBest) {
+			t_qBest = t_qThis;
+			t_best = t_encoding;
+		}
+	}
+
+	/* e.g. "gzip;q=0.5, identity" asks for an uncompressed response.  An
+	  identity that isn't mentioned (even by "*") is only the fallback */
+	t_qThis = (t_q[C_ENCODING_IDENTITY] >= 0) ? t_q[C_ENCODING_IDENTITY]
+			: t_qOthers;
+	if (t_qBest < t_qThis)
+		t_best = C_ENCODING_IDENTITY;
+
+	return t_best;
+}
+
+
+/******************************************************************************
+ * certwatch_compress_isCompressible()                                        *
+ *   Determines whether a response is worth compressing.                      *
+ *                                                                            *
+ * IN:	v_request - the request record (with the response's headers).        *
+ * 	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_length - the body's length (in bytes), or -1 if it's not known.     *
+ *                                                                            *
+ * Returns:	1 if the response should be compressed; otherwise 0.          *
+ ******************************************************************************/
+static int certwatch_compress_isCompressible(
+	request_rec* const v_request,
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	const apr_off_t v_length
+)
+{
+	const char* t_contentType = v_request->content_type;
+
+	if ((v_length >= 0)
+			&& (v_length < v_certWatchDirConfig->m_compressMinSize))
+		return 0;
+	/* The function may have compressed the body itself */
+	else if (apr_table_get(v_request->headers_out, "Content-Encoding")
+			|| (!t_contentType))
+		return 0;
+
+	/* Images, certificates, etc. are compressed already or are too small
+	  to benefit */
+	return (!strncasecmp(t_contentType, "text/", 5))
+		|| ap_strcasestr(t_contentType, "json")
+		|| ap_strcasestr(t_contentType, "xml")
+		|| ap_strcasestr(t_contentType, "javascript");
+}
+
+
+/******************************************************************************
+ * certwatch_compress_setHeaders()                                            *
+ *   Labels a response as compressed.  Like mod_deflate, the coding is added  *
+ * to the ETag, since the compressed representation differs.                  *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_encoding - the content coding (C_ENCODING_*).                       *
+ ******************************************************************************/
+static void certwatch_compress_setHeaders(
+	request_rec* const v_request,
+	const int v_encoding
+)
+{
+	const char* t_eTag = apr_table_get(v_request->headers_out, "ETag");
+	apr_size_t t_eTag_len;
+
+	apr_table_setn(
+		v_request->headers_out, "Content-Encoding",
+		g_encodingName[v_encoding]
+	);
+	apr_table_unset(v_request->headers_out, "Content-Length");
+
+	if (!t_eTag)
+		return;
+	t_eTag_len = strlen(t_eTag);
+	if ((t_eTag_len > 0) && (t_eTag[t_eTag_len - 1] == '"'))
+		t_eTag = apr_psprintf(
+			v_request->pool, "%.*s-%s\"", (int)(t_eTag_len - 1),
+			t_eTag, g_encodingName[v_encoding]
+		);
+	else
+		t_eTag = apr_pstrcat(
+			v_request->pool, t_eTag, "-",
+			g_encodingName[v_encoding], NULL
+		);
+	apr_table_setn(v_request->headers_out, "ETag", t_eTag);
+}
+
+
+/******************************************************************************
+ * certwatch_compress_destroy()                                               *
+ *   Frees a compressor's library state.  Runs as a request pool cleanup.     *
+ *                                                                            *
+ * IN:	v_compressor - the compressor.                                        *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t certwatch_compress_destroy(
+	void* const v_compressor
+)
+{
+	tCertWatchCompressor* t_compressor =
+		(tCertWatchCompressor*)v_compressor;
+
+	switch (t_compressor->m_encoding) {
+		case C_ENCODING_GZIP:
+			(void)deflateEnd(&t_compressor->m_zStream);
+			break;
+#ifdef HAVE_BROTLI
+		case C_ENCODING_BROTLI:
+			BrotliEncoderDestroyInstance(t_compressor->m_brotli);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case C_ENCODING_ZSTD:
+			(void)ZSTD_freeCCtx(t_compressor->m_zstd);
+			break;
+#endif
+	}
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_compress_begin()                                                 *
+ *   Starts compressing a response.                                           *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_encoding - the content coding (C_ENCODING_*).                       *
+ * 	v_length - the body's length (in bytes), or -1 if it's not known.     *
+ *                                                                            *
+ * Returns:	pointer to the compressor, or NULL if an error occurred.      *
+ ******************************************************************************/
+static tCertWatchCompressor* certwatch_compress_begin(
+	request_rec* const v_request,
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	const int v_encoding,
+	const apr_off_t v_length
+)
+{
+	tCertWatchCompressor* t_compressor = apr_pcalloc(
+		v_request->pool, sizeof(*t_compressor)
+	);
+	int t_level = v_certWatchDirConfig->m_compressLevel[v_encoding];
+
+	t_compressor->m_encoding = v_encoding;
+	t_compressor->m_bucketAlloc = v_request->connection->bucket_alloc;
+	t_compressor->m_buffer = apr_palloc(
+		v_request->pool, C_COMPRESS_BUFFER_SIZE
+	);
+
+	switch (v_encoding) {
+		case C_ENCODING_GZIP:
+			/* 15 + 16 = a 32KB window, in a gzip wrapper */
+			if (deflateInit2(
+					&t_compressor->m_zStream, t_level,
+					Z_DEFLATED, 15 + 16, 8,
+					Z_DEFAULT_STRATEGY) != Z_OK)
+				goto label_error;
+			break;
+#ifdef HAVE_BROTLI
+		case C_ENCODING_BROTLI:
+			t_compressor->m_brotli = BrotliEncoderCreateInstance(
+				NULL, NULL, NULL
+			);
+			if (!t_compressor->m_brotli)
+				goto label_error;
+			(void)BrotliEncoderSetParameter(
+				t_compressor->m_brotli, BROTLI_PARAM_QUALITY,
+				t_level
+			);
+			(void)BrotliEncoderSetParameter(
+				t_compressor->m_brotli, BROTLI_PARAM_MODE,
+				BROTLI_MODE_TEXT
+			);
+			if ((v_length >= 0) && (v_length < (1 << 30)))
+				(void)BrotliEncoderSetParameter(
+					t_compressor->m_brotli,
+					BROTLI_PARAM_SIZE_HINT, v_length
+				);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case C_ENCODING_ZSTD:
+			t_compressor->m_zstd = ZSTD_createCCtx();
+			if (!t_compressor->m_zstd)
+				goto label_error;
+			(void)ZSTD_CCtx_setParameter(
+				t_compressor->m_zstd, ZSTD_c_compressionLevel,
+				t_level
+			);
+			/* Knowing the size lets a small response use a small
+			  window, and records the size in the frame header */
+			if (v_length >= 0)
+				(void)ZSTD_CCtx_setPledgedSrcSize(
+					t_compressor->m_zstd, v_length
+				);
+			break;
+#endif
+		default:
+			goto label_error;
+	}
+
+	apr_pool_cleanup_register(
+		v_request->pool, t_compressor, certwatch_compress_destroy,
+		apr_pool_cleanup_null
+	);
+
+	return t_compressor;
+
+label_error:
+	ap_log_rerror(
+		APLOG_MARK, APLOG_ERR, 0, v_request,
+		"Unable to start %s compression", g_encodingName[v_encoding]
+	);
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_compress_write()                                                 *
+ *   Compresses some of a response, appending whatever output is ready to a  *
+ * brigade.                                                                   *
+ *                                                                            *
+ * IN:	v_compressor - the compressor.                                        *
+ * 	v_data - the data.                                                    *
+ * 	v_length - the length of v_data (in bytes).                           *
+ * 	v_mode - C_COMPRESS_CONTINUE, C_COMPRESS_FLUSH or C_COMPRESS_FINISH.  *
+ *                                                                            *
+ * IN/OUT:	v_bucketBrigade - the brigade.                                *
+ *                                                                            *
+ * Returns:	1 on success; 0 if an error occurred.                         *
+ ******************************************************************************/
+static int certwatch_compress_write(
+	tCertWatchCompressor* const v_compressor,
+	const char* const v_data,
+	const apr_size_t v_length,
+	const int v_mode,
+	apr_bucket_brigade* const v_bucketBrigade
+)
+{
+	apr_size_t t_output_len;
+
+	switch (v_compressor->m_encoding) {
+		case C_ENCODING_GZIP: {
+			z_stream* t_zStream = &v_compressor->m_zStream;
+			t_zStream->next_in = (Bytef*)v_data;
+			t_zStream->avail_in = v_length;
+			/* deflate() has consumed all of the input, and output all
+			  that it can, once there's space left over */
+			do {
+				t_zStream->next_out = v_compressor->m_buffer;
+				t_zStream->avail_out = C_COMPRESS_BUFFER_SIZE;
+				if (deflate(t_zStream,
+						(v_mode == C_COMPRESS_FINISH)
+							? Z_FINISH
+						: (v_mode == C_COMPRESS_FLUSH)
+							? Z_SYNC_FLUSH
+						: Z_NO_FLUSH) == Z_STREAM_ERROR)
+					return 0;
+				t_output_len = C_COMPRESS_BUFFER_SIZE
+						- t_zStream->avail_out;
+				if (t_output_len > 0)
+					APR_BRIGADE_INSERT_TAIL(
+						v_bucketBrigade,
+						apr_bucket_heap_create(
+							(char*)v_compressor
+								->m_buffer,
+							t_output_len, NULL,
+							v_compressor
+								->m_bucketAlloc
+						)
+					);
+			} while (t_zStream->avail_out == 0);
+			return 1;
+		}
+#ifdef HAVE_BROTLI
+		case C_ENCODING_BROTLI: {
+			BrotliEncoderOperation t_op =
+				(v_mode == C_COMPRESS_FINISH)
+					? BROTLI_OPERATION_FINISH
+				: (v_mode == C_COMPRESS_FLUSH)
+					? BROTLI_OPERATION_FLUSH
+				: BROTLI_OPERATION_PROCESS;
+			const uint8_t* t_nextIn = (const uint8_t*)v_data;
+			size_t t_availIn = v_length;
+			uint8_t* t_nextOut;
+			size_t t_availOut;
+			for (;;) {
+				t_nextOut = v_compressor->m_buffer;
+				t_availOut = C_COMPRESS_BUFFER_SIZE;
+				if (!BrotliEncoderCompressStream(
+						v_compressor->m_brotli, t_op,
+						&t_availIn, &t_nextIn,
+						&t_availOut, &t_nextOut, NULL))
+					return 0;
+				t_output_len = C_COMPRESS_BUFFER_SIZE
+						- t_availOut;
+				if (t_output_len > 0)
+					APR_BRIGADE_INSERT_TAIL(
+						v_bucketBrigade,
+						apr_bucket_heap_create(
+							(char*)v_compressor
+								->m_buffer,
+							t_output_len, NULL,
+							v_compressor
+								->m_bucketAlloc
+						)
+					);
+				if ((t_availIn == 0)
+						&& (!BrotliEncoderHasMoreOutput(
+							v_compressor->m_brotli))
+						&& ((t_op != BROTLI_OPERATION_FINISH)
+							|| BrotliEncoderIsFinished(
+								v_compressor
+									->m_brotli
+							)))
+					return 1;
+			}
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case C_ENCODING_ZSTD: {
+			ZSTD_EndDirective t_op =
+				(v_mode == C_COMPRESS_FINISH) ? ZSTD_e_end
+				: (v_mode == C_COMPRESS_FLUSH) ? ZSTD_e_flush
+				: ZSTD_e_continue;
+			ZSTD_inBuffer t_in = { v_data, v_length, 0 };
+			ZSTD_outBuffer t_out;
+			size_t t_remaining;
+			for (;;) {
+				t_out.dst = v_compressor->m_buffer;
+				t_out.size = C_COMPRESS_BUFFER_SIZE;
+				t_out.pos = 0;
+				t_remaining = ZSTD_compressStream2(
+					v_compressor->m_zstd, &t_out, &t_in,
+					t_op
+				);
+				if (ZSTD_isError(t_remaining))
+					return 0;
+				if (t_out.pos > 0)
+					APR_BRIGADE_INSERT_TAIL(
+						v_bucketBrigade,
+						apr_bucket_heap_create(
+							(char*)v_compressor
+								->m_buffer,
+							t_out.pos, NULL,
+							v_compressor
+								->m_bucketAlloc
+						)
+					);
+				if ((t_op == ZSTD_e_continue)
+						? (t_in.pos == t_in.size)
+						: (t_remaining == 0))
+					return 1;
+			}
+		}
+#endif
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * certwatch_compress_buffer()                                                *
+ *   Compresses a whole response into memory, so that it can be cached in     *
+ * compressed form.                                                           *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_compressor - the compressor, which is finished with.                *
+ * 	v_data - the body.                                                    *
+ * 	v_length - the length of v_data (in bytes).                           *
+ *                                                                            *
+ * OUT:	v_compressed_len - the length of the compressed body (in bytes).      *
+ *                                                                            *
+ * Returns:	the compressed body (in the request's pool), or NULL if an    *
+ * 		error occurred.                                               *
+ ******************************************************************************/
+static char* certwatch_compress_buffer(
+	request_rec* const v_request,
+	tCertWatchCompressor* const v_compressor,
+	const char* const v_data,
+	const apr_size_t v_length,
+	apr_size_t* const v_compressed_len
+)
+{
+	apr_bucket_brigade* t_bucketBrigade = apr_brigade_create(
+		v_request->pool, v_request->connection->bucket_alloc
+	);
+	char* t_compressed = NULL;
+
+	if (certwatch_compress_write(
+			v_compressor, v_data, v_length, C_COMPRESS_FINISH,
+			t_bucketBrigade)
+			&& (apr_brigade_pflatten(
+				t_bucketBrigade, &t_compressed,
+				v_compressed_len, v_request->pool
+			) != APR_SUCCESS))
+		t_compressed = NULL;
+	apr_brigade_destroy(t_bucketBrigade);
+
+	return t_compressed;
+}
+
+
+/******************************************************************************
+ * certwatch_cutShort()                                                       *
+ *   Ends a response whose status line has already been sent, so that the     *
+ * client can tell that it's incomplete.  httpd's chunking filter withholds   *
+ * the terminating 0-chunk only after a 502 or 504 error bucket, and the      *
+ * connection is closed so that an unchunked body is cut short too.           *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_bucketBrigade - an empty brigade.                                   *
+ ******************************************************************************/
+static void certwatch_cutShort(
+	request_rec* const v_request,
+	apr_bucket_brigade* const v_bucketBrigade
+)
+{
+	v_request->connection->keepalive = AP_CONN_CLOSE;
+	APR_BRIGADE_INSERT_TAIL(
+		v_bucketBrigade,
+		ap_bucket_error_create(
+			HTTP_BAD_GATEWAY, NULL, v_request->pool,
+			v_request->connection->bucket_alloc
+		)
+	);
+	APR_BRIGADE_INSERT_TAIL(
+		v_bucketBrigade,
+		apr_bucket_eos_create(v_request->connection->bucket_alloc)
+	);
+	ap_pass_brigade(v_request->output_filters, v_bucketBrigade);
+}
+
+
+/******************************************************************************
+ * certwatch_compress_send()                                                  *
+ *   Compresses a response as it's sent, passing each piece of output down    *
+ * the output filter chain as soon as it's ready, followed by an EOS.         *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_compressor - the compressor, which is finished with.                *
+ * 	v_data - the body.                                                    *
+ * 	v_length - the length of v_data (in bytes).                           *
+ *                                                                            *
+ * Returns:	1 on success; 0 if an error occurred, in which case the       *
+ * 		response has been cut short.                                  *
+ ******************************************************************************/
+static int certwatch_compress_send(
+	request_rec* const v_request,
+	tCertWatchCompressor* const v_compressor,
+	const char* const v_data,
+	const apr_size_t v_length
+)
+{
+	apr_bucket_brigade* t_bucketBrigade = apr_brigade_create(
+		v_request->pool, v_request->connection->bucket_alloc
+	);
+	apr_size_t t_offset = 0;
+	apr_size_t t_chunk_len;
+	int t_mode;
+
+	do {
+		t_chunk_len = v_length - t_offset;
+		if (t_chunk_len > C_COMPRESS_BUFFER_SIZE)
+			t_chunk_len = C_COMPRESS_BUFFER_SIZE;
+		t_mode = ((t_offset + t_chunk_len) == v_length)
+				? C_COMPRESS_FINISH : C_COMPRESS_CONTINUE;
+		if (!certwatch_compress_write(
+				v_compressor, v_data + t_offset, t_chunk_len,
+				t_mode, t_bucketBrigade)) {
+			/* Some of the body may have been sent already */
+			apr_brigade_cleanup(t_bucketBrigade);
+			certwatch_cutShort(v_request, t_bucketBrigade);
+			apr_brigade_destroy(t_bucketBrigade);
+			return 0;
+		}
+		t_offset += t_chunk_len;
+
+		if (t_mode == C_COMPRESS_FINISH)
+			APR_BRIGADE_INSERT_TAIL(
+				t_bucketBrigade,
+				apr_bucket_eos_create(
+					v_request->connection->bucket_alloc
+				)
+			);
+		/* Stop if the client has gone away */
+		if ((!APR_BRIGADE_EMPTY(t_bucketBrigade))
+				&& (ap_pass_brigade(
+					v_request->output_filters,
+					t_bucketBrigade
+				) != APR_SUCCESS))
+			break;
+		apr_brigade_cleanup(t_bucketBrigade);
+	} while (t_mode != C_COMPRESS_FINISH);
+
+	apr_brigade_destroy(t_bucketBrigade);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_streamResponse()                                                 *
+ *   Runs web_apis_stream() in single-row mode, passing each row (a chunk of  *
+ * the response) down the output filter chain and flushing it as soon as it   *
+ * arrives, compressed if the client accepts a coding that's offered.  The   *
+ * first row may start with a [BEGIN_HEADERS] block.                          *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_query - the query state (the statement has been sent).              *
+ * 	v_encoding - the negotiated content coding (C_ENCODING_*).            *
+ *                                                                            *
+ * OUT:	v_PGresult - if the query failed before any output was sent, the      *
+ * 		failed result (which the caller must PQclear()); otherwise    *
+ * 		NULL.                                                         *
+ *                                                                            *
+ * Returns:	OK, or DECLINED if there was no response.                     *
+ ******************************************************************************/
+static int certwatch_streamResponse(
+	request_rec* const v_request,
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	tCertWatchQuery* const v_query,
+	const int v_encoding,
+	PGresult** const v_PGresult
+)
+{
+	apr_bucket_brigade* t_bucketBrigade;
+	tCertWatchCompressor* t_compressor = NULL;
+	PGresult* t_PGresult;
+	char* t_chunk;
+	int t_chunk_len;
+	int t_nChunks = 0;
+	int t_failed = 0;
+
+	*v_PGresult = NULL;
+	(void)PQsetSingleRowMode(v_query->m_conn->m_PGconn);
+
+	t_bucketBrigade = apr_brigade_create(
+		v_request->pool, v_request->connection->bucket_alloc
+	);
+
+	/* Consume every result, even after an error, so that the connection is
+	  left idle */
+	while ((t_PGresult = certwatch_query_getResult(v_query))) {
+		if (t_failed || (PQresultStatus(t_PGresult) == PGRES_TUPLES_OK)) {
+			PQclear(t_PGresult);
+			continue;
+		}
+		else if (PQresultStatus(t_PGresult) != PGRES_SINGLE_TUPLE) {
+			t_failed = 1;
+			if (!t_nChunks) {
+				*v_PGresult = t_PGresult;
+				continue;
+			}
+
+			/* The status line has already been sent, so all we can
+			  do is cut the response short */
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, 0, NULL,
+				"web_apis_stream() => %s",
+				PQresultErrorMessage(t_PGresult)
+			);
+			PQclear(t_PGresult);
+			certwatch_cutShort(v_request, t_bucketBrigade);
+			continue;
+		}
+
+		t_chunk = PQgetvalue(t_PGresult, 0, 0);
+		t_chunk_len = PQgetlength(t_PGresult, 0, 0);
+		if (!t_nChunks++) {
+			/* If no HTTP header customization was requested, set
+			  some defaults */
+			if (!certwatch_applyHeaders(
+					v_request, &t_chunk, &t_chunk_len,
+					NULL))
+				v_request->content_type =
+					"text/html; charset=UTF-8";
+
+			/* The length isn't known yet, so compress any response
+			  of a suitable type */
+			if (v_encoding && certwatch_compress_isCompressible(
+					v_request, v_certWatchDirConfig, -1)) {
+				t_compressor = certwatch_compress_begin(
+					v_request, v_certWatchDirConfig,
+					v_encoding, -1
+				);
+				if (t_compressor)
+					certwatch_compress_setHeaders(
+						v_request, v_encoding
+					);
+			}
+		}
+
+		/* Send this chunk on its way.  A compressed chunk is flushed
+		  from the compressor too, so that the client can decode it
+		  straight away */
+		if ((t_chunk_len > 0) && (!t_compressor))
+			ap_fwrite(
+				v_request->output_filters, t_bucketBrigade,
+				t_chunk, t_chunk_len
+			);
+		else if ((t_chunk_len > 0) && !certwatch_compress_write(
+				t_compressor, t_chunk, t_chunk_len,
+				C_COMPRESS_FLUSH, t_bucketBrigade)) {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, 0, NULL,
+				"Unable to compress the response"
+			);
+			t_failed = 1;
+			apr_brigade_cleanup(t_bucketBrigade);
+			certwatch_cutShort(v_request, t_bucketBrigade);
+		}
+		if ((t_chunk_len > 0) && !t_failed)
+			ap_fflush(v_request->output_filters, t_bucketBrigade);
+		PQclear(t_PGresult);
+	}
+
+	/* End the compressed stream */
+	if (t_compressor && !t_failed
+			&& certwatch_compress_write(
+				t_compressor, NULL, 0, C_COMPRESS_FINISH,
+				t_bucketBrigade))
+		ap_pass_brigade(v_request->output_filters, t_bucketBrigade);
+
+	apr_brigade_destroy(t_bucketBrigade);
+
+	return ((t_nChunks > 0) || *v_PGresult) ? OK : DECLINED;
+}
+
+
+/* XXH64 (https://github.com/Cyan4973/xxHash) constants */
+#define C_XXH_PRIME64_1		APR_UINT64_C(0x9E3779B185EBCA87)
+#define C_XXH_PRIME64_2		APR_UINT64_C(0xC2B2AE3D27D4EB4F)
+#define C_XXH_PRIME64_3		APR_UINT64_C(0x165667B19E3779F9)
+#define C_XXH_PRIME64_4		APR_UINT64_C(0x85EBCA77C2B2AE63)
+#define C_XXH_PRIME64_5		APR_UINT64_C(0x27D4EB2F165667C5)
+#define XXH_ROTL64(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+
+/******************************************************************************
+ * certwatch_xxh64_read()                                                     *
+ *   Reads a little-endian integer of up to 8 bytes.                          *
+ ******************************************************************************/
+static apr_uint64_t certwatch_xxh64_read(
+	const unsigned char* const v_data,
+	const int v_size
+)
+{
+	apr_uint64_t t_value = 0;
+	int i;
+
+	for (i = v_size - 1; i >= 0; i--)
+		t_value = (t_value << 8) | v_data[i];
+
+	return t_value;
+}
+
+
+/******************************************************************************
+ * certwatch_xxh64_round()                                                    *
+ ******************************************************************************/
+static apr_uint64_t certwatch_xxh64_round(
+	apr_uint64_t v_acc,
+	const apr_uint64_t v_input
+)
+{
+	v_acc += v_input * C_XXH_PRIME64_2;
+	v_acc = XXH_ROTL64(v_acc, 31);
+
+	return v_acc * C_XXH_PRIME64_1;
+}
+
+
+/******************************************************************************
+ * certwatch_xxh64_merge()                                                    *
+ ******************************************************************************/
+static apr_uint64_t certwatch_xxh64_merge(
+	apr_uint64_t v_acc,
+	const apr_uint64_t v_value
+)
+{
+	v_acc ^= certwatch_xxh64_round(0, v_value);
+
+	return (v_acc * C_XXH_PRIME64_1) + C_XXH_PRIME64_4;
+}
+
+
+/******************************************************************************
+ * certwatch_xxh64()                                                          *
+ *   Calculates the XXH64 hash (with seed 0) of some data.                    *
+ *                                                                            *
+ * IN:	v_data - the data.                                                    *
+ * 	v_length - the data's length.                                         *
+ *                                                                            *
+ * Returns:	the hash.                                                     *
+ ******************************************************************************/
+static apr_uint64_t certwatch_xxh64(
+	const void* const v_data,
+	const apr_size_t v_length
+)
+{
+	const unsigned char* t_data = (const unsigned char*)v_data;
+	const unsigned char* t_end = t_data + v_length;
+	apr_uint64_t t_hash;
+	apr_uint64_t t_acc[4];
+
+	if (v_length >= 32) {
+		t_acc[0] = C_XXH_PRIME64_1 + C_XXH_PRIME64_2;
+		t_acc[1] = C_XXH_PRIME64_2;
+		t_acc[2] = 0;
+		t_acc[3] = -C_XXH_PRIME64_1;
+		do {
+			t_acc[0] = certwatch_xxh64_round(
+				t_acc[0], certwatch_xxh64_read(t_data, 8)
+			);
+			t_acc[1] = certwatch_xxh64_round(
+				t_acc[1], certwatch_xxh64_read(t_data + 8, 8)
+			);
+			t_acc[2] = certwatch_xxh64_round(
+				t_acc[2], certwatch_xxh64_read(t_data + 16, 8)
+			);
+			t_acc[3] = certwatch_xxh64_round(
+				t_acc[3], certwatch_xxh64_read(t_data + 24, 8)
+			);
+			t_data += 32;
+		} while ((t_end - t_data) >= 32);
+
+		t_hash = XXH_ROTL64(t_acc[0], 1) + XXH_ROTL64(t_acc[1], 7)
+			+ XXH_ROTL64(t_acc[2], 12) + XXH_ROTL64(t_acc[3], 18);
+		t_hash = certwatch_xxh64_merge(t_hash, t_acc[0]);
+		t_hash = certwatch_xxh64_merge(t_hash, t_acc[1]);
+		t_hash = certwatch_xxh64_merge(t_hash, t_acc[2]);
+		t_hash = certwatch_xxh64_merge(t_hash, t_acc[3]);
+	}
+	else
+		t_hash = C_XXH_PRIME64_5;
+
+	t_hash += v_length;
+
+	for (; (t_end - t_data) >= 8; t_data += 8) {
+		t_hash ^= certwatch_xxh64_round(
+			0, certwatch_xxh64_read(t_data, 8)
+		);
+		t_hash = (XXH_ROTL64(t_hash, 27) * C_XXH_PRIME64_1)
+				+ C_XXH_PRIME64_4;
+	}
+	if ((t_end - t_data) >= 4) {
+		t_hash ^= certwatch_xxh64_read(t_data, 4) * C_XXH_PRIME64_1;
+		t_hash = (XXH_ROTL64(t_hash, 23) * C_XXH_PRIME64_2)
+				+ C_XXH_PRIME64_3;
+		t_data += 4;
+	}
+	for (; t_data < t_end; t_data++) {
+		t_hash ^= (*t_data) * C_XXH_PRIME64_5;
+		t_hash = XXH_ROTL64(t_hash, 11) * C_XXH_PRIME64_1;
+	}
+
+	t_hash ^= t_hash >> 33;
+	t_hash *= C_XXH_PRIME64_2;
+	t_hash ^= t_hash >> 29;
+	t_hash *= C_XXH_PRIME64_3;
+	t_hash ^= t_hash >> 32;
+
+	return t_hash;
+}
+
+
+/******************************************************************************
+ * certwatch_setETag()                                                        *
+ *   Sets a strong ETag for a response, unless web_apis() supplied one.       *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_body - the response body (without the headers block).              *
+ * 	v_body_len - the response body's length.                              *
+ ******************************************************************************/
+static void certwatch_setETag(
+	request_rec* const v_request,
+	const char* const v_body,
+	const apr_size_t v_body_len
+)
+{
+	if (apr_table_get(v_request->headers_out, "ETag"))
+		return;
+
+	apr_table_setn(
+		v_request->headers_out, "ETag",
+		apr_psprintf(
+			v_request->pool, "\"%016" APR_UINT64_T_HEX_FMT "\"",
+			certwatch_xxh64(v_body, v_body_len)
+		)
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_notModified()                                                    *
+ *   Determines whether the client already has this response (i.e. a GET    *
+ * with a matching If-None-Match), and if so sends a 304 with no body.       *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	1 if a 304 was sent; otherwise 0.                             *
+ ******************************************************************************/
+static int certwatch_notModified(
+	request_rec* const v_request
+)
+{
+	apr_bucket_brigade* t_bucketBrigade;
+
+	if ((v_request->method_number != M_GET)
+			|| (ap_meets_conditions(v_request)
+				!= HTTP_NOT_MODIFIED))
+		return 0;
+
+	/* The HTTP header filter only sends the headers that are relevant to a
+	  304 */
+	v_request->status = HTTP_NOT_MODIFIED;
+	t_bucketBrigade = apr_brigade_create(
+		v_request->pool, v_request->connection->bucket_alloc
+	);
+	APR_BRIGADE_INSERT_TAIL(
+		t_bucketBrigade,
+		apr_bucket_eos_create(v_request->connection->bucket_alloc)
+	);
+	ap_pass_brigade(v_request->output_filters, t_bucketBrigade);
+
+	return 1;
+}
+
+
+/* Typedef for the fixed-size part of a response cache entry, which is
+  followed by the cache key, the header lines and then the body.  A large
+  response is stored whole under a second ID, and the entry under the key's
+  own ID has no header lines or body and just records how big that is, so
+  that a lookup needn't allocate room for the largest possible response */
+typedef struct tCertWatchCacheEntry {
+	apr_time_t m_storedAt;
+	apr_uint32_t m_keyLen;
+	apr_uint32_t m_headerLinesLen;
+	apr_uint32_t m_externalLen;	/* 0 = the response follows */
+} tCertWatchCacheEntry;
+
+#define C_CACHE_INLINE_MAX	16384	/* Bytes of header lines and body */
+
+
+/******************************************************************************
+ * certwatch_apiName()                                                        *
+ *   Identifies which API a request is for, for the purposes of per-function  *
+ * configuration: the function name from the URI path if there is one (e.g.  *
+ * "monitored-logs"), otherwise the first parameter's name (e.g. "id" or      *
+ * "identity").                                                               *
+ *                                                                            *
+ * IN:	v_function - the function name from the URI path.                     *
+ * 	v_firstName - the first parameter's name, or NULL.                    *
+ *                                                                            *
+ * Returns:	the API name.                                                 *
+ ******************************************************************************/
+static const char* certwatch_apiName(
+	const char* const v_function,
+	const char* const v_firstName
+)
+{
+	if (*v_function || !v_firstName)
+		return v_function;
+	else
+		return v_firstName;
+}
+
+
+/******************************************************************************
+ * certwatch_cache_isEnabled()                                                *
+ *   Determines whether responses for this API may be cached.                 *
+ *                                                                            *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ * 	v_apiName - the API name.                                             *
+ *                                                                            *
+ * Returns:	1 if cacheable; otherwise 0.                                  *
+ ******************************************************************************/
+static int certwatch_cache_isEnabled(
+	const tCertWatchDirConfig* const v_certWatchDirConfig,
+	const char* const v_apiName
+)
+{
+	int i;
+
+	if ((!g_cacheInstance) || (v_certWatchDirConfig->m_cacheMaxTTL <= 0))
+		return 0;
+	else if (!v_certWatchDirConfig->m_cacheFunctions)
+		return 1;
+
+	for (i = 0; i < v_certWatchDirConfig->m_cacheFunctions->nelts; i++)
+		if (!strcmp(v_apiName, APR_ARRAY_IDX(
+				v_certWatchDirConfig->m_cacheFunctions, i,
+				const char*)))
+			return 1;
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * certwatch_cache_id()                                                       *
+ *   Calculates the socache ID for a cache key.  The key itself is stored in  *
+ * the entry and compared on retrieval, so a digest collision can't return    *
+ * the wrong response.                                                        *
+ *                                                                            *
+ * IN:	v_key - the cache key.                                                *
+ *                                                                            *
+ * OUT:	v_id - the ID.                                                        *
+ ******************************************************************************/
+static void certwatch_cache_id(
+	const char* const v_key,
+	unsigned char v_id[APR_SHA1_DIGESTSIZE]
+)
+{
+	apr_sha1_ctx_t t_sha1;
+
+	apr_sha1_init(&t_sha1);
+	apr_sha1_update(&t_sha1, v_key, strlen(v_key));
+	apr_sha1_final(v_id, &t_sha1);
+}
+
+
+/******************************************************************************
+ * certwatch_cache_externalId()                                               *
+ *   Calculates the socache ID under which a large response is stored whole.  *
+ *                                                                            *
+ * IN:	v_key - the cache key.                                                *
+ *                                                                            *
+ * OUT:	v_id - the ID.                                                        *
+ ******************************************************************************/
+static void certwatch_cache_externalId(
+	const char* const v_key,
+	unsigned char v_id[APR_SHA1_DIGESTSIZE]
+)
+{
+	apr_sha1_ctx_t t_sha1;
+
+	apr_sha1_init(&t_sha1);
+	apr_sha1_update(&t_sha1, v_key, strlen(v_key));
+	apr_sha1_update(&t_sha1, "\n[EXTERNAL]", 11);
+	apr_sha1_final(v_id, &t_sha1);
+}
+
+
+/* Typedef for a parameter in a request key */
+typedef struct tCertWatchKeyParam {
+	const char* m_name;		/* Quoted and escaped */
+	apr_size_t m_nameLen;
+	const char* m_value;		/* Quoted and escaped */
+	apr_size_t m_valueLen;
+	int m_index;
+} tCertWatchKeyParam;
+
+
+/******************************************************************************
+ * certwatch_key_nextElement()                                                *
+ *   Finds the end of the next element in a PostgreSQL array string made by   *
+ * certwatch_parse_makeParamArrays(), in which every element is quoted.       *
+ *                                                                            *
+ * IN:	v_from - the element's opening " character.                           *
+ *                                                                            *
+ * Returns:	pointer to the byte after the element's closing " character.  *
+ ******************************************************************************/
+static const char* certwatch_key_nextElement(
+	const char* v_from
+)
+{
+	for (v_from++; *v_from && (*v_from != '"'); v_from++)
+		if ((*v_from == '\\') && v_from[1])
+			v_from++;
+
+	return *v_from ? (v_from + 1) : v_from;
+}
+
+
+/******************************************************************************
+ * certwatch_key_compare()                                                    *
+ *   qsort() comparator that orders parameters by name, keeping parameters    *
+ * with the same name in their original order.                                *
+ ******************************************************************************/
+static int certwatch_key_compare(
+	const void* const v_a,
+	const void* const v_b
+)
+{
+	const tCertWatchKeyParam* t_a = (const tCertWatchKeyParam*)v_a;
+	const tCertWatchKeyParam* t_b = (const tCertWatchKeyParam*)v_b;
+	int t_result = memcmp(
+		t_a->m_name, t_b->m_name,
+		(t_a->m_nameLen < t_b->m_nameLen)
+			? t_a->m_nameLen : t_b->m_nameLen
+	);
+
+	if (t_result)
+		return t_result;
+	else if (t_a->m_nameLen != t_b->m_nameLen)
+		return (t_a->m_nameLen < t_b->m_nameLen) ? -1 : 1;
+	else
+		return t_a->m_index - t_b->m_index;
+}
+
+
+/******************************************************************************
+ * certwatch_key_create()                                                     *
+ *   Builds the key that identifies identical requests.  The parameters have  *
+ * already been decoded and their names lowercased; they are put in order of  *
+ * name, so that equivalent query strings share a key.  The first parameter   *
+ * stays first, since it may identify the API (see certwatch_apiName()), and  *
+ * repeated names keep their order, since functions use the first.            *
+ *                                                                            *
+ * IN:	v_pool - the pool to allocate from.                                   *
+ * 	v_prefix - the key's first line (test mode, content coding).          *
+ * 	v_function - the function name from the URI path.                     *
+ * 	v_nameArray - the parameter name array, or NULL.                      *
+ * 	v_valueArray - the parameter value array, or NULL.                    *
+ *                                                                            *
+ * Returns:	the request key.                                              *
+ ******************************************************************************/
+static const char* certwatch_key_create(
+	apr_pool_t* const v_pool,
+	const char* const v_prefix,
+	const char* const v_function,
+	const char* const v_nameArray,
+	const char* const v_valueArray
+)
+{
+	tCertWatchKeyParam* t_params;
+	const char* t_name;
+	const char* t_value;
+	char* t_key;
+	char* t_to;
+	apr_size_t t_length;
+	int t_nParams = 0;
+	int i;
+
+	if (!v_nameArray)
+		return apr_pstrcat(v_pool, v_prefix, "\n", v_function, NULL);
+
+	/* Each element takes at least 3 bytes ("",) */
+	t_length = strlen(v_nameArray);
+	t_params = apr_palloc(
+		v_pool, ((t_length / 3) + 1) * sizeof(*t_params)
+	);
+
+	/* Split the arrays, skipping their opening braces */
+	t_name = v_nameArray + 1;
+	t_value = v_valueArray + 1;
+	while ((*t_name == '"') && (*t_value == '"')) {
+		t_params[t_nParams].m_name = t_name;
+		t_name = certwatch_key_nextElement(t_name);
+		t_params[t_nParams].m_nameLen =
+					t_name - t_params[t_nParams].m_name;
+		t_params[t_nParams].m_value = t_value;
+		t_value = certwatch_key_nextElement(t_value);
+		t_params[t_nParams].m_valueLen =
+					t_value - t_params[t_nParams].m_value;
+		t_params[t_nParams].m_index = t_nParams;
+		t_length += t_params[t_nParams].m_valueLen;
+		t_nParams++;
+
+		/* Skip the commas */
+		if (*t_name == ',')
+			t_name++;
+		if (*t_value == ',')
+			t_value++;
+	}
+
+	if (t_nParams > 2)
+		qsort(t_params + 1, t_nParams - 1, sizeof(*t_params),
+			certwatch_key_compare);
+
+	/* Build the key: "name"="value", for each parameter */
+	t_length += strlen(v_prefix) + strlen(v_function) + (2 * t_nParams) + 3;
+	t_key = apr_palloc(v_pool, t_length);
+	t_to = t_key + apr_snprintf(
+		t_key, t_length, "%s\n%s\n", v_prefix, v_function
+	);
+	for (i = 0; i < t_nParams; i++) {
+		memcpy(t_to, t_params[i].m_name, t_params[i].m_nameLen);
+		t_to += t_params[i].m_nameLen;
+		*(t_to++) = '=';
+		memcpy(t_to, t_params[i].m_value, t_params[i].m_valueLen);
+		t_to += t_params[i].m_valueLen;
+		*(t_to++) = ',';
+	}
+	*t_to = '\0';
+
+	return t_key;
+}
+
+
+/******************************************************************************
+ * certwatch_cache_isPrivate()                                                *
+ *   Determines whether a response must not be shared with other clients.     *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	1 if the response is private; otherwise 0.                    *
+ ******************************************************************************/
+static int certwatch_cache_isPrivate(
+	request_rec* const v_request
+)
+{
+	const char* t_cacheControl = apr_table_get(
+		v_request->headers_out, "Cache-Control"
+	);
+
+	if (apr_table_get(v_request->headers_out, "Set-Cookie"))
+		return 1;
+
+	return t_cacheControl && (
+		ap_find_token(v_request->pool, t_cacheControl, "no-store")
+		|| ap_find_token(v_request->pool, t_cacheControl, "private")
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_cache_findSeconds()                                              *
+ *   Finds a delta-seconds directive (e.g. max-age) in a Cache-Control        *
+ * header, matching whole directives as ap_find_token() does.                 *
+ *                                                                            *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ * 	v_cacheControl - the Cache-Control header.                            *
+ * 	v_name - the directive's name (in lower case).                        *
+ *                                                                            *
+ * OUT:	v_seconds - the directive's value, or 0 if it isn't a valid number of *
+ * 		seconds.                                                      *
+ *                                                                            *
+ * Returns:	1 if the directive was found; otherwise 0.                    *
+ ******************************************************************************/
+static int certwatch_cache_findSeconds(
+	apr_pool_t* const v_pool,
+	const char* v_cacheControl,
+	const char* const v_name,
+	long* const v_seconds
+)
+{
+	const apr_size_t t_name_len = strlen(v_name);
+	char* t_directive;
+	char* t_value;
+	char* t_end;
+	apr_size_t t_value_len;
+	apr_int64_t t_seconds;
+
+	/* Each directive comes back trimmed and, outside quotes, in lower
+	  case */
+	while ((t_directive = ap_get_list_item(v_pool, &v_cacheControl))) {
+		if (strncmp(t_directive, v_name, t_name_len)
+				|| (t_directive[t_name_len] != '='))
+			continue;
+
+		/* The value may be quoted, e.g. max-age="60" */
+		t_value = t_directive + t_name_len + 1;
+		t_value_len = strlen(t_value);
+		if ((t_value_len >= 2) && (t_value[0] == '"')
+				&& (t_value[t_value_len - 1] == '"')) {
+			t_value[t_value_len - 1] = '\0';
+			t_value++;
+		}
+
+		*v_seconds = 0;
+		if (apr_isdigit(*t_value)) {
+			t_seconds = apr_strtoi64(t_value, &t_end, 10);
+			if ((!*t_end) && (t_seconds >= 0))
+				*v_seconds = (t_seconds > LONG_MAX) ? LONG_MAX
+							: (long)t_seconds;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * certwatch_cache_ttl()                                                      *
+ *   Determines how long a response may be cached for, from the Cache-Control *
+ * and Expires headers that the function supplied.                            *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_maxTTL - the maximum TTL (in seconds).                              *
+ *                                                                            *
+ * Returns:	the TTL (in seconds), or 0 if the response must not be cached.*
+ ******************************************************************************/
+static long certwatch_cache_ttl(
+	request_rec* const v_request,
+	const long v_maxTTL
+)
+{
+	const char* t_cacheControl = apr_table_get(
+		v_request->headers_out, "Cache-Control"
+	);
+	const char* t_expires;
+	long t_ttl = -1;
+
+	if (certwatch_cache_isPrivate(v_request))
+		return 0;
+
+	if (t_cacheControl) {
+		if (ap_find_token(v_request->pool, t_cacheControl, "no-cache"))
+			return 0;
+
+		/* s-maxage takes precedence over max-age.  A malformed value
+		  leaves the response uncacheable, rather than falling back to
+		  Expires */
+		if (!certwatch_cache_findSeconds(
+				v_request->pool, t_cacheControl, "s-maxage",
+				&t_ttl))
+			(void)certwatch_cache_findSeconds(
+				v_request->pool, t_cacheControl, "max-age",
+				&t_ttl
+			);
+	}
+
+	if (t_ttl < 0) {
+		t_expires = apr_table_get(v_request->headers_out, "Expires");
+		if (t_expires) {
+			apr_time_t t_expiry = apr_date_parse_http(t_expires);
+			if (t_expiry != APR_DATE_BAD)
+				t_ttl = apr_time_sec(
+					t_expiry - v_request->request_time
+				);
+		}
+	}
+
+	if (t_ttl <= 0)
+		return 0;
+
+	return (t_ttl > v_maxTTL) ? v_maxTTL : t_ttl;
+}
+
+
+/******************************************************************************
+ * certwatch_cache_fetch()                                                    *
+ *   Retrieves a cache entry and checks that it is for this key.              *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_id - the entry's socache ID.                                        *
+ * 	v_key - the cache key.                                                *
+ *                                                                            *
+ * IN/OUT:	v_dataLen - the largest entry to retrieve (in bytes); on      *
+ * 		return, the size of the entry.                                *
+ *                                                                            *
+ * OUT:	v_data - the entry (followed by a spare byte).                        *
+ * 	v_entry - the entry's fixed-size part.                                *
+ *                                                                            *
+ * Returns:	1 if the entry was found; otherwise 0.                        *
+ ******************************************************************************/
+static int certwatch_cache_fetch(
+	request_rec* const v_request,
+	const unsigned char v_id[APR_SHA1_DIGESTSIZE],
+	const char* const v_key,
+	unsigned int* const v_dataLen,
+	unsigned char** const v_data,
+	tCertWatchCacheEntry* const v_entry
+)
+{
+	apr_size_t t_keyLen = strlen(v_key);
+	apr_status_t t_result;
+
+	/* Leave room for NULL-terminating the header lines */
+	*v_data = apr_palloc(v_request->pool, *v_dataLen + 1);
+
+	if (g_cacheMutex)
+		apr_global_mutex_lock(g_cacheMutex);
+	t_result = g_cacheProvider->retrieve(
+		g_cacheInstance, v_request->server, v_id, APR_SHA1_DIGESTSIZE,
+		*v_data, v_dataLen, v_request->pool
+	);
+	if (g_cacheMutex)
+		apr_global_mutex_unlock(g_cacheMutex);
+	if ((t_result != APR_SUCCESS) || (*v_dataLen < sizeof(*v_entry)))
+		return 0;
+
+	memcpy(v_entry, *v_data, sizeof(*v_entry));
+
+	return (v_entry->m_keyLen == t_keyLen)
+		&& ((sizeof(*v_entry) + v_entry->m_keyLen
+				+ v_entry->m_headerLinesLen) <= *v_dataLen)
+		&& !memcmp(*v_data + sizeof(*v_entry), v_key, t_keyLen);
+}
+
+
+/******************************************************************************
+ * certwatch_cache_retrieve()                                                 *
+ *   Looks up a response in the cache.  Only a buffer big enough for a small  *
+ * response is allocated up front; a large response's size is recorded in     *
+ * its entry, and it is then retrieved into a buffer of exactly that size.    *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_key - the cache key.                                                *
+ * 	v_maxObjectSize - the largest entry that may have been stored.        *
+ *                                                                            *
+ * OUT:	v_storedAt - when the response was stored.                            *
+ * 	v_headerLines - the header lines (NULL-terminated; modifiable).       *
+ * 	v_body - the body.                                                    *
+ * 	v_body_len - the length of v_body (in bytes).                         *
+ *                                                                            *
+ * Returns:	1 if the response was found; otherwise 0.                     *
+ ******************************************************************************/
+static int certwatch_cache_retrieve(
+	request_rec* const v_request,
+	const char* const v_key,
+	const apr_size_t v_maxObjectSize,
+	apr_time_t* const v_storedAt,
+	char** const v_headerLines,
+	char** const v_body,
+	apr_size_t* const v_body_len
+)
+{
+	unsigned char t_id[APR_SHA1_DIGESTSIZE];
+	tCertWatchCacheEntry t_entry;
+	unsigned char* t_data;
+	unsigned int t_dataLen;
+	apr_size_t t_keyLen = strlen(v_key);
+
+	certwatch_cache_id(v_key, t_id);
+	t_dataLen = sizeof(t_entry) + t_keyLen + C_CACHE_INLINE_MAX;
+	if (!certwatch_cache_fetch(
+			v_request, t_id, v_key, &t_dataLen, &t_data, &t_entry))
+		return 0;
+
+	if (t_entry.m_externalLen) {
+		if (t_entry.m_externalLen
+				> (sizeof(t_entry) + t_keyLen + v_maxObjectSize))
+			return 0;
+		certwatch_cache_externalId(v_key, t_id);
+		t_dataLen = t_entry.m_externalLen;
+		if ((!certwatch_cache_fetch(
+					v_request, t_id, v_key, &t_dataLen,
+					&t_data, &t_entry))
+				|| t_entry.m_externalLen)
+			return 0;
+	}
+
+	*v_storedAt = t_entry.m_storedAt;
+
+	/* Move the header lines back by one byte so that they can be
+	  NULL-terminated without overwriting the body */
+	*v_headerLines = (char*)t_data + sizeof(t_entry) + t_keyLen - 1;
+	memmove(*v_headerLines, *v_headerLines + 1, t_entry.m_headerLinesLen);
+	(*v_headerLines)[t_entry.m_headerLinesLen] = '\0';
+
+	*v_body = (char*)t_data + sizeof(t_entry) + t_keyLen
+			+ t_entry.m_headerLinesLen;
+	*v_body_len = t_dataLen - sizeof(t_entry) - t_keyLen
+			- t_entry.m_headerLinesLen;
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_cache_store()                                                    *
+ *   Stores a serialized cache entry.                                         *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_id - the entry's socache ID.                                        *
+ * 	v_expiry - when the entry expires.                                    *
+ * 	v_data - the entry.                                                   *
+ * 	v_dataLen - the size of v_data (in bytes).                            *
+ *                                                                            *
+ * Returns:	1 if the entry was stored; otherwise 0.                       *
+ ******************************************************************************/
+static int certwatch_cache_store(
+	request_rec* const v_request,
+	const unsigned char v_id[APR_SHA1_DIGESTSIZE],
+	const apr_time_t v_expiry,
+	unsigned char* const v_data,
+	const apr_size_t v_dataLen
+)
+{
+	apr_status_t t_result;
+
+	if (g_cacheMutex)
+		apr_global_mutex_lock(g_cacheMutex);
+	t_result = g_cacheProvider->store(
+		g_cacheInstance, v_request->server, v_id, APR_SHA1_DIGESTSIZE,
+		v_expiry, v_data, v_dataLen, v_request->pool
+	);
+	if (g_cacheMutex)
+		apr_global_mutex_unlock(g_cacheMutex);
+	if (t_result != APR_SUCCESS) {
+		ap_log_rerror(
+			APLOG_MARK, APLOG_DEBUG, t_result, v_request,
+			"Unable to cache response"
+		);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_cache_put()                                                      *
+ *   Stores a response in the cache.                                          *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_key - the cache key.                                                *
+ * 	v_ttl - how long to store the response for (in seconds).              *
+ * 	v_maxObjectSize - the largest response that may be stored.            *
+ * 	v_headerLines - the header lines, or NULL.                            *
+ * 	v_body - the body.                                                    *
+ * 	v_body_len - the length of v_body (in bytes).                         *
+ *                                                                            *
+ * Returns:	1 if the response was stored; otherwise 0.                    *
+ ******************************************************************************/
+static int certwatch_cache_put(
+	request_rec* const v_request,
+	const char* const v_key,
+	const long v_ttl,
+	const apr_size_t v_maxObjectSize,
+	const char* const v_headerLines,
+	const char* const v_body,
+	const apr_size_t v_body_len
+)
+{
+	unsigned char t_id[APR_SHA1_DIGESTSIZE];
+	tCertWatchCacheEntry t_entry;
+	unsigned char* t_data;
+	apr_size_t t_dataLen;
+	apr_time_t t_expiry;
+
+	t_entry.m_storedAt = apr_time_now();
+	t_entry.m_keyLen = strlen(v_key);
+	t_entry.m_headerLinesLen = v_headerLines ? strlen(v_headerLines) : 0;
+	t_entry.m_externalLen = 0;
+	if ((t_entry.m_headerLinesLen + v_body_len) > v_maxObjectSize)
+		return 0;
+	t_expiry = t_entry.m_storedAt + apr_time_from_sec(v_ttl);
+
+	/* Serialize the entry */
+	t_dataLen = sizeof(t_entry) + t_entry.m_keyLen
+			+ t_entry.m_headerLinesLen + v_body_len;
+	t_data = apr_palloc(v_request->pool, t_dataLen);
+	memcpy(t_data, &t_entry, sizeof(t_entry));
+	memcpy(t_data + sizeof(t_entry), v_key, t_entry.m_keyLen);
+	if (v_headerLines)
+		memcpy(t_data + sizeof(t_entry) + t_entry.m_keyLen,
+			v_headerLines, t_entry.m_headerLinesLen);
+	memcpy(t_data + sizeof(t_entry) + t_entry.m_keyLen
+			+ t_entry.m_headerLinesLen, v_body, v_body_len);
+
+	if ((t_entry.m_headerLinesLen + v_body_len) <= C_CACHE_INLINE_MAX) {
+		certwatch_cache_id(v_key, t_id);
+		return certwatch_cache_store(
+			v_request, t_id, t_expiry, t_data, t_dataLen
+		);
+	}
+
+	/* Store a large response under its second ID first, so that a lookup
+	  that finds the entry that records its size will normally find it
+	  too */
+	certwatch_cache_externalId(v_key, t_id);
+	if (!certwatch_cache_store(
+			v_request, t_id, t_expiry, t_data, t_dataLen))
+		return 0;
+
+	t_entry.m_headerLinesLen = 0;
+	t_entry.m_externalLen = t_dataLen;
+	memcpy(t_data, &t_entry, sizeof(t_entry));
+	certwatch_cache_id(v_key, t_id);
+
+	return certwatch_cache_store(
+		v_request, t_id, t_expiry, t_data,
+		sizeof(t_entry) + t_entry.m_keyLen
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_cache_serve()                                                    *
+ *   If a response is in the cache, send it.                                  *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_key - the cache key.                                                *
+ * 	v_maxObjectSize - the largest response that may have been stored.     *
+ *                                                                            *
+ * Returns:	1 if the response was found and sent; otherwise 0.            *
+ ******************************************************************************/
+static int certwatch_cache_serve(
+	request_rec* const v_request,
+	const char* const v_key,
+	const apr_size_t v_maxObjectSize
+)
+{
+	apr_bucket_brigade* t_bucketBrigade;
+	apr_time_t t_storedAt;
+	char* t_headerLines;
+	char* t_body;
+	apr_size_t t_body_len;
+
+	if (!certwatch_cache_retrieve(
+			v_request, v_key, v_maxObjectSize, &t_storedAt,
+			&t_headerLines, &t_body, &t_body_len))
+		return 0;
+
+	v_request->content_type = "text/html; charset=UTF-8";
+	certwatch_applyHeaderLines(
+		v_request, t_headerLines, t_headerLines + strlen(t_headerLines)
+	);
+	apr_table_setn(
+		v_request->headers_out, "Age",
+		apr_psprintf(
+			v_request->pool, "%" APR_TIME_T_FMT,
+			apr_time_sec(apr_time_now() - t_storedAt)
+		)
+	);
+
+	/* If the client already has this response, there's no need to send
+	  the body */
+	certwatch_setETag(v_request, t_body, t_body_len);
+	if (certwatch_notModified(v_request))
+		return 1;
+
+	t_bucketBrigade = apr_brigade_create(
+		v_request->pool, v_request->connection->bucket_alloc
+	);
+	APR_BRIGADE_INSERT_TAIL(
+		t_bucketBrigade,
+		apr_bucket_pool_create(
+			t_body, t_body_len, v_request->pool,
+			v_request->connection->bucket_alloc
+		)
+	);
+	APR_BRIGADE_INSERT_TAIL(
+		t_bucketBrigade,
+		apr_bucket_eos_create(v_request->connection->bucket_alloc)
+	);
+	ap_pass_brigade(v_request->output_filters, t_bucketBrigade);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_coalesce_end()                                                   *
+ *   Releases a coalescing slot, waking any requests that are waiting for     *
+ * this one's response.  Runs as a request pool cleanup.                      *
+ *                                                                            *
+ * IN:	v_coalesce - the coalescing state.                                    *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t certwatch_coalesce_end(
+	void* const v_coalesce
+)
+{
+	tCertWatchCoalesce* t_coalesce = (tCertWatchCoalesce*)v_coalesce;
+
+	/* Only release the slot if it still belongs to this query */
+	(void)apr_atomic_cas64(
+		&t_coalesce->m_slot->m_keyHash, 0, t_coalesce->m_keyHash
+	);
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_coalesce_setUnshareable()                                        *
+ *   Marks a leader's key as unshareable, so that the requests waiting for    *
+ * its response (and identical requests that arrive soon after) run their     *
+ * own queries straight away instead of waiting for a response that won't be  *
+ * published.                                                                 *
+ *                                                                            *
+ * IN:	v_coalesce - the leader's coalescing state.                           *
+ ******************************************************************************/
+static void certwatch_coalesce_setUnshareable(
+	tCertWatchCoalesce* const v_coalesce
+)
+{
+	apr_atomic_set64(
+		&v_coalesce->m_slot->m_unshareableUntil,
+		apr_time_now() + apr_time_from_sec(C_COALESCE_UNSHAREABLE_TTL)
+	);
+	apr_atomic_set64(
+		&v_coalesce->m_slot->m_unshareable, v_coalesce->m_keyHash
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_coalesce_isUnshareable()                                         *
+ *   Determines whether a key's responses have recently turned out not to be  *
+ * shareable.                                                                 *
+ *                                                                            *
+ * IN:	v_coalesce - the coalescing state.                                    *
+ * 	v_now - the current time.                                             *
+ *                                                                            *
+ * Returns:	1 if the key is marked as unshareable; otherwise 0.           *
+ ******************************************************************************/
+static int certwatch_coalesce_isUnshareable(
+	const tCertWatchCoalesce* const v_coalesce,
+	const apr_time_t v_now
+)
+{
+	return (apr_atomic_read64(&v_coalesce->m_slot->m_unshareable)
+				== v_coalesce->m_keyHash)
+		&& (v_now < (apr_time_t)apr_atomic_read64(
+				&v_coalesce->m_slot->m_unshareableUntil));
+}
+
+
+/******************************************************************************
+ * certwatch_coalesce_begin()                                                 *
+ *   Determines whether an identical query is already running in any child.   *
+ * If not, this request becomes the leader for its key, and any identical     *
+ * requests that arrive while it runs will wait for its response.  If so,     *
+ * waits (for a bounded time) for the leader to finish.                       *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_key - the request key.                                              *
+ * 	v_waitMs - the longest time to wait for a leader (in milliseconds).   *
+ *                                                                            *
+ * OUT:	v_coalesce - for a leader, the state to pass to                       *
+ * 		certwatch_coalesce_end() (via apr_pool_cleanup_run()).        *
+ *                                                                            *
+ * Returns:	C_COALESCE_LEADER = this request must run the query and share *
+ * 				its response.                                 *
+ * 		C_COALESCE_DONE = a leader has finished; its response may be  *
+ * 				in the cache.                                 *
+ * 		C_COALESCE_NONE = run the query without sharing it (e.g.      *
+ * 				because the key is marked as unshareable).    *
+ ******************************************************************************/
+#define C_COALESCE_NONE		0
+#define C_COALESCE_LEADER	1
+#define C_COALESCE_DONE		2
+static int certwatch_coalesce_begin(
+	request_rec* const v_request,
+	const char* const v_key,
+	const int v_waitMs,
+	tCertWatchCoalesce** const v_coalesce
+)
+{
+	unsigned char t_id[APR_SHA1_DIGESTSIZE];
+	tCertWatchCoalesce* t_coalesce;
+	apr_uint64_t t_keyHash;
+	apr_uint64_t t_owner;
+	apr_time_t t_now = apr_time_now();
+	apr_time_t t_deadline = t_now + apr_time_from_msec(v_waitMs);
+	apr_interval_time_t t_sleep = 1000;
+
+	/* Zero means "slot free", so make sure that no key hashes to it */
+	certwatch_cache_id(v_key, t_id);
+	memcpy(&t_keyHash, t_id, sizeof(t_keyHash));
+	t_keyHash |= 1;
+
+	t_coalesce = apr_palloc(v_request->pool, sizeof(*t_coalesce));
+	t_coalesce->m_keyHash = t_keyHash;
+	t_coalesce->m_slot = &g_coalesceSlots[t_keyHash % g_nCoalesceSlots];
+
+	/* Don't wait for a response that won't be shared */
+	if (certwatch_coalesce_isUnshareable(t_coalesce, t_now))
+		return C_COALESCE_NONE;
+
+	while (1) {
+		t_owner = apr_atomic_cas64(
+			&t_coalesce->m_slot->m_keyHash, t_keyHash, 0
+		);
+		if (t_owner == 0)
+			break;		/* Slot claimed: we're the leader */
+		else if (t_owner != t_keyHash)
+			return C_COALESCE_NONE;	/* Slot used by another query */
+		else if (t_now >= t_deadline) {
+			/* The leader is taking too long (or its child died),
+			  so take over as the leader */
+			ap_log_rerror(
+				APLOG_MARK, APLOG_INFO, 0, v_request,
+				"Gave up waiting for an identical query after "
+				"%dms", v_waitMs
+			);
+			break;
+		}
+
+		/* Poll, backing off to at most 50ms between checks */
+		apr_sleep(t_sleep);
+		if (t_sleep < 50000)
+			t_sleep *= 2;
+		t_now = apr_time_now();
+		if (apr_atomic_read64(&t_coalesce->m_slot->m_keyHash)
+				!= t_keyHash)
+			return certwatch_coalesce_isUnshareable(
+					t_coalesce, t_now
+				) ? C_COALESCE_NONE : C_COALESCE_DONE;
+	}
+
+	apr_pool_cleanup_register(
+		v_request->pool, t_coalesce, certwatch_coalesce_end,
+		apr_pool_cleanup_null
+	);
+	*v_coalesce = t_coalesce;
+
+	return C_COALESCE_LEADER;
+}
+
+
+/******************************************************************************
+ * certwatch_admit_end()                                                      *
+ *   Releases a request's admission control slot.  Runs as a request pool     *
+ * cleanup.                                                                   *
+ *                                                                            *
+ * IN:	v_admit - the admission control state.                                *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t certwatch_admit_end(
+	void* const v_admit
+)
+{
+	tCertWatchAdmit* t_admit = (tCertWatchAdmit*)v_admit;
+
+	/* Release this child's share first, so that dying in between could
+	  only leak a slot, never release one twice */
+	if (t_admit->m_childSlot)
+		apr_atomic_dec32(&t_admit->m_childSlot->m_active);
+	apr_atomic_dec32(&t_admit->m_slot->m_active);
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_admit_tryIncrement()                                             *
+ *   Increments a shared counter, unless it has reached its limit.            *
+ *                                                                            *
+ * IN:	v_counter - the counter.                                              *
+ * 	v_max - the counter's limit.                                          *
+ *                                                                            *
+ * Returns:	1 if the counter was incremented; otherwise 0.                *
+ ******************************************************************************/
+static int certwatch_admit_tryIncrement(
+	volatile apr_uint32_t* const v_counter,
+	const apr_uint32_t v_max
+)
+{
+	apr_uint32_t t_value = apr_atomic_read32(v_counter);
+	apr_uint32_t t_previous;
+
+	while (t_value < v_max) {
+		t_previous = apr_atomic_cas32(v_counter, t_value + 1, t_value);
+		if (t_previous == t_value)
+			return 1;
+		t_value = t_previous;
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * certwatch_admit_begin()                                                    *
+ *   Limits the number of concurrent queries for each API across all          *
+ * children, so that a saturated database isn't pushed further into           *
+ * thrashing.  When an API is at its limit, a bounded number of requests may  *
+ * wait (for a bounded time) for a query to finish; any others are shed       *
+ * immediately.                                                               *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_apiName - the API name.                                             *
+ * 	v_waitMs - the longest time to wait (in milliseconds).                *
+ *                                                                            *
+ * OUT:	v_admit - if this API is limited, the state to pass to                *
+ * 		certwatch_admit_end() (via apr_pool_cleanup_run()) once the   *
+ * 		query has finished.                                           *
+ *                                                                            *
+ * Returns:	1 if the query may run; 0 if the request must be shed.        *
+ ******************************************************************************/
+static int certwatch_admit_begin(
+	request_rec* const v_request,
+	const char* const v_apiName,
+	const int v_waitMs,
+	tCertWatchAdmit** const v_admit
+)
+{
+	const tCertWatchAdmitLimit* t_limit = NULL;
+	tCertWatchAdmit* t_admit;
+	apr_time_t t_deadline;
+	apr_interval_time_t t_sleep = 1000;
+	int t_admitted;
+	int i;
+
+	/* Find this API's limits, or else the default limits */
+	for (i = 0; i < g_admitLimits->nelts; i++) {
+		const tCertWatchAdmitLimit* t_thisLimit =
+			&APR_ARRAY_IDX(g_admitLimits, i, tCertWatchAdmitLimit);
+		if (!strcmp(t_thisLimit->m_apiName, v_apiName)) {
+			t_limit = t_thisLimit;
+			break;
+		}
+		else if (!strcmp(t_thisLimit->m_apiName, "*"))
+			t_limit = t_thisLimit;
+	}
+	if (!t_limit)
+		return 1;	/* This API is unlimited */
+
+	t_admit = apr_palloc(v_request->pool, sizeof(*t_admit));
+	t_admit->m_limit = t_limit;
+	i = t_limit - &APR_ARRAY_IDX(g_admitLimits, 0, tCertWatchAdmitLimit);
+	t_admit->m_slot = &g_admitSlots[i];
+	t_admit->m_childSlot = g_admitMySlots ? &g_admitMySlots[i] : NULL;
+
+	t_admitted = certwatch_admit_tryIncrement(
+		&t_admit->m_slot->m_active, t_limit->m_maxActive
+	);
+	if ((!t_admitted) && certwatch_admit_tryIncrement(
+			&t_admit->m_slot->m_queued, t_limit->m_maxQueued)) {
+		if (t_admit->m_childSlot)
+			apr_atomic_inc32(&t_admit->m_childSlot->m_queued);
+
+		/* Wait in the queue.  Poll, backing off to at most 20ms
+		  between checks */
+		t_deadline = apr_time_now() + apr_time_from_msec(v_waitMs);
+		do {
+			apr_sleep(t_sleep);
+			if (t_sleep < 20000)
+				t_sleep *= 2;
+			t_admitted = certwatch_admit_tryIncrement(
+				&t_admit->m_slot->m_active, t_limit->m_maxActive
+			);
+		} while ((!t_admitted) && (apr_time_now() < t_deadline));
+
+		if (t_admit->m_childSlot)
+			apr_atomic_dec32(&t_admit->m_childSlot->m_queued);
+		apr_atomic_dec32(&t_admit->m_slot->m_queued);
+	}
+
+	if (!t_admitted) {
+		ap_log_rerror(
+			APLOG_MARK, APLOG_INFO, 0, v_request,
+			"Shed a request for %s (%u active, %u queued)",
+			*v_apiName ? v_apiName : "(none)",
+			apr_atomic_read32(&t_admit->m_slot->m_active),
+			apr_atomic_read32(&t_admit->m_slot->m_queued)
+		);
+		return 0;
+	}
+
+	if (t_admit->m_childSlot)
+		apr_atomic_inc32(&t_admit->m_childSlot->m_active);
+	apr_pool_cleanup_register(
+		v_request->pool, t_admit, certwatch_admit_end,
+		apr_pool_cleanup_null
+	);
+	*v_admit = t_admit;
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_admit_subtract()                                                 *
+ *   Subtracts from a shared counter, without letting it fall below zero.     *
+ *                                                                            *
+ * IN:	v_counter - the counter.                                              *
+ * 	v_amount - the amount to subtract.                                    *
+ ******************************************************************************/
+static void certwatch_admit_subtract(
+	volatile apr_uint32_t* const v_counter,
+	const apr_uint32_t v_amount
+)
+{
+	apr_uint32_t t_value = apr_atomic_read32(v_counter);
+	apr_uint32_t t_previous;
+
+	while (v_amount && t_value) {
+		t_previous = apr_atomic_cas32(
+			v_counter, (t_value > v_amount) ? (t_value - v_amount) : 0,
+			t_value
+		);
+		if (t_previous == t_value)
+			break;
+		t_value = t_previous;
+	}
+}
+
+
+/******************************************************************************
+ * certwatch_admit_childInit()                                                *
+ *   Claims this child's row of the admission control counters.               *
+ *                                                                            *
+ * IN:	v_server - the server record.                                         *
+ ******************************************************************************/
+static void certwatch_admit_childInit(
+	server_rec* const v_server
+)
+{
+	apr_uint32_t t_pid = (apr_uint32_t)getpid();
+	int i;
+
+	for (i = 0; i < g_nAdmitChildren; i++)
+		if (apr_atomic_cas32(&g_admitChildren[i], t_pid, 0) == 0) {
+			g_admitMySlots = &g_admitChildSlots[
+				i * g_admitLimits->nelts
+			];
+			return;
+		}
+
+	ap_log_error(
+		APLOG_MARK, APLOG_WARNING, 0, v_server,
+		"No admission control row is free for child %d, so its slots "
+		"won't be released if it dies mid-request", (int)t_pid
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_childStatus()                                                    *
+ *   Runs in the parent whenever a child's status changes.  When a child has  *
+ * exited, releases any admission control slots that it still held (because   *
+ * it crashed or was killed mid-request), and frees its row.                  *
+ *                                                                            *
+ * IN:	v_server - the server record.                                         *
+ * 	v_pid - the child's process ID.                                       *
+ * 	v_generation - the child's generation.                                *
+ * 	v_slot - the child's scoreboard slot.                                 *
+ * 	v_state - the child's new status.                                     *
+ ******************************************************************************/
+static void certwatch_childStatus(
+	server_rec* const v_server,
+	const pid_t v_pid,
+	const ap_generation_t v_generation,
+	const int v_slot,
+	const mpm_child_status v_state
+)
+{
+	tCertWatchAdmitSlot* t_childSlots;
+	apr_uint32_t t_active;
+	apr_uint32_t t_queued;
+	int i;
+	int j;
+
+	/* A child of an earlier generation used counters that have since been
+	  discarded, so its PID won't be found */
+	if ((v_state != MPM_CHILD_EXITED) || (!g_admitChildren))
+		return;
+
+	for (i = 0; i < g_nAdmitChildren; i++) {
+		if (apr_atomic_read32(&g_admitChildren[i])
+				!= (apr_uint32_t)v_pid)
+			continue;
+
+		t_childSlots = &g_admitChildSlots[i * g_admitLimits->nelts];
+		for (j = 0; j < g_admitLimits->nelts; j++) {
+			t_active = apr_atomic_xchg32(
+				&t_childSlots[j].m_active, 0
+			);
+			t_queued = apr_atomic_xchg32(
+				&t_childSlots[j].m_queued, 0
+			);
+			if ((!t_active) && (!t_queued))
+				continue;
+
+			certwatch_admit_subtract(
+				&g_admitSlots[j].m_active, t_active
+			);
+			certwatch_admit_subtract(
+				&g_admitSlots[j].m_queued, t_queued
+			);
+			ap_log_error(
+				APLOG_MARK, APLOG_WARNING, 0, v_server,
+				"Released %u active and %u queued admission "
+				"control slot(s) for %s held by child %d",
+				t_active, t_queued,
+				APR_ARRAY_IDX(
+					g_admitLimits, j, tCertWatchAdmitLimit
+				).m_apiName, (int)v_pid
+			);
+		}
+		apr_atomic_set32(&g_admitChildren[i], 0);
+		break;
+	}
+}
+
+
+/******************************************************************************
+ * certwatch_rate_cost()                                                      *
+ *   Determines how many tokens a query for an API costs.                     *
+ *                                                                            *
+ * IN:	v_apiName - the API name.                                             *
+ *                                                                            *
+ * Returns:	the cost (in tokens).                                         *
+ ******************************************************************************/
+static apr_uint32_t certwatch_rate_cost(
+	const char* const v_apiName
+)
+{
+	const apr_array_header_t* t_costs = g_rateConfig->m_rateCosts;
+	apr_uint32_t t_cost = 1;
+	int i;
+
+	/* Find this API's cost, or else the default cost */
+	for (i = 0; t_costs && (i < t_costs->nelts); i++) {
+		const tCertWatchRateCost* t_thisCost =
+			&APR_ARRAY_IDX(t_costs, i, tCertWatchRateCost);
+		if (!strcmp(t_thisCost->m_apiName, v_apiName))
+			return t_thisCost->m_cost;
+		else if (!strcmp(t_thisCost->m_apiName, "*"))
+			t_cost = t_thisCost->m_cost;
+	}
+
+	return t_cost;
+}
+
+
+/******************************************************************************
+ * certwatch_rate_key()                                                       *
+ *   Identifies the client (or the network prefix that it belongs to) for     *
+ * rate limiting.  X-Forwarded-For is not consulted, because any client can   *
+ * send one; behind a proxy, load mod_remoteip with RemoteIPInternalProxy so  *
+ * that useragent_ip holds the address that the trusted proxy saw.            *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	the client's key (never 0).                                   *
+ ******************************************************************************/
+static apr_uint64_t certwatch_rate_key(
+	request_rec* const v_request
+)
+{
+	unsigned char t_address[16];
+	const char* t_client = v_request->useragent_ip;
+	apr_size_t t_length;
+	int t_bits;
+	int i;
+
+	/* Key on the network prefix, so that a client can't dodge its limit by
+	  hopping between addresses in its own IPv6 /64 */
+	if (inet_pton(AF_INET, t_client, t_address) == 1) {
+		t_bits = g_rateConfig->m_ratePrefix4;
+		t_length = 4;
+	}
+	else if (inet_pton(AF_INET6, t_client, t_address) == 1) {
+		t_bits = g_rateConfig->m_ratePrefix6;
+		t_length = 16;
+	}
+	else
+		return certwatch_xxh64(t_client, strlen(t_client)) | 1;
+
+	for (i = 0; i < (int)t_length; i++) {
+		if (t_bits <= 0)
+			t_address[i] = 0;
+		else if (t_bits < 8)
+			t_address[i] &= (unsigned char)(0xFF << (8 - t_bits));
+		t_bits -= 8;
+	}
+
+	/* Zero means "slot free", so make sure that no key hashes to it */
+	return certwatch_xxh64(t_address, t_length) | 1;
+}
+
+
+/******************************************************************************
+ * certwatch_rate_tokens()                                                    *
+ *   Works out how many tokens are in a bucket now.                           *
+ *                                                                            *
+ * IN:	v_state - the bucket's state.                                         *
+ * 	v_nowMs - the current time (in milliseconds, modulo 2^36).            *
+ *                                                                            *
+ * Returns:	the number of milli-tokens.                                   *
+ ******************************************************************************/
+static apr_uint64_t certwatch_rate_tokens(
+	const apr_uint64_t v_state,
+	const apr_uint64_t v_nowMs
+)
+{
+	apr_uint64_t t_capacity = (apr_uint64_t)g_rateConfig->m_rateBurst
+					* 1000;
+	apr_uint64_t t_elapsed;
+	apr_uint64_t t_tokens;
+
+	if (!v_state)
+		return t_capacity;
+
+	/* Another child may have stamped a slightly later time, which would
+	  otherwise look like a very long time ago */
+	t_elapsed = (v_nowMs - (v_state >> C_RATE_TOKEN_BITS))
+			& C_RATE_TIME_MASK;
+	if (t_elapsed > (C_RATE_TIME_MASK / 2))
+		t_elapsed = 0;
+
+	/* Tokens/second is milli-tokens/millisecond */
+	if (t_elapsed >= (t_capacity / g_rateConfig->m_rateRate))
+		return t_capacity;
+	t_tokens = (v_state & C_RATE_TOKEN_MASK)
+			+ (t_elapsed * g_rateConfig->m_rateRate);
+
+	return (t_tokens < t_capacity) ? t_tokens : t_capacity;
+}
+
+
+/******************************************************************************
+ * certwatch_rate_take()                                                      *
+ *   Takes tokens from the client's bucket, which is shared by all children   *
+ * and updated without locks.  A client whose bucket is too empty is told to *
+ * go away (with a Retry-After header) before a connection is even checked   *
+ * out.                                                                       *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_cost - the number of tokens to take.                                *
+ *                                                                            *
+ * Returns:	1 if the query may run; 0 if the client is over its limit.    *
+ ******************************************************************************/
+static int certwatch_rate_take(
+	request_rec* const v_request,
+	const apr_uint32_t v_cost
+)
+{
+	tCertWatchRateSlot* t_slot = NULL;
+	tCertWatchRateSlot* t_probe;
+	apr_uint64_t t_key = certwatch_rate_key(v_request);
+	apr_uint64_t t_nowMs = (apr_uint64_t)apr_time_as_msec(apr_time_now())
+				& C_RATE_TIME_MASK;
+	apr_uint64_t t_capacity = (apr_uint64_t)g_rateConfig->m_rateBurst
+					* 1000;
+	apr_uint64_t t_cost = (apr_uint64_t)v_cost * 1000;
+	apr_uint64_t t_owner;
+	apr_uint64_t t_old;
+	apr_uint64_t t_new;
+	apr_uint64_t t_tokens;
+	int i;
+
+	if (v_cost == 0)
+		return 1;
+	else if (t_cost > t_capacity)
+		t_cost = t_capacity;	/* Needs a full bucket */
+
+	/* Find the client's bucket, or else claim one that's free or that has
+	  been idle for long enough to have refilled (so that forgetting its
+	  owner makes no difference) */
+	for (i = 0; (i < C_RATE_PROBES) && !t_slot; i++) {
+		t_probe = &g_rateSlots[(t_key + i) % g_nRateSlots];
+		t_owner = apr_atomic_read64(&t_probe->m_key);
+		if (t_owner == t_key)
+			t_slot = t_probe;
+		else if ((t_owner == 0) || (certwatch_rate_tokens(
+				apr_atomic_read64(&t_probe->m_state), t_nowMs)
+					== t_capacity)) {
+			if (apr_atomic_cas64(&t_probe->m_key, t_key, t_owner)
+					== t_owner) {
+				apr_atomic_set64(&t_probe->m_state, 0);
+				t_slot = t_probe;
+			}
+			else if (apr_atomic_read64(&t_probe->m_key) == t_key)
+				t_slot = t_probe;
+		}
+	}
+
+	/* Every bucket nearby belongs to an active client, so fail open */
+	if (!t_slot) {
+		ap_log_rerror(
+			APLOG_MARK, APLOG_DEBUG, 0, v_request,
+			"No rate limiting bucket is available"
+		);
+		return 1;
+	}
+
+	do {
+		t_old = apr_atomic_read64(&t_slot->m_state);
+		t_tokens = certwatch_rate_tokens(t_old, t_nowMs);
+		if (t_tokens < t_cost) {
+			/* Tell the client when there'll be enough tokens */
+			apr_table_setn(
+				v_request->err_headers_out, "Retry-After",
+				apr_itoa(v_request->pool, (int)(
+					(t_cost - t_tokens
+						+ (g_rateConfig->m_rateRate
+							* 1000) - 1)
+					/ (g_rateConfig->m_rateRate * 1000)
+				))
+			);
+			ap_log_rerror(
+				APLOG_MARK, APLOG_INFO, 0, v_request,
+				"Rate limited"
+			);
+			return 0;
+		}
+		t_new = (t_nowMs << C_RATE_TOKEN_BITS) | (t_tokens - t_cost);
+	} while (apr_atomic_cas64(&t_slot->m_state, t_new, t_old) != t_old);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * certwatch_metrics_bucket()                                                 *
+ *   Determines which histogram bucket a latency belongs in.                  *
+ *                                                                            *
+ * IN:	v_usec - the latency (in microseconds).                               *
+ *                                                                            *
+ * Returns:	the bucket index.                                             *
+ ******************************************************************************/
+static unsigned int certwatch_metrics_bucket(
+	const apr_uint64_t v_usec
+)
+{
+	unsigned int t_exponent = 0;
+	unsigned int t_index;
+
+	/* The first buckets each hold one value */
+	if (v_usec < (1 << C_HISTOGRAM_SUB_BITS))
+		return (unsigned int)v_usec;
+
+	/* After that, each doubling is split into equal sub-buckets */
+	while ((v_usec >> t_exponent) >= (2 << C_HISTOGRAM_SUB_BITS))
+		t_exponent++;
+	t_index = ((t_exponent + 1) << C_HISTOGRAM_SUB_BITS)
+			+ (unsigned int)(v_usec >> t_exponent)
+			- (1 << C_HISTOGRAM_SUB_BITS);
+
+	return (t_index < C_HISTOGRAM_BUCKETS) ? t_index
+						: (C_HISTOGRAM_BUCKETS - 1);
+}
+
+
+/******************************************************************************
+ * certwatch_metrics_bucketLimit()                                            *
+ *   Determines the (exclusive) upper limit of a histogram bucket.            *
+ *                                                                            *
+ * IN:	v_index - the bucket index.                                           *
+ *                                                                            *
+ * Returns:	the upper limit (in microseconds).                            *
+ ******************************************************************************/
+static apr_uint64_t certwatch_metrics_bucketLimit(
+	const unsigned int v_index
+)
+{
+	unsigned int t_exponent;
+	apr_uint64_t t_mantissa;
+
+	if (v_index < (1 << C_HISTOGRAM_SUB_BITS))
+		return v_index + 1;
+
+	t_exponent = (v_index >> C_HISTOGRAM_SUB_BITS) - 1;
+	t_mantissa = (v_index & ((1 << C_HISTOGRAM_SUB_BITS) - 1))
+			+ (1 << C_HISTOGRAM_SUB_BITS);
+
+	return (t_mantissa + 1) << t_exponent;
+}
+
+
+/******************************************************************************
+ * certwatch_metrics_observe()                                                *
+ *   Adds a duration to one of an API's shared histograms.                    *
+ *                                                                            *
+ * IN:	v_metrics - the API's metrics.                                        *
+ * 	v_phase - the phase (C_PHASE_*).                                      *
+ * 	v_usec - the duration (in microseconds).                              *
+ ******************************************************************************/
+static void certwatch_metrics_observe(
+	tCertWatchMetrics* const v_metrics,
+	const int v_phase,
+	const apr_uint64_t v_usec
+)
+{
+	tCertWatchHistogram* t_histogram = &v_metrics->m_phases[v_phase];
+
+	apr_atomic_inc64(&t_histogram->m_count);
+	apr_atomic_add64(&t_histogram->m_sum, v_usec);
+	apr_atomic_inc64(
+		&t_histogram->m_buckets[certwatch_metrics_bucket(v_usec)]
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_metrics_record()                                                 *
+ *   Records how long a request phase took.  A phase that's repeated (e.g.    *
+ * when a query is retried on another server) accumulates.                    *
+ *                                                                            *
+ * IN:	v_stats - the request's timings.                                      *
+ * 	v_phase - the phase (C_PHASE_*).                                      *
+ * 	v_startedAt - when the phase started.                                 *
+ *                                                                            *
+ * Returns:	the current time, i.e. when the next phase starts.            *
+ ******************************************************************************/
+static apr_time_t certwatch_metrics_record(
+	tCertWatchRequestStats* const v_stats,
+	const int v_phase,
+	const apr_time_t v_startedAt
+)
+{
+	apr_time_t t_now = apr_time_now();
+	apr_uint64_t t_usec;
+
+	t_usec = (t_now > v_startedAt) ? (t_now - v_startedAt) : 0;
+	v_stats->m_phases[v_phase] += t_usec;
+	v_stats->m_recorded |= (1 << v_phase);
+
+	if (v_stats->m_metrics)
+		certwatch_metrics_observe(v_stats->m_metrics, v_phase, t_usec);
+
+	return t_now;
+}
+
+
+/******************************************************************************
+ * certwatch_metrics_end()                                                    *
+ *   Records a request's total time, status and size.  Runs as a request      *
+ * pool cleanup, by which time the response has been written.                 *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t certwatch_metrics_end(
+	void* const v_request
+)
+{
+	request_rec* t_request = (request_rec*)v_request;
+	tCertWatchRequestStats* t_stats =
+		(tCertWatchRequestStats*)ap_get_module_config(
+			t_request->request_config, &certwatch_module
+		);
+	tCertWatchMetrics* t_metrics = t_stats->m_metrics;
+
+	if (t_request->status == HTTP_SERVICE_UNAVAILABLE)
+		apr_atomic_inc64(&t_metrics->m_unavailable);
+	else if (t_request->status == HTTP_TOO_MANY_REQUESTS)
+		apr_atomic_inc64(&t_metrics->m_rateLimited);
+	if (t_request->bytes_sent > 0)
+		apr_atomic_add64(
+			&t_metrics->m_bytesOut, t_request->bytes_sent
+		);
+	(void)certwatch_metrics_record(
+		t_stats, C_PHASE_TOTAL, t_request->request_time
+	);
+	apr_atomic_dec32(&t_metrics->m_inFlight);
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_metrics_begin()                                                  *
+ *   Starts recording a request's timings, and counts the request against     *
+ * its API's shared metrics slot, or slot 0 if the API has none.              *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_apiName - the API name.                                             *
+ *                                                                            *
+ * Returns:	pointer to the request's timings.                             *
+ ******************************************************************************/
+static tCertWatchRequestStats* certwatch_metrics_begin(
+	request_rec* const v_request,
+	const char* const v_apiName
+)
+{
+	tCertWatchRequestStats* t_stats;
+	tCertWatchMetrics* t_metrics = &g_metrics[0];
+	apr_size_t i;
+
+	t_stats = apr_pcalloc(v_request->pool, sizeof(*t_stats));
+	ap_set_module_config(
+		v_request->request_config, &certwatch_module, t_stats
+	);
+	if (!g_metrics)
+		return t_stats;
+
+	/* The named slots are contiguous, and never change once the children
+	  have started */
+	for (i = 1; (i < g_nMetrics)
+			&& (g_metrics[i].m_state == C_METRICS_SLOT_READY); i++)
+		if (!strcmp(g_metrics[i].m_apiName, v_apiName)) {
+			t_metrics = &g_metrics[i];
+			break;
+		}
+
+	apr_atomic_inc64(&t_metrics->m_requests);
+	apr_atomic_inc32(&t_metrics->m_inFlight);
+	t_stats->m_metrics = t_metrics;
+	apr_pool_cleanup_register(
+		v_request->pool, v_request, certwatch_metrics_end,
+		apr_pool_cleanup_null
+	);
+
+	return t_stats;
+}
+
+
+/******************************************************************************
+ * certwatch_traceId()                                                        *
+ *   Determines the request's trace ID, which ties the access log entry to    *
+ * the database session: the trace-id from a W3C traceparent header, or else  *
+ * a well-formed X-Request-Id header, or else mod_unique_id's UNIQUE_ID, or   *
+ * else a new random ID.                                                      *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	the trace ID.                                                 *
+ ******************************************************************************/
+#define C_TRACE_ID_MAX		64
+static const char* certwatch_traceId(
+	request_rec* const v_request
+)
+{
+	static const char t_hexDigits[] = "0123456789abcdef";
+	unsigned char t_random[16];
+	const char* t_header;
+	char* t_traceId;
+	apr_size_t i;
+
+	/* traceparent = version "-" trace-id "-" parent-id "-" flags, where the
+	  trace-id is 32 lowercase hex digits and not all zeros */
+	t_header = apr_table_get(v_request->headers_in, "traceparent");
+	if (t_header && (strlen(t_header) >= 55) && (t_header[2] == '-')
+			&& (t_header[35] == '-')) {
+		for (i = 3; i < 35; i++)
+			if ((!apr_isxdigit(t_header[i]))
+					|| apr_isupper(t_header[i]))
+				break;
+		if ((i == 35) && (strspn(t_header + 3, "0") < 32))
+			return apr_pstrndup(v_request->pool, t_header + 3, 32);
+	}
+
+	/* The ID is logged and passed to the database, so only accept one
+	  that's short and needs no escaping */
+	t_header = apr_table_get(v_request->headers_in, "X-Request-Id");
+	if (t_header) {
+		for (i = 0; t_header[i] && (i <= C_TRACE_ID_MAX); i++)
+			if (!(apr_isalnum(t_header[i])
+					|| strchr("-._:", t_header[i])))
+				break;
+		if ((i > 0) && (i <= C_TRACE_ID_MAX) && !t_header[i])
+			return t_header;
+	}
+
+	t_header = apr_table_get(v_request->subprocess_env, "UNIQUE_ID");
+	if (t_header)
+		return t_header;
+
+	ap_random_insecure_bytes(t_random, sizeof(t_random));
+	t_traceId = apr_palloc(v_request->pool, (sizeof(t_random) * 2) + 1);
+	for (i = 0; i < sizeof(t_random); i++) {
+		t_traceId[i * 2] = t_hexDigits[t_random[i] >> 4];
+		t_traceId[(i * 2) + 1] = t_hexDigits[t_random[i] & 0x0F];
+	}
+	t_traceId[i * 2] = '\0';
+
+	return t_traceId;
+}
+
+
+/******************************************************************************
+ * certwatch_shadow_isSampled()                                               *
+ *   Decides whether to mirror this request to the test function.             *
+ *                                                                            *
+ * IN:	v_certWatchDirConfig - the per-directory configuration.               *
+ *                                                                            *
+ * Returns:	1 if the request should be mirrored; otherwise 0.             *
+ ******************************************************************************/
+static int certwatch_shadow_isSampled(
+	const tCertWatchDirConfig* const v_certWatchDirConfig
+)
+{
+	/* Streamed responses are written as they arrive, so there's no single
+	  execution time to compare */
+	if ((!g_shadowThreadPool) || (v_certWatchDirConfig->m_shadowSample <= 0)
+			|| v_certWatchDirConfig->m_stream)
+		return 0;
+
+	return (apr_atomic_inc32(&g_shadowCount)
+			% v_certWatchDirConfig->m_shadowSample) == 0;
+}
+
+
+/******************************************************************************
+ * certwatch_shadow_run()                                                     *
+ *   Runs a mirrored request on the test function, on one of the shadow      *
+ * threads, and records both functions' execution times.                      *
+ *                                                                            *
+ * IN:	v_thread_unused - the thread.                                         *
+ * 	v_shadow - the mirrored request, which is freed.                      *
+ *                                                                            *
+ * Returns:	NULL.                                                         *
+ ******************************************************************************/
+static void* APR_THREAD_FUNC certwatch_shadow_run(
+	apr_thread_t* const v_thread_unused,
+	void* const v_shadow
+)
+{
+	tCertWatchShadow* t_shadow = (tCertWatchShadow*)v_shadow;
+	tCertWatchConnPool* t_connPool;
+	tCertWatchConn* t_conn = NULL;
+	tCertWatchQuery t_query;
+	PGresult* t_PGresult = NULL;
+	apr_time_t t_startedAt = 0;
+	int t_warm;
+
+	/* One connection per shadow thread is all that's ever needed */
+	t_connPool = certwatch_conn_findPool(
+		g_shadowConnPools, t_shadow->m_connInfo, t_shadow->m_isReplica,
+		0, g_shadowThreads, t_shadow->m_dirConfig->m_connIdleTTL
+	);
+	if (t_connPool)
+		t_conn = certwatch_conn_acquire(t_connPool);
+	if (!t_conn) {
+		apr_atomic_inc64(&t_shadow->m_metrics->m_shadowFailed);
+		goto label_return;
+	}
+
+	/* The first run of a statement on a new connection includes the
+	  PREPARE and the cost of loading the new backend's caches, so a pair is
+	  only timed if neither side was a first run */
+	t_warm = (t_conn->m_sent & (1 << t_shadow->m_stmt)) != 0;
+	t_startedAt = apr_time_now();
+	t_PGresult = certwatch_conn_send(
+		t_conn, t_shadow->m_stmt, t_shadow->m_paramValues,
+		t_shadow->m_dirConfig->m_prepare
+	);
+	if (!t_PGresult) {
+		certwatch_query_begin(
+			&t_query, NULL, t_conn,
+			t_shadow->m_dirConfig->m_queryTimeout
+		);
+		t_PGresult = certwatch_query_collect(&t_query);
+	}
+	certwatch_conn_release(t_connPool, t_conn);
+
+	/* Only successful pairs are compared, so that a test function that
+	  fails quickly doesn't look like an improvement */
+	if (PQresultStatus(t_PGresult) != PGRES_TUPLES_OK) {
+		ap_log_error(
+			APLOG_MARK, APLOG_WARNING, 0, NULL,
+			"Shadow request for %s failed: %s",
+			t_shadow->m_paramValues[0],
+			t_PGresult ? PQresultErrorMessage(t_PGresult)
+				: "no result"
+		);
+		apr_atomic_inc64(&t_shadow->m_metrics->m_shadowFailed);
+	}
+	else if (t_warm && t_shadow->m_productionWarm) {
+		certwatch_metrics_observe(
+			t_shadow->m_metrics, C_PHASE_SHADOW_PRODUCTION,
+			t_shadow->m_productionUsec
+		);
+		certwatch_metrics_observe(
+			t_shadow->m_metrics, C_PHASE_SHADOW_TEST,
+			apr_time_now() - t_startedAt
+		);
+	}
+	if (t_PGresult)
+		PQclear(t_PGresult);
+
+label_return:
+	free(t_shadow);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_shadow_submit()                                                  *
+ *   Queues a successful request to be mirrored to the test function, unless *
+ * the shadow threads are too far behind.                                     *
+ *                                                                            *
+ * IN:	v_ctx - the request's state.                                          *
+ ******************************************************************************/
+static void certwatch_shadow_submit(
+	tCertWatchContext* const v_ctx
+)
+{
+	tCertWatchMetrics* t_metrics = v_ctx->m_stats->m_metrics;
+	tCertWatchShadow* t_shadow;
+	apr_size_t t_length[4];
+	apr_size_t t_size = sizeof(*t_shadow);
+	char* t_to;
+	int i;
+
+	if ((!t_metrics) || (!v_ctx->m_connPool) || (!g_shadowThreadPool))
+		return;
+
+	if (apr_thread_pool_tasks_count(g_shadowThreadPool) >= g_shadowQueue)
+		goto label_dropped;
+
+	for (i = 0; i < 4; i++) {
+		t_length[i] = v_ctx->m_paramValues[i]
+				? (strlen(v_ctx->m_paramValues[i]) + 1) : 0;
+		t_size += t_length[i];
+	}
+	t_shadow = malloc(t_size);
+	if (!t_shadow)
+		goto label_dropped;
+
+	t_shadow->m_dirConfig = v_ctx->m_dirConfig;
+	t_shadow->m_connInfo = v_ctx->m_connPool->m_connInfo;
+	t_shadow->m_isReplica = v_ctx->m_connPool->m_isReplica;
+	t_shadow->m_stmt = v_ctx->m_stmt + C_STMT_TEST_OFFSET;
+	t_shadow->m_metrics = t_metrics;
+	t_shadow->m_productionUsec = v_ctx->m_executeUsec;
+	t_shadow->m_productionWarm = v_ctx->m_executeWarm;
+	t_to = (char*)(t_shadow + 1);
+	for (i = 0; i < 4; i++) {
+		t_shadow->m_paramValues[i] = NULL;
+		if (t_length[i]) {
+			t_shadow->m_paramValues[i] = memcpy(
+				t_to, v_ctx->m_paramValues[i], t_length[i]
+			);
+			t_to += t_length[i];
+		}
+	}
+
+	if (apr_thread_pool_push(
+			g_shadowThreadPool, certwatch_shadow_run, t_shadow,
+			APR_THREAD_TASK_PRIORITY_LOWEST, NULL) == APR_SUCCESS)
+		return;
+	free(t_shadow);
+
+label_dropped:
+	apr_atomic_inc64(&t_metrics->m_shadowDropped);
+}
+
+
+/******************************************************************************
+ * certwatch_shadow_stop()                                                    *
+ *   Discards the shadow requests that are still queued, and waits for those  *
+ * that are running.  Runs before the child's connection pools are           *
+ * destroyed.                                                                 *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t certwatch_shadow_stop(
+	void* const v_unused
+)
+{
+	apr_thread_pool_t* t_threadPool = g_shadowThreadPool;
+
+	g_shadowThreadPool = NULL;
+	(void)apr_thread_pool_destroy(t_threadPool);
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_shadow_start()                                                   *
+ *   Creates this child's shadow request threads, which start on demand.     *
+ *                                                                            *
+ * IN:	v_pool - the child process's pool.                                    *
+ * 	v_server - the server record.                                         *
+ ******************************************************************************/
+static void certwatch_shadow_start(
+	apr_pool_t* const v_pool,
+	server_rec* const v_server
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_server->module_config, &certwatch_module
+		);
+	apr_status_t t_result;
+
+	if (t_certWatchServerConfig->m_shadowThreads <= 0)
+		return;
+
+	t_result = apr_thread_pool_create(
+		&g_shadowThreadPool, 0,
+		t_certWatchServerConfig->m_shadowThreads, v_pool
+	);
+	if (t_result != APR_SUCCESS) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, t_result, v_server,
+			"Unable to create the shadow request threads"
+		);
+		g_shadowThreadPool = NULL;
+		return;
+	}
+
+	g_shadowConnPools = apr_hash_make(v_pool);
+	g_shadowThreads = t_certWatchServerConfig->m_shadowThreads;
+	g_shadowQueue = t_certWatchServerConfig->m_shadowQueue;
+	apr_pool_pre_cleanup_register(v_pool, NULL, certwatch_shadow_stop);
+}
+
+
+/******************************************************************************
+ * certwatch_ctx_send()                                                       *
+ *   Sends the query to the primary or a read replica, moving on to another  *
+ * server if the chosen one can't be reached.                                 *
+ *                                                                            *
+ * IN/OUT:	v_ctx - the request's state.                                  *
+ *                                                                            *
+ * Returns:	1 if the query was sent (or failed to send, in which case      *
+ * 		v_ctx->m_PGresult holds the error); 0 if there are no servers *
+ * 		left to try.                                                  *
+ ******************************************************************************/
+static int certwatch_ctx_send(
+	tCertWatchContext* const v_ctx
+)
+{
+	while (v_ctx->m_attempt < C_ROUTE_ATTEMPTS) {
+		v_ctx->m_attempt++;
+		v_ctx->m_connPool = certwatch_conn_route(
+			v_ctx->m_dirConfig, v_ctx->m_apiName, v_ctx->m_connPool
+		);
+		if (!v_ctx->m_connPool)
+			return 0;
+		v_ctx->m_conn = certwatch_conn_checkOut(
+			v_ctx->m_dirConfig, v_ctx->m_connPool
+		);
+		v_ctx->m_phaseStart = certwatch_metrics_record(
+			v_ctx->m_stats, C_PHASE_CONNECT, v_ctx->m_phaseStart
+		);
+		if (!v_ctx->m_conn)
+			continue;
+
+		if (v_ctx->m_PGresult) {
+			PQclear(v_ctx->m_PGresult);
+			v_ctx->m_PGresult = NULL;
+		}
+
+		/* Execute the required function, without blocking, so that the
+		  query can be cancelled if it takes too long or if the client
+		  goes away */
+		v_ctx->m_executeWarm = (v_ctx->m_conn->m_sent
+						& (1 << v_ctx->m_stmt)) != 0;
+		v_ctx->m_PGresult = certwatch_conn_send(
+			v_ctx->m_conn, v_ctx->m_stmt, v_ctx->m_paramValues,
+			v_ctx->m_dirConfig->m_prepare
+		);
+		if (!v_ctx->m_PGresult)
+			certwatch_query_begin(
+				&v_ctx->m_query, v_ctx->m_request,
+				v_ctx->m_conn, v_ctx->m_dirConfig->m_queryTimeout
+			);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * certwatch_ctx_endAttempt()                                                 *
+ *   Checks in the connection once the query's results have been collected,  *
+ * and decides whether the query should be retried on another server.        *
+ *                                                                            *
+ * IN/OUT:	v_ctx - the request's state.                                  *
+ *                                                                            *
+ * Returns:	1 if the query should be retried; otherwise 0.                *
+ ******************************************************************************/
+static int certwatch_ctx_endAttempt(
+	tCertWatchContext* const v_ctx
+)
+{
+	apr_time_t t_startedAt = v_ctx->m_phaseStart;
+	int t_retry;
+
+	/* A query that was cancelled, or that has already sent part of its
+	  response, mustn't be repeated */
+	v_ctx->m_phaseStart = certwatch_metrics_record(
+		v_ctx->m_stats, C_PHASE_EXECUTE, t_startedAt
+	);
+	v_ctx->m_executeUsec = (v_ctx->m_phaseStart > t_startedAt)
+				? (v_ctx->m_phaseStart - t_startedAt) : 0;
+	t_retry = (!v_ctx->m_query.m_cancelled) && certwatch_conn_isRetryable(
+		v_ctx->m_conn, v_ctx->m_PGresult
+	);
+	if (t_retry) {
+		ap_log_error(
+			APLOG_MARK, APLOG_WARNING, 0, NULL,
+			"Retrying on another server after: %s",
+			PQresultErrorMessage(v_ctx->m_PGresult)
+		);
+		if (g_metricsHeader)
+			apr_atomic_inc64(&g_metricsHeader->m_retries);
+	}
+
+	certwatch_conn_checkIn(
+		v_ctx->m_dirConfig, v_ctx->m_connPool, v_ctx->m_conn
+	);
+	v_ctx->m_conn = NULL;
+
+	return t_retry;
+}
+
+
+/******************************************************************************
+ * certwatch_ctx_complete()                                                   *
+ *   Waits for the query that has been sent (streaming its response, if so    *
+ * configured), retrying it on another server if necessary.                  *
+ *                                                                            *
+ * IN/OUT:	v_ctx - the request's state.                                  *
+ ******************************************************************************/
+static void certwatch_ctx_complete(
+	tCertWatchContext* const v_ctx
+)
+{
+	do {
+		if (v_ctx->m_PGresult)
+			continue;	/* The query couldn't be sent */
+		else if (v_ctx->m_dirConfig->m_stream) {
+			v_ctx->m_returnCode = certwatch_streamResponse(
+				v_ctx->m_request, v_ctx->m_dirConfig,
+				&v_ctx->m_query, v_ctx->m_encoding,
+				&v_ctx->m_PGresult
+			);
+			v_ctx->m_streamed = !v_ctx->m_PGresult;
+		}
+		else
+			v_ctx->m_PGresult = certwatch_query_collect(
+				&v_ctx->m_query
+			);
+	} while (certwatch_ctx_endAttempt(v_ctx) && certwatch_ctx_send(v_ctx));
+}
+
+
+/******************************************************************************
+ * certwatch_ctx_respond()                                                    *
+ *   Outputs the HTTP Response once the query has completed.                  *
+ *                                                                            *
+ * IN/OUT:	v_ctx - the request's state.                                  *
+ *                                                                            *
+ * Returns:	OK, DECLINED or some other Apache HTTP error code.            *
+ ******************************************************************************/
+static int certwatch_ctx_respond(
+	tCertWatchContext* const v_ctx
+)
+{
+	request_rec* t_request = v_ctx->m_request;
+	tCertWatchDirConfig* t_certWatchDirConfig = v_ctx->m_dirConfig;
+	const char* t_headerLines = NULL;
+	char* t_response = NULL;
+	int t_response_len = 0;
+	int t_returnCode = DECLINED;
+	tCertWatchCompressor* t_compressor = NULL;
+	long t_ttl = 0;
+	int t_share;
+	int t_shared = 0;
+
+	/* Let another query for this API run before this response is
+	  written */
+	if (v_ctx->m_admit)
+		apr_pool_cleanup_run(
+			t_request->pool, v_ctx->m_admit, certwatch_admit_end
+		);
+
+	/* Has the response already been sent? */
+	if (v_ctx->m_streamed)
+		return v_ctx->m_returnCode;
+	else if (!v_ctx->m_PGresult) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, NULL,
+			"No database server is available"
+		);
+		return DECLINED;
+	}
+
+	/* If the client has gone away, there's nobody to respond to */
+	if (v_ctx->m_query.m_cancelled == C_CANCEL_CLIENT_GONE) {
+		t_request->connection->aborted = 1;
+		t_returnCode = OK;
+		goto label_return;
+	}
+
+	/* Ensure that the SQL query was successful */
+	if (PQresultStatus(v_ctx->m_PGresult) != PGRES_TUPLES_OK) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, NULL,
+			"web_apis() => %s",
+			PQresultErrorMessage(v_ctx->m_PGresult)
+		);
+
+		/* Return a 503 with an error webpage */
+		time_t t_endTime = time(NULL);
+		struct tm t_tm;
+		gmtime_r(&t_endTime, &t_tm);
+		t_request->status = HTTP_SERVICE_UNAVAILABLE;
+		t_request->content_type = "text/html; charset=UTF-8";
+		t_response = apr_psprintf(
+			t_request->pool,
+"<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.0 Transitional//EN\"><HTML><HEAD><TITLE>crt.sh | ERROR!</TITLE><LINK href=\"//fonts.googleapis.com/css?family=Roboto+Mono|Roboto:400,400i,700,700i\" rel=\"stylesheet\"><STYLE type=\"text/css\">body{color:#888888;font:12pt Roboto,sans-serif;padding-top:10px;text-align:center} span{border-radius:10px} span.title{background-color:#00B373;color:#FFFFFF;font:bold 18pt Roboto,sans-serif;padding:0px 5px} span.whiteongrey{background-color:#D9D9D6;color:#FFFFFF;font:bold 18pt Roboto,sans-serif;padding:0px 5px} .copyright{font:8pt Roboto,sans-serif;color:#00B373}</STYLE></HEAD><BODY><A style=\"text-decoration:none\" href=\"/\"><SPAN class=\"title\">crt.sh</SPAN></A>&nbsp; <SPAN class=\"whiteongrey\">Certificate Search</SPAN><BR><BR><BR><BR>Sorry, something went wrong... :-(<BR><BR>Your request was terminated by the crt.sh database server after <B>%ld</B> second%s with the following messages:<BR><BR><TEXTAREA readonly rows=\"8\" cols=\"100\">%s</TEXTAREA><BR><BR>Unfortunately, searches that would produce many results may never succeed. For other requests, please try again later.<BR><BR><BR><P class=\"copyright\">&copy; Sectigo Limited 2015-%d. All rights reserved.</P><DIV><A href=\"https://sectigo.com/\"><IMG src=\"/sectigo_s.png\"></A>&nbsp;<A href=\"https://github.com/crtsh\"><IMG src=\"/GitHub-Mark-32px.png\"></A></DIV></BODY></HTML>",
+			(t_endTime - v_ctx->m_startTime), (((t_endTime - v_ctx->m_startTime) == 1) ? "": "s"),
+			PQresultErrorMessage(v_ctx->m_PGresult), (t_tm.tm_year + 1900)
+		);
+		t_response_len = strlen(t_response);
+		t_returnCode = OK;
+		goto label_outputResponse;
+	}
+
+	/* Now that this request's own execution time is known, mirror it */
+	if (v_ctx->m_shadow)
+		certwatch_shadow_submit(v_ctx);
+
+	/* No row, or a NULL response, means "not found" whichever form the
+	  response takes */
+	if ((PQntuples(v_ctx->m_PGresult) < 1)
+			|| PQgetisnull(v_ctx->m_PGresult, 0, 0)) {
+		t_returnCode = DECLINED;
+		goto label_return;
+	}
+
+	apr_time_t t_phaseStart = apr_time_now();
+	if (v_ctx->m_stmt >= C_STMT_WEB_APIS_FRAMED) {
+		/* The headers and body are separate fields */
+		t_request->content_type = "text/html; charset=UTF-8";
+		if (!certwatch_applyFramed(
+				t_request, v_ctx->m_PGresult, &t_response,
+				&t_response_len,
+				v_ctx->m_requestKey ? &t_headerLines : NULL)) {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, 0, NULL,
+				"web_apis_framed() returned a malformed result"
+			);
+			t_returnCode = HTTP_INTERNAL_SERVER_ERROR;
+			goto label_return;
+		}
+	}
+	else {
+		/* Does the function's response require any HTTP Response
+		  headers to be set or modified?  If not, set some defaults */
+		t_response = PQgetvalue(v_ctx->m_PGresult, 0, 0);
+		t_response_len = PQgetlength(v_ctx->m_PGresult, 0, 0);
+		if (t_response_len == 0) {
+			t_returnCode = DECLINED;
+			goto label_return;
+		}
+		if (!certwatch_applyHeaders(
+				t_request, &t_response, &t_response_len,
+				v_ctx->m_requestKey ? &t_headerLines : NULL))
+			t_request->content_type = "text/html; charset=UTF-8";
+	}
+	(void)certwatch_metrics_record(
+		v_ctx->m_stats, C_PHASE_HEADERS, t_phaseStart
+	);
+	certwatch_setETag(t_request, t_response, t_response_len);
+
+	/* Will this response be cached, or shared with identical requests? */
+	if (v_ctx->m_cacheKey)
+		t_ttl = certwatch_cache_ttl(
+			t_request, t_certWatchDirConfig->m_cacheMaxTTL
+		);
+	t_share = v_ctx->m_coalesceKey && !certwatch_cache_isPrivate(t_request);
+
+	/* Compress the response if the client accepts a coding that's offered.
+	  A response that will be kept is compressed in one go and kept in
+	  compressed form, so that it needn't be compressed again; any other
+	  response is compressed as it's sent */
+	if (v_ctx->m_encoding && certwatch_compress_isCompressible(
+			t_request, t_certWatchDirConfig, t_response_len))
+		t_compressor = certwatch_compress_begin(
+			t_request, t_certWatchDirConfig, v_ctx->m_encoding,
+			t_response_len
+		);
+	if (t_compressor && ((t_ttl > 0) || t_share)) {
+		apr_size_t t_compressed_len;
+		char* t_compressed = certwatch_compress_buffer(
+			t_request, t_compressor, t_response, t_response_len,
+			&t_compressed_len
+		);
+		if (!t_compressed) {
+			ap_log_rerror(
+				APLOG_MARK, APLOG_ERR, 0, t_request,
+				"Unable to compress the response"
+			);
+			t_returnCode = HTTP_INTERNAL_SERVER_ERROR;
+			goto label_return;
+		}
+		t_response = t_compressed;
+		t_response_len = t_compressed_len;
+		PQclear(v_ctx->m_PGresult);
+		v_ctx->m_PGresult = NULL;
+	}
+	if (t_compressor) {
+		certwatch_compress_setHeaders(t_request, v_ctx->m_encoding);
+		/* A cache hit must be labelled the same way */
+		if (v_ctx->m_requestKey)
+			t_headerLines = apr_pstrcat(
+				t_request->pool,
+				t_headerLines ? t_headerLines : "",
+				"Content-Encoding: ",
+				g_encodingName[v_ctx->m_encoding], "\nETag: ",
+				apr_table_get(t_request->headers_out, "ETag"),
+				"\n", NULL
+			);
+	}
+
+	/* If the function said that this response may be cached, do so */
+	if (t_ttl > 0)
+		certwatch_cache_put(
+			t_request, v_ctx->m_cacheKey, t_ttl,
+			t_certWatchDirConfig->m_cacheMaxObjectSize,
+			t_headerLines, t_response, t_response_len
+		);
+
+	/* Share this response with any identical requests that are waiting
+	  for it, for just long enough for them to pick it up */
+	if (t_share)
+		t_shared = certwatch_cache_put(
+			t_request, v_ctx->m_coalesceKey,
+			(t_certWatchDirConfig->m_coalesceWait / 1000) + 2,
+			t_certWatchDirConfig->m_cacheMaxObjectSize,
+			t_headerLines, t_response, t_response_len
+		);
+	if (v_ctx->m_coalesce) {
+		if (!t_shared)
+			certwatch_coalesce_setUnshareable(v_ctx->m_coalesce);
+		apr_pool_cleanup_run(
+			t_request->pool, v_ctx->m_coalesce,
+			certwatch_coalesce_end
+		);
+		v_ctx->m_coalesce = NULL;
+	}
+
+	/* If the client already has this response, there's no need to send
+	  the body */
+	if (certwatch_notModified(t_request)) {
+		t_returnCode = OK;
+		goto label_return;
+	}
+
+	t_phaseStart = apr_time_now();
+
+	/* Compress the response straight from the PGresult's memory */
+	if (t_compressor && v_ctx->m_PGresult) {
+		if (!certwatch_compress_send(
+				t_request, t_compressor, t_response,
+				t_response_len))
+			ap_log_rerror(
+				APLOG_MARK, APLOG_ERR, 0, t_request,
+				"Unable to compress the response"
+			);
+		(void)certwatch_metrics_record(
+			v_ctx->m_stats, C_PHASE_OUTPUT, t_phaseStart
+		);
+		t_returnCode = OK;
+		goto label_return;
+	}
+
+	apr_bucket_brigade* t_bucketBrigade = apr_brigade_create(
+		t_request->pool, t_request->connection->bucket_alloc
+	);
+	apr_file_t* t_spoolFile = NULL;
+	if ((t_certWatchDirConfig->m_spoolThreshold > 0)
+			&& (t_response_len
+				> t_certWatchDirConfig->m_spoolThreshold)) {
+		apr_status_t t_result = certwatch_spoolResponse(
+			t_request, t_certWatchDirConfig->m_spoolDir,
+			t_response, t_response_len, &t_spoolFile
+		);
+		if (t_result != APR_SUCCESS) {
+			ap_log_rerror(
+				APLOG_MARK, APLOG_WARNING, t_result, t_request,
+				"Unable to spool a %d byte response",
+				t_response_len
+			);
+			t_spoolFile = NULL;
+		}
+	}
+
+	if (t_spoolFile) {
+		/* Output the response from the spool file, and free the
+		  PGresult now */
+		apr_brigade_insert_file(
+			t_bucketBrigade, t_spoolFile, 0, t_response_len,
+			t_request->pool
+		);
+		PQclear(v_ctx->m_PGresult);
+	}
+	else if (v_ctx->m_PGresult)
+		/* Output the response straight from the PGresult's memory.
+		  The bucket takes ownership of the PGresult, so that it is
+		  only freed once the response has been written */
+		APR_BRIGADE_INSERT_TAIL(
+			t_bucketBrigade,
+			certwatch_bucket_pgresult_create(
+				v_ctx->m_PGresult, t_response, t_response_len,
+				t_request->connection->bucket_alloc
+			)
+		);
+	else
+		/* The compressed response is in the request's pool */
+		APR_BRIGADE_INSERT_TAIL(
+			t_bucketBrigade,
+			apr_bucket_pool_create(
+				t_response, t_response_len, t_request->pool,
+				t_request->connection->bucket_alloc
+			)
+		);
+	v_ctx->m_PGresult = NULL;
+	APR_BRIGADE_INSERT_TAIL(
+		t_bucketBrigade,
+		apr_bucket_eos_create(t_request->connection->bucket_alloc)
+	);
+	ap_pass_brigade(t_request->output_filters, t_bucketBrigade);
+	(void)certwatch_metrics_record(
+		v_ctx->m_stats, C_PHASE_OUTPUT, t_phaseStart
+	);
+
+	t_returnCode = OK;
+	goto label_return;
+
+	/* Output the error webpage */
+label_outputResponse:
+	ap_rwrite(t_response, t_response_len, t_request);
+
+label_return:
+	if (v_ctx->m_coalesce)
+		apr_pool_cleanup_run(
+			t_request->pool, v_ctx->m_coalesce,
+			certwatch_coalesce_end
+		);
+	if (v_ctx->m_PGresult) {
+		PQclear(v_ctx->m_PGresult);
+		v_ctx->m_PGresult = NULL;
+	}
+
+	return t_returnCode;
+}
+
+
+#ifdef AP_MPMQ_CAN_POLL
+static void certwatch_async_callback(void* const v_baton);
+static void certwatch_async_timeout(void* const v_baton);
+
+
+/******************************************************************************
+ * certwatch_async_wait()                                                     *
+ *   Asks the MPM to call back when the query's connection (or the client's   *
+ * connection) becomes readable, or when the query timeout expires, so that  *
+ * no worker thread is tied up while the database server works.               *
+ *                                                                            *
+ * IN:	v_ctx - the request's state.                                          *
+ *                                                                            *
+ * Returns:	1 if the callback was registered; otherwise 0.                *
+ ******************************************************************************/
+static int certwatch_async_wait(
+	tCertWatchContext* const v_ctx
+)
+{
+	apr_array_header_t* t_pollFds;
+	apr_pollfd_t* t_pollFd;
+	apr_socket_t* t_socket;
+	apr_os_sock_t t_fd;
+	apr_time_t t_timeout = 0;
+
+	/* The pool holds just the current registration */
+	if (v_ctx->m_pollPool)
+		apr_pool_clear(v_ctx->m_pollPool);
+	else if (apr_pool_create(
+			&v_ctx->m_pollPool, v_ctx->m_request->pool)
+				!= APR_SUCCESS)
+		return 0;
+
+	/* apr_os_sock_put() only allocates a new apr_socket_t if it's given
+	  NULL */
+	t_fd = PQsocket(v_ctx->m_conn->m_PGconn);
+	t_socket = NULL;
+	if ((t_fd < 0) || (apr_os_sock_put(&t_socket, &t_fd, v_ctx->m_pollPool)
+				!= APR_SUCCESS))
+		return 0;
+	t_pollFds = apr_array_make(v_ctx->m_pollPool, 2, sizeof(*t_pollFd));
+	t_pollFd = (apr_pollfd_t*)apr_array_push(t_pollFds);
+	t_pollFd->p = v_ctx->m_pollPool;
+	t_pollFd->desc_type = APR_POLL_SOCKET;
+	t_pollFd->reqevents = APR_POLLIN;
+	t_pollFd->desc.s = t_socket;
+
+	/* Once the query has been cancelled, just wait for it to finish */
+	if (!v_ctx->m_query.m_cancelled) {
+		t_socket = ap_get_conn_socket(v_ctx->m_request->connection);
+		if ((v_ctx->m_query.m_clientFd >= 0) && t_socket) {
+			t_pollFd = (apr_pollfd_t*)apr_array_push(t_pollFds);
+			t_pollFd->p = v_ctx->m_pollPool;
+			t_pollFd->desc_type = APR_POLL_SOCKET;
+			t_pollFd->reqevents = APR_POLLIN | APR_POLLHUP;
+			t_pollFd->desc.s = t_socket;
+		}
+
+		if (v_ctx->m_query.m_deadline) {
+			t_timeout = v_ctx->m_query.m_deadline - apr_time_now();
+			if (t_timeout <= 0) {
+				certwatch_query_cancel(
+					&v_ctx->m_query, C_CANCEL_TIMEOUT
+				);
+				t_timeout = 0;
+			}
+		}
+	}
+
+	return (ap_mpm_register_poll_callback_timeout(
+			v_ctx->m_pollPool, t_pollFds, certwatch_async_callback,
+			certwatch_async_timeout, v_ctx, t_timeout
+		) == APR_SUCCESS);
+}
+
+
+/******************************************************************************
+ * certwatch_async_end()                                                      *
+ *   Finishes a suspended request, as the core would have done had the        *
+ * content handler returned v_returnCode, and resumes its connection.         *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_returnCode - the HTTP status, or OK.                                *
+ ******************************************************************************/
+static void certwatch_async_end(
+	request_rec* const v_request,
+	const int v_returnCode
+)
+{
+	conn_rec* t_connection = v_request->connection;
+
+	if (v_returnCode == OK)
+		ap_finalize_request_protocol(v_request);
+	else {
+		/* There's no longer a default handler to decline to, so this
+		  is what it would have returned */
+		v_request->status = HTTP_OK;
+		ap_die(
+			(v_returnCode == DECLINED) ? HTTP_NOT_FOUND
+							: v_returnCode,
+			v_request
+		);
+	}
+
+	/* This may free the request's pool */
+	ap_process_request_after_handler(v_request);
+	ap_mpm_resume_suspended(t_connection);
+}
+
+
+/******************************************************************************
+ * certwatch_async_continue()                                                 *
+ *   Resumes a suspended request when the MPM calls back: waits again if the  *
+ * query hasn't finished, or else outputs the response.                      *
+ *                                                                            *
+ * IN:	v_ctx - the request's state.                                          *
+ * 	v_timedOut - non-zero if the query timeout has expired.               *
+ ******************************************************************************/
+static void certwatch_async_continue(
+	tCertWatchContext* const v_ctx,
+	const int v_timedOut
+)
+{
+	request_rec* t_request = v_ctx->m_request;
+	PGconn* t_PGconn = v_ctx->m_conn->m_PGconn;
+	struct pollfd t_pollFd;
+	int t_returnCode;
+
+	/* Don't run until the content handler has returned SUSPENDED */
+#if APR_HAS_THREADS
+	apr_thread_mutex_t* t_invokeMutex = t_request->invoke_mtx;
+	if (t_invokeMutex)
+		apr_thread_mutex_lock(t_invokeMutex);
+#endif
+
+	if (v_timedOut && !v_ctx->m_query.m_cancelled)
+		certwatch_query_cancel(&v_ctx->m_query, C_CANCEL_TIMEOUT);
+	else if ((!v_ctx->m_query.m_cancelled)
+			&& (v_ctx->m_query.m_clientFd >= 0)) {
+		t_pollFd.fd = v_ctx->m_query.m_clientFd;
+		t_pollFd.events = POLLIN;
+		t_pollFd.revents = 0;
+		if ((poll(&t_pollFd, 1, 0) > 0)
+				&& certwatch_query_isClientGone(&v_ctx->m_query))
+			certwatch_query_cancel(
+				&v_ctx->m_query, C_CANCEL_CLIENT_GONE
+			);
+	}
+
+	/* If this fails, or the callback can't be registered, collecting the
+	  results will block or report the error */
+	if (PQconsumeInput(t_PGconn) && PQisBusy(t_PGconn)
+			&& certwatch_async_wait(v_ctx))
+		goto label_unlock;
+
+	v_ctx->m_PGresult = certwatch_query_collect(&v_ctx->m_query);
+	if (certwatch_ctx_endAttempt(v_ctx) && certwatch_ctx_send(v_ctx)) {
+		if ((!v_ctx->m_PGresult) && certwatch_async_wait(v_ctx))
+			goto label_unlock;
+		certwatch_ctx_complete(v_ctx);
+	}
+
+	t_returnCode = certwatch_ctx_respond(v_ctx);
+#if APR_HAS_THREADS
+	if (t_invokeMutex)
+		apr_thread_mutex_unlock(t_invokeMutex);
+#endif
+	certwatch_async_end(t_request, t_returnCode);
+	return;
+
+label_unlock:
+#if APR_HAS_THREADS
+	if (t_invokeMutex)
+		apr_thread_mutex_unlock(t_invokeMutex);
+#endif
+}
+
+
+/******************************************************************************
+ * certwatch_async_callback()                                                 *
+ *   Called by the MPM when a suspended request's query connection (or its    *
+ * client connection) becomes readable.                                       *
+ *                                                                            *
+ * IN:	v_baton - the request's state.                                        *
+ ******************************************************************************/
+static void certwatch_async_callback(
+	void* const v_baton
+)
+{
+	certwatch_async_continue((tCertWatchContext*)v_baton, 0);
+}
+
+
+/******************************************************************************
+ * certwatch_async_timeout()                                                  *
+ *   Called by the MPM when a suspended request's query timeout expires.      *
+ *                                                                            *
+ * IN:	v_baton - the request's state.                                        *
+ ******************************************************************************/
+static void certwatch_async_timeout(
+	void* const v_baton
+)
+{
+	certwatch_async_continue((tCertWatchContext*)v_baton, 1);
+}
+#endif
+
+
+/******************************************************************************
+ * certwatch_contentHandler()                                                 *
+ *   Handle an HTTP request from a CertWatch client and return an HTTP        *
+ * Response.                                                                  *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	OK, DECLINED, SUSPENDED or some other Apache HTTP error code. *
+ ******************************************************************************/
+static int certwatch_contentHandler(
+	request_rec* const v_request
+)
+{
+	tCertWatchContext* t_ctx;
+	char* t_requestParams = NULL;
+	char* t_nameArray = NULL;
+	char* t_valueArray = NULL;
+	const char* t_firstName = NULL;
+	char* t_value;
+	char* t_uri;
+	unsigned char* t_body_data = NULL;
+	long t_body_size = 0;
+	int t_returnCode = DECLINED;
+
+	/* Check if we need to handle this request at all */
+	if (strcmp(v_request->handler, "certwatch"))
+		return DECLINED;
+
+	/* Get the per-directory configuration structure */
+	tCertWatchDirConfig* t_certWatchDirConfig =
+		(tCertWatchDirConfig*)ap_get_module_config(
+			v_request->per_dir_config, &certwatch_module
+		);
+	if (!t_certWatchDirConfig)
+		return DECLINED;
+
+	/* Isolate the path component of the URI */
 	t_uri = apr_pstrdup(v_request->pool, v_request->unparsed_uri);
 	t_value = ap_strchr(t_uri, '?');
 	if (t_value)
 		*t_value = '\0';
 
-	/* If there's a dot in the path, decline to handle it here (except for
-	  *.json): images, robots.txt, etc */
-	t_value = ap_strrchr(t_uri, '.');
-	if ((t_value != NULL) && (strcmp(t_value, ".json") != 0))
+	/* If there's a dot in the path, decline to handle it here (except for
+	  *.json): images, robots.txt, etc */
+	t_value = ap_strrchr(t_uri, '.');
+	if ((t_value != NULL) && (strcmp(t_value, ".json") != 0))
+		return DECLINED;
+
+	/* Process this request */
+	if (!strncmp(v_request->uri, "/test/", 6)) {
+		apr_table_set(
+			v_request->headers_out, "Location",
+			apr_psprintf(
+				v_request->pool, "https://%s/?%s",
+				v_request->hostname, v_request->args
+			)
+		);
+		return HTTP_MOVED_TEMPORARILY;
+	}
+	else if (v_request->method_number == M_GET)
+		t_requestParams = v_request->args;
+	else if (v_request->method_number == M_POST) {
+		t_returnCode = certwatch_read_body(
+			v_request, t_certWatchDirConfig->m_maxBodySize,
+			&t_body_data, &t_body_size
+		);
+		if (t_returnCode != OK)
+			return t_returnCode;
+		t_requestParams = (char*)t_body_data;
+	}
+	else
+		return DECLINED;
+
+	const char* t_accept = apr_table_get(v_request->headers_in, "Accept");
+	if (t_accept && (!strcmp(t_accept, "application/json")))
+		t_requestParams = apr_psprintf(
+			v_request->pool, "output=json&%s", t_requestParams
+		);
+
+	/* Is the output format specified by the path? */
+	certwatch_parse_makeParamArrays(
+		certwatch_poolAlloc, v_request->pool,
+		((strlen(v_request->unparsed_uri) > 1)
+				&& (!strstr(v_request->unparsed_uri, "/?")))
+			? v_request->uri : NULL,
+		t_requestParams, &t_nameArray, &t_valueArray, &t_firstName
+	);
+
+	/* The request's state lives in its pool, so that it can outlive this
+	  handler if the query is waited for asynchronously */
+	t_ctx = apr_pcalloc(v_request->pool, sizeof(*t_ctx));
+	t_ctx->m_request = v_request;
+	t_ctx->m_dirConfig = t_certWatchDirConfig;
+	t_ctx->m_query.m_clientFd = -1;
+
+	/* Prepare the function's parameters */
+	t_ctx->m_paramValues[0] = strrchr(v_request->uri, '/') + 1;
+	t_ctx->m_paramValues[1] = t_nameArray;
+	t_ctx->m_paramValues[2] = t_valueArray;
+	const char* t_xForwardedFor = apr_table_get(
+		v_request->headers_in, "X-Forwarded-For"
+	);
+	/* The trace ID comes first, so that it survives the truncation of
+	  application_name to 63 bytes (and so appears in pg_stat_activity and,
+	  via %a in log_line_prefix, in the slow query log) */
+	const char* t_traceId = certwatch_traceId(v_request);
+	apr_table_setn(v_request->notes, "certwatch_trace_id", t_traceId);
+	t_ctx->m_paramValues[3] = apr_psprintf(
+		v_request->pool, "%s [%s] %s", t_traceId,
+		t_xForwardedFor ? t_xForwardedFor : v_request->useragent_ip,
+		v_request->the_request
+	);
+	int t_isTest = !strncmp(v_request->uri, "/_ROB_IS_TESTING_/", 18);
+	t_ctx->m_apiName = certwatch_apiName(
+		t_ctx->m_paramValues[0], t_firstName
+	);
+	t_ctx->m_stats = certwatch_metrics_begin(v_request, t_ctx->m_apiName);
+	t_ctx->m_stats->m_function = t_ctx->m_paramValues[0];
+	t_ctx->m_stats->m_nameArray = t_nameArray;
+	t_ctx->m_stats->m_valueArray = t_valueArray;
+
+	/* Choose the content coding.  Whether or not the response ends up
+	  compressed, which representation is sent depends on Accept-Encoding */
+	if (t_certWatchDirConfig->m_nCompress > 0) {
+		apr_table_mergen(
+			v_request->headers_out, "Vary", "Accept-Encoding"
+		);
+		t_ctx->m_encoding = certwatch_compress_negotiate(
+			v_request, t_certWatchDirConfig
+		);
+	}
+
+	/* The request key identifies identical requests.  The output format
+	  (from the path or the Accept header) is one of the parameters, so it's
+	  part of the key, and so is the content coding, since responses are
+	  cached in compressed form */
+	if ((!t_certWatchDirConfig->m_stream) && g_cacheInstance)
+		t_ctx->m_requestKey = certwatch_key_create(
+			v_request->pool,
+			apr_pstrcat(
+				v_request->pool, t_isTest ? "test" : "",
+				t_ctx->m_encoding
+					? g_encodingName[t_ctx->m_encoding]
+					: "", NULL
+			),
+			t_ctx->m_paramValues[0], t_nameArray, t_valueArray
+		);
+
+	/* If this response may be cached, check whether it already has been */
+	if (t_ctx->m_requestKey && certwatch_cache_isEnabled(
+			t_certWatchDirConfig, t_ctx->m_apiName)) {
+		t_ctx->m_cacheKey = t_ctx->m_requestKey;
+		if (certwatch_cache_serve(
+				v_request, t_ctx->m_cacheKey,
+				t_certWatchDirConfig->m_cacheMaxObjectSize))
+			return OK;
+	}
+
+	/* Charge the client for the query (a cached response is free), and
+	  turn it away cheaply if it's over its limit */
+	if (g_rateSlots && !certwatch_rate_take(
+			v_request, certwatch_rate_cost(t_ctx->m_apiName)))
+		return HTTP_TOO_MANY_REQUESTS;
+
+	/* If an identical query is already running, wait for its response
+	  rather than running it again */
+	if (t_ctx->m_requestKey && g_coalesceSlots) {
+		t_ctx->m_coalesceKey = apr_pstrcat(
+			v_request->pool, "coalesce\n", t_ctx->m_requestKey, NULL
+		);
+		switch (certwatch_coalesce_begin(
+				v_request, t_ctx->m_requestKey,
+				t_certWatchDirConfig->m_coalesceWait,
+				&t_ctx->m_coalesce)) {
+			case C_COALESCE_DONE:
+				if (certwatch_cache_serve(
+						v_request, t_ctx->m_coalesceKey,
+						t_certWatchDirConfig
+							->m_cacheMaxObjectSize))
+					return OK;
+				/* The leader failed, or its response can't be
+				  shared, so run the query ourselves */
+				t_ctx->m_coalesceKey = NULL;
+				break;
+			case C_COALESCE_NONE:
+				t_ctx->m_coalesceKey = NULL;
+				break;
+		}
+	}
+
+	/* Limit the number of concurrent queries for this API, shedding load
+	  with a cheap 503 when the database is saturated */
+	t_ctx->m_phaseStart = apr_time_now();
+	if (g_admitSlots && !certwatch_admit_begin(
+			v_request, t_ctx->m_apiName,
+			t_certWatchDirConfig->m_admitWait, &t_ctx->m_admit)) {
+		(void)certwatch_metrics_record(
+			t_ctx->m_stats, C_PHASE_QUEUE, t_ctx->m_phaseStart
+		);
+		apr_table_setn(
+			v_request->err_headers_out, "Retry-After",
+			apr_itoa(
+				v_request->pool,
+				t_certWatchDirConfig->m_admitRetryAfter
+			)
+		);
+		return HTTP_SERVICE_UNAVAILABLE;
+	}
+	t_ctx->m_phaseStart = certwatch_metrics_record(
+		t_ctx->m_stats, C_PHASE_QUEUE, t_ctx->m_phaseStart
+	);
+
+	/* Decide which variant of web_apis() to call */
+	t_ctx->m_stmt = C_STMT_WEB_APIS;
+	if (t_certWatchDirConfig->m_stream)
+		t_ctx->m_stmt = C_STMT_WEB_APIS_STREAM;
+	else if (t_certWatchDirConfig->m_framed)
+		t_ctx->m_stmt = C_STMT_WEB_APIS_FRAMED;
+	if (t_isTest)
+		t_ctx->m_stmt += C_STMT_TEST_OFFSET;
+	else
+		t_ctx->m_shadow = certwatch_shadow_isSampled(
+			t_certWatchDirConfig
+		);
+
+	/* Run the query on the primary or a read replica, moving on to another
+	  server if the chosen one is unavailable */
+	t_ctx->m_startTime = time(NULL);
+	if (certwatch_ctx_send(t_ctx)) {
+#ifdef AP_MPMQ_CAN_POLL
+		/* On an MPM that can suspend requests (i.e. event), free this
+		  worker thread until the result arrives.  A streamed response
+		  is written as it arrives, so it can't be waited for this way,
+		  and nor can an HTTP/2 stream */
+		if ((!t_ctx->m_PGresult) && t_certWatchDirConfig->m_async
+				&& g_mpmCanPoll
+				&& (!t_certWatchDirConfig->m_stream)
+				&& (!v_request->connection->master)
+				&& certwatch_async_wait(t_ctx))
+			return SUSPENDED;
+#endif
+		certwatch_ctx_complete(t_ctx);
+	}
+
+	return certwatch_ctx_respond(t_ctx);
+}
+
+
+/******************************************************************************
+ * certwatch_batch_flush()                                                    *
+ *   Sends everything that's queued on a non-blocking connection, reading    *
+ * any results that arrive meanwhile so that the server can't stall waiting  *
+ * for us to read them.                                                       *
+ *                                                                            *
+ * IN:	v_PGconn - the connection.                                            *
+ *                                                                            *
+ * Returns:	1 on success; 0 if an error occurred.                         *
+ ******************************************************************************/
+static int certwatch_batch_flush(
+	PGconn* const v_PGconn
+)
+{
+	struct pollfd t_pollFd;
+	int t_flushed;
+
+	while ((t_flushed = PQflush(v_PGconn)) == 1) {
+		t_pollFd.fd = PQsocket(v_PGconn);
+		t_pollFd.events = POLLIN | POLLOUT;
+		t_pollFd.revents = 0;
+		if (poll(&t_pollFd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if ((t_pollFd.revents & POLLIN) && !PQconsumeInput(v_PGconn))
+			return 0;
+	}
+
+	return (t_flushed == 0);
+}
+
+
+/******************************************************************************
+ * certwatch_batch_run()                                                      *
+ *   Runs a batch's sub-requests on one connection.  In pipeline mode, every *
+ * sub-request is sent before any result is awaited, so the whole batch      *
+ * costs about one round trip.  Each sub-request is followed by a sync       *
+ * point, so that one failure doesn't abort the rest.  The query timeout      *
+ * applies to the whole batch, and a cancellation stops it.                   *
+ *                                                                            *
+ * IN:	v_query - the query state.                                            *
+ * 	v_nItems - the number of sub-requests.                                *
+ * 	v_stmt - the statement (C_STMT_*).                                    *
+ * 	v_prepare - non-zero to use a prepared statement.                     *
+ *                                                                            *
+ * IN/OUT:	v_items - the sub-requests, which receive their results.      *
+ ******************************************************************************/
+static void certwatch_batch_run(
+	tCertWatchQuery* const v_query,
+	tCertWatchBatchItem* const v_items,
+	const int v_nItems,
+	const int v_stmt,
+	const int v_prepare
+)
+{
+	int i;
+#ifdef LIBPQ_HAS_PIPELINING
+	PGconn* t_PGconn = v_query->m_conn->m_PGconn;
+	PGresult* t_PGresult;
+	int t_prepare = v_prepare;
+	int t_nSent;
+
+	/* Statements can't be prepared synchronously in pipeline mode */
+	if (t_prepare) {
+		t_PGresult = certwatch_conn_prepare(v_query->m_conn, v_stmt);
+		if (t_PGresult) {
+			PQclear(t_PGresult);
+			t_prepare = 0;
+		}
+	}
+
+	if ((PQsetnonblocking(t_PGconn, 1) == 0)
+			&& PQenterPipelineMode(t_PGconn)) {
+		for (t_nSent = 0; t_nSent < v_nItems; t_nSent++) {
+			v_items[t_nSent].m_PGresult = certwatch_conn_send(
+				v_query->m_conn, v_stmt,
+				v_items[t_nSent].m_paramValues, t_prepare
+			);
+			if (v_items[t_nSent].m_PGresult)
+				break;
+			else if (!PQpipelineSync(t_PGconn)) {
+				v_items[t_nSent].m_PGresult =
+					PQmakeEmptyPGresult(
+						t_PGconn, PGRES_FATAL_ERROR
+					);
+				break;
+			}
+		}
+
+		/* If this fails, the results will report the error */
+		(void)certwatch_batch_flush(t_PGconn);
+
+		for (i = 0; (i < t_nSent) && !v_query->m_cancelled; i++) {
+			v_items[i].m_PGresult = certwatch_query_collect(v_query);
+
+			/* Every sub-request's results end at its sync point */
+			t_PGresult = certwatch_query_getResult(v_query);
+			if (PQresultStatus(t_PGresult) != PGRES_PIPELINE_SYNC) {
+				PQclear(t_PGresult);
+				break;
+			}
+			PQclear(t_PGresult);
+		}
+
+		/* If there are still results to come, this fails, and so the
+		  connection will be closed rather than reused */
+		(void)PQexitPipelineMode(t_PGconn);
+		(void)PQsetnonblocking(t_PGconn, 0);
+		return;
+	}
+	(void)PQsetnonblocking(t_PGconn, 0);
+#endif
+
+	/* Without pipeline mode, run the sub-requests one at a time */
+	for (i = 0; (i < v_nItems) && !v_query->m_cancelled; i++) {
+		v_items[i].m_PGresult = certwatch_conn_send(
+			v_query->m_conn, v_stmt, v_items[i].m_paramValues,
+			v_prepare
+		);
+		if (!v_items[i].m_PGresult)
+			v_items[i].m_PGresult = certwatch_query_collect(v_query);
+	}
+}
+
+
+/******************************************************************************
+ * certwatch_batch_addPart()                                                  *
+ *   Appends a sub-request's response to a batch's multipart response body,   *
+ * with its status and (from any [BEGIN_HEADERS] block) headers as part      *
+ * headers.  A successful response is output straight from the PGresult's    *
+ * memory, in which case the part takes ownership of the PGresult.           *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_bucketBrigade - the response body.                                  *
+ * 	v_boundary - the multipart boundary.                                  *
+ *                                                                            *
+ * IN/OUT:	v_item - the sub-request.                                     *
+ ******************************************************************************/
+static void certwatch_batch_addPart(
+	request_rec* const v_request,
+	apr_bucket_brigade* const v_bucketBrigade,
+	const char* const v_boundary,
+	tCertWatchBatchItem* const v_item
+)
+{
+	const char* t_contentType = "Content-Type: text/html; charset=UTF-8\r\n";
+	const char* t_headers = "";
+	char* t_response = "";
+	char* t_lines;
+	char* t_endOfHeaders;
+	char* t_next;
+	int t_response_len = 0;
+	int t_status = HTTP_OK;
+
+	if (!v_item->m_PGresult) {
+		t_status = HTTP_SERVICE_UNAVAILABLE;
+		t_contentType = "Content-Type: text/plain; charset=UTF-8\r\n";
+		t_response = "This sub-request was not run.\n";
+	}
+	else if (PQresultStatus(v_item->m_PGresult) != PGRES_TUPLES_OK) {
+		t_status = HTTP_SERVICE_UNAVAILABLE;
+		t_contentType = "Content-Type: text/plain; charset=UTF-8\r\n";
+		t_response = PQresultErrorMessage(v_item->m_PGresult);
+	}
+	else if ((PQntuples(v_item->m_PGresult) < 1)
+			|| (PQgetlength(v_item->m_PGresult, 0, 0) == 0))
+		t_status = HTTP_NOT_FOUND;
+	else {
+		t_response = PQgetvalue(v_item->m_PGresult, 0, 0);
+		t_response_len = PQgetlength(v_item->m_PGresult, 0, 0);
+
+		/* Copy the function's headers into the part's headers */
+		if (certwatch_findHeaders(
+				t_response, t_response_len, &t_lines,
+				&t_endOfHeaders)) {
+			for (; t_lines < t_endOfHeaders; t_lines = t_next + 1) {
+				t_next = memchr(
+					t_lines, '\n', t_endOfHeaders - t_lines
+				);
+				if (!t_next)
+					break;
+				else if (!memchr(t_lines, ':', t_next - t_lines))
+					continue;
+				if (!strncasecmp(t_lines, "Content-Type:", 13))
+					t_contentType = "";
+				t_headers = apr_pstrcat(
+					v_request->pool, t_headers,
+					apr_pstrmemdup(
+						v_request->pool, t_lines,
+						t_next - t_lines
+					), "\r\n", NULL
+				);
+			}
+			t_response_len -= (t_endOfHeaders - t_response);
+			t_response_len -= strlen(C_HTTP_HEADERS_CLOSE);
+			t_response = t_endOfHeaders
+					+ strlen(C_HTTP_HEADERS_CLOSE);
+		}
+	}
+
+	apr_brigade_printf(
+		v_bucketBrigade, NULL, NULL,
+		"--%s\r\nStatus: %d\r\nContent-Location: %s\r\n%s%s\r\n",
+		v_boundary, t_status, v_item->m_line, t_contentType, t_headers
+	);
+	if (t_response_len > 0) {
+		APR_BRIGADE_INSERT_TAIL(
+			v_bucketBrigade,
+			certwatch_bucket_pgresult_create(
+				v_item->m_PGresult, t_response, t_response_len,
+				v_bucketBrigade->bucket_alloc
+			)
+		);
+		v_item->m_PGresult = NULL;
+	}
+	else
+		apr_brigade_puts(v_bucketBrigade, NULL, NULL, t_response);
+	apr_brigade_puts(v_bucketBrigade, NULL, NULL, "\r\n");
+}
+
+
+/******************************************************************************
+ * certwatch_batchHandler()                                                   *
+ *   Handle a POSTed batch of sub-requests, one per line, each in the same    *
+ * form as a GET request's URI (e.g. "/?id=12345").  They're all run on one   *
+ * connection, and their responses are returned as one multipart/mixed body, *
+ * in the same order, each part having its own Status header.                 *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	OK, DECLINED or some other Apache HTTP error code.            *
+ ******************************************************************************/
+static int certwatch_batchHandler(
+	request_rec* const v_request
+)
+{
+	static const char t_hexDigits[] = "0123456789abcdef";
+	tCertWatchConnPool* t_connPool = NULL;
+	tCertWatchConn* t_conn = NULL;
+	apr_array_header_t* t_items;
+	tCertWatchBatchItem* t_item;
+	tCertWatchQuery t_query = { NULL, NULL, 0, 0, -1, C_CANCEL_NONE };
+	tCertWatchAdmit* t_admit = NULL;
+	apr_bucket_brigade* t_bucketBrigade;
+	apr_time_t t_phaseStart;
+	unsigned char t_random[16];
+	char t_boundary[(sizeof(t_random) * 2) + 1];
+	const char* t_routeName = NULL;
+	const char* t_apiName;
+	const char* t_firstName;
+	char* t_nameArray;
+	char* t_valueArray;
+	char* t_line;
+	char* t_next;
+	char* t_path;
+	char* t_args;
+	unsigned char* t_body_data = NULL;
+	long t_body_size = 0;
+	apr_size_t t_length;
+	apr_uint32_t t_cost = 0;
+	int t_attempt;
+	int t_returnCode;
+	int i;
+
+	/* Check if we need to handle this request at all */
+	if (strcmp(v_request->handler, "certwatch-batch"))
+		return DECLINED;
+	else if (v_request->method_number != M_POST)
+		return HTTP_METHOD_NOT_ALLOWED;
+
+	/* Get the per-directory configuration structure */
+	tCertWatchDirConfig* t_certWatchDirConfig =
+		(tCertWatchDirConfig*)ap_get_module_config(
+			v_request->per_dir_config, &certwatch_module
+		);
+	if (!t_certWatchDirConfig)
+		return DECLINED;
+
+	t_returnCode = certwatch_read_body(
+		v_request, t_certWatchDirConfig->m_maxBodySize, &t_body_data,
+		&t_body_size
+	);
+	if (t_returnCode != OK)
+		return t_returnCode;
+	else if (!t_body_data)
+		return HTTP_BAD_REQUEST;
+
+	/* Split the body into sub-requests, ignoring blank lines */
+	t_items = apr_array_make(
+		v_request->pool, 16, sizeof(tCertWatchBatchItem)
+	);
+	for (t_line = (char*)t_body_data; *t_line; t_line = t_next) {
+		t_next = strchr(t_line, '\n');
+		if (t_next)
+			*(t_next++) = '\0';
+		else
+			t_next = t_line + strlen(t_line);
+		t_length = strlen(t_line);
+		if ((t_length > 0) && (t_line[t_length - 1] == '\r'))
+			t_line[--t_length] = '\0';
+		if (t_length == 0)
+			continue;
+		else if (*t_line != '/')
+			return HTTP_BAD_REQUEST;
+		else if (t_items->nelts >= t_certWatchDirConfig->m_batchMaxItems)
+			return HTTP_REQUEST_ENTITY_TOO_LARGE;
+
+		t_item = (tCertWatchBatchItem*)apr_array_push(t_items);
+		t_item->m_line = t_line;
+	}
+	if (t_items->nelts == 0)
+		return HTTP_BAD_REQUEST;
+
+	const char* t_xForwardedFor = apr_table_get(
+		v_request->headers_in, "X-Forwarded-For"
+	);
+	const char* t_traceId = certwatch_traceId(v_request);
+	apr_table_setn(v_request->notes, "certwatch_trace_id", t_traceId);
+	tCertWatchRequestStats* t_stats = certwatch_metrics_begin(
+		v_request, "batch"
+	);
+
+	/* Prepare each sub-request's parameters, just as the content handler
+	  does for a GET request */
+	for (i = 0; i < t_items->nelts; i++) {
+		t_item = &APR_ARRAY_IDX(t_items, i, tCertWatchBatchItem);
+		t_path = apr_pstrdup(v_request->pool, t_item->m_line);
+		t_args = strchr(t_path, '?');
+		if (t_args)
+			*(t_args++) = '\0';
+		if (ap_unescape_url(t_path) != OK)
+			return HTTP_BAD_REQUEST;
+
+		certwatch_parse_makeParamArrays(
+			certwatch_poolAlloc, v_request->pool,
+			((strlen(t_item->m_line) > 1)
+					&& (!strstr(t_item->m_line, "/?")))
+				? t_path : NULL,
+			t_args, &t_nameArray, &t_valueArray, &t_firstName
+		);
+		t_item->m_paramValues[0] = strrchr(t_path, '/') + 1;
+		t_item->m_paramValues[1] = t_nameArray;
+		t_item->m_paramValues[2] = t_valueArray;
+		t_item->m_paramValues[3] = apr_psprintf(
+			v_request->pool, "%s [%s] %s", t_traceId,
+			t_xForwardedFor ? t_xForwardedFor
+					: v_request->useragent_ip,
+			t_item->m_line
+		);
+
+		/* The batch runs on the primary if any of its APIs must */
+		t_apiName = certwatch_apiName(
+			t_item->m_paramValues[0], t_firstName
+		);
+		if ((!t_routeName) || certwatch_conn_isPinned(
+				t_certWatchDirConfig, t_apiName))
+			t_routeName = t_apiName;
+		if (g_rateSlots)
+			t_cost += certwatch_rate_cost(t_apiName);
+	}
+
+	/* The client is charged for every sub-request up front */
+	if (g_rateSlots && !certwatch_rate_take(v_request, t_cost))
+		return HTTP_TOO_MANY_REQUESTS;
+
+	/* A batch is admitted as a single "batch" query */
+	t_phaseStart = apr_time_now();
+	if (g_admitSlots && !certwatch_admit_begin(
+			v_request, "batch", t_certWatchDirConfig->m_admitWait,
+			&t_admit)) {
+		(void)certwatch_metrics_record(
+			t_stats, C_PHASE_QUEUE, t_phaseStart
+		);
+		apr_table_setn(
+			v_request->err_headers_out, "Retry-After",
+			apr_itoa(
+				v_request->pool,
+				t_certWatchDirConfig->m_admitRetryAfter
+			)
+		);
+		return HTTP_SERVICE_UNAVAILABLE;
+	}
+	t_phaseStart = certwatch_metrics_record(
+		t_stats, C_PHASE_QUEUE, t_phaseStart
+	);
+
+	for (t_attempt = 0; (t_attempt < C_ROUTE_ATTEMPTS) && !t_conn;
+			t_attempt++) {
+		t_connPool = certwatch_conn_route(
+			t_certWatchDirConfig, t_routeName, t_connPool
+		);
+		if (!t_connPool)
+			break;
+		t_conn = certwatch_conn_checkOut(
+			t_certWatchDirConfig, t_connPool
+		);
+	}
+	t_phaseStart = certwatch_metrics_record(
+		t_stats, C_PHASE_CONNECT, t_phaseStart
+	);
+	if (!t_conn) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, NULL,
+			"No database server is available"
+		);
+		t_returnCode = HTTP_SERVICE_UNAVAILABLE;
+		goto label_return;
+	}
+
+	certwatch_query_begin(
+		&t_query, v_request, t_conn,
+		t_certWatchDirConfig->m_queryTimeout
+	);
+	certwatch_batch_run(
+		&t_query, (tCertWatchBatchItem*)t_items->elts, t_items->nelts,
+		strncmp(v_request->uri, "/_ROB_IS_TESTING_/", 18)
+			? C_STMT_WEB_APIS : C_STMT_WEB_APIS_TEST,
+		t_certWatchDirConfig->m_prepare
+	);
+	certwatch_conn_checkIn(t_certWatchDirConfig, t_connPool, t_conn);
+	t_phaseStart = certwatch_metrics_record(
+		t_stats, C_PHASE_EXECUTE, t_phaseStart
+	);
+
+	/* If the client has gone away, there's nobody to respond to */
+	if (t_query.m_cancelled == C_CANCEL_CLIENT_GONE) {
+		v_request->connection->aborted = 1;
+		t_returnCode = OK;
+		goto label_return;
+	}
+
+	if (t_admit)
+		apr_pool_cleanup_run(
+			v_request->pool, t_admit, certwatch_admit_end
+		);
+
+	ap_random_insecure_bytes(t_random, sizeof(t_random));
+	for (i = 0; i < (int)sizeof(t_random); i++) {
+		t_boundary[i * 2] = t_hexDigits[t_random[i] >> 4];
+		t_boundary[(i * 2) + 1] = t_hexDigits[t_random[i] & 0x0F];
+	}
+	t_boundary[i * 2] = '\0';
+	v_request->content_type = apr_pstrcat(
+		v_request->pool, "multipart/mixed; boundary=", t_boundary, NULL
+	);
+	apr_table_setn(v_request->headers_out, "Cache-Control", "no-store");
+
+	t_bucketBrigade = apr_brigade_create(
+		v_request->pool, v_request->connection->bucket_alloc
+	);
+	for (i = 0; i < t_items->nelts; i++)
+		certwatch_batch_addPart(
+			v_request, t_bucketBrigade, t_boundary,
+			&APR_ARRAY_IDX(t_items, i, tCertWatchBatchItem)
+		);
+	apr_brigade_printf(
+		t_bucketBrigade, NULL, NULL, "--%s--\r\n", t_boundary
+	);
+	APR_BRIGADE_INSERT_TAIL(
+		t_bucketBrigade,
+		apr_bucket_eos_create(v_request->connection->bucket_alloc)
+	);
+	ap_pass_brigade(v_request->output_filters, t_bucketBrigade);
+	(void)certwatch_metrics_record(
+		t_stats, C_PHASE_OUTPUT, t_phaseStart
+	);
+	t_returnCode = OK;
+
+label_return:
+	for (i = 0; i < t_items->nelts; i++)
+		if (APR_ARRAY_IDX(t_items, i, tCertWatchBatchItem).m_PGresult)
+			PQclear(APR_ARRAY_IDX(
+				t_items, i, tCertWatchBatchItem
+			).m_PGresult);
+
+	return t_returnCode;
+}
+
+
+/******************************************************************************
+ * certwatch_status_percentile()                                              *
+ *   Estimates a percentile from a histogram.                                 *
+ *                                                                            *
+ * IN:	v_buckets - the histogram's buckets.                                  *
+ * 	v_count - the total of the buckets.                                   *
+ * 	v_percent - the percentile.                                           *
+ *                                                                            *
+ * Returns:	the upper limit (in microseconds) of the percentile's bucket. *
+ ******************************************************************************/
+static apr_uint64_t certwatch_status_percentile(
+	const apr_uint64_t* const v_buckets,
+	const apr_uint64_t v_count,
+	const int v_percent
+)
+{
+	apr_uint64_t t_target = ((v_count * v_percent) + 99) / 100;
+	apr_uint64_t t_cumulative = 0;
+	unsigned int i;
+
+	if (v_count == 0)
+		return 0;
+
+	for (i = 0; i < C_HISTOGRAM_BUCKETS; i++) {
+		t_cumulative += v_buckets[i];
+		if (t_cumulative >= t_target)
+			break;
+	}
+
+	return certwatch_metrics_bucketLimit(
+		(i < C_HISTOGRAM_BUCKETS) ? i : (C_HISTOGRAM_BUCKETS - 1)
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_status_snapshot()                                                *
+ *   Copies a histogram's buckets, so that they can be reported consistently  *
+ * while other requests update them.                                          *
+ *                                                                            *
+ * IN:	v_histogram - the histogram.                                          *
+ *                                                                            *
+ * OUT:	v_buckets - the buckets.                                              *
+ *                                                                            *
+ * Returns:	the total of the buckets.                                     *
+ ******************************************************************************/
+static apr_uint64_t certwatch_status_snapshot(
+	tCertWatchHistogram* const v_histogram,
+	apr_uint64_t* const v_buckets
+)
+{
+	apr_uint64_t t_count = 0;
+	unsigned int i;
+
+	for (i = 0; i < C_HISTOGRAM_BUCKETS; i++) {
+		v_buckets[i] = apr_atomic_read64(&v_histogram->m_buckets[i]);
+		t_count += v_buckets[i];
+	}
+
+	return t_count;
+}
+
+
+/******************************************************************************
+ * certwatch_status_promCounter()                                             *
+ *   Outputs one per-API metric family in the Prometheus text format.         *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_name - the metric name.                                             *
+ * 	v_help - the metric's description.                                    *
+ * 	v_type - the metric type ("counter" or "gauge").                      *
+ * 	v_offset - the offset of the apr_uint64_t in tCertWatchMetrics, or    *
+ * 		-1 for m_inFlight.                                            *
+ ******************************************************************************/
+static void certwatch_status_promCounter(
+	request_rec* const v_request,
+	const char* const v_name,
+	const char* const v_help,
+	const char* const v_type,
+	const long v_offset
+)
+{
+	apr_uint64_t t_value;
+	apr_size_t i;
+
+	ap_rprintf(
+		v_request, "# HELP %s %s\n# TYPE %s %s\n",
+		v_name, v_help, v_name, v_type
+	);
+	for (i = 0; i < g_nMetrics; i++) {
+		if (apr_atomic_read32(&g_metrics[i].m_state)
+				!= C_METRICS_SLOT_READY)
+			continue;
+		if (v_offset < 0)
+			t_value = apr_atomic_read32(&g_metrics[i].m_inFlight);
+		else
+			t_value = apr_atomic_read64((volatile apr_uint64_t*)(
+				(char*)&g_metrics[i] + v_offset
+			));
+		ap_rprintf(
+			v_request, "%s{api=\"%s\"} %" APR_UINT64_T_FMT "\n",
+			v_name, g_metrics[i].m_apiName, t_value
+		);
+	}
+}
+
+
+/******************************************************************************
+ * certwatch_status_prometheus()                                              *
+ *   Outputs the metrics in the Prometheus text format.                       *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ ******************************************************************************/
+static void certwatch_status_prometheus(
+	request_rec* const v_request
+)
+{
+	apr_uint64_t t_buckets[C_HISTOGRAM_BUCKETS];
+	apr_uint64_t t_count;
+	apr_uint64_t t_cumulative;
+	apr_size_t i;
+	unsigned int j;
+	int t_phase;
+
+	v_request->content_type = "text/plain; version=0.0.4; charset=utf-8";
+
+	ap_rprintf(
+		v_request,
+		"# HELP certwatch_connect_failures_total Failed attempts to "
+		"connect to a database server.\n"
+		"# TYPE certwatch_connect_failures_total counter\n"
+		"certwatch_connect_failures_total %" APR_UINT64_T_FMT "\n"
+		"# HELP certwatch_retries_total Queries retried on another "
+		"database server.\n"
+		"# TYPE certwatch_retries_total counter\n"
+		"certwatch_retries_total %" APR_UINT64_T_FMT "\n",
+		apr_atomic_read64(&g_metricsHeader->m_connectFailures),
+		apr_atomic_read64(&g_metricsHeader->m_retries)
+	);
+
+	certwatch_status_promCounter(
+		v_request, "certwatch_requests_total", "Requests.", "counter",
+		APR_OFFSETOF(tCertWatchMetrics, m_requests)
+	);
+	certwatch_status_promCounter(
+		v_request, "certwatch_unavailable_total",
+		"Requests that returned 503 Service Unavailable.", "counter",
+		APR_OFFSETOF(tCertWatchMetrics, m_unavailable)
+	);
+	certwatch_status_promCounter(
+		v_request, "certwatch_rate_limited_total",
+		"Requests that returned 429 Too Many Requests.", "counter",
+		APR_OFFSETOF(tCertWatchMetrics, m_rateLimited)
+	);
+	certwatch_status_promCounter(
+		v_request, "certwatch_response_bytes_total",
+		"Response body bytes sent.", "counter",
+		APR_OFFSETOF(tCertWatchMetrics, m_bytesOut)
+	);
+	certwatch_status_promCounter(
+		v_request, "certwatch_shadow_failed_total",
+		"Shadow requests that failed on the test function.", "counter",
+		APR_OFFSETOF(tCertWatchMetrics, m_shadowFailed)
+	);
+	certwatch_status_promCounter(
+		v_request, "certwatch_shadow_dropped_total",
+		"Shadow requests that were dropped because too many were "
+		"waiting.", "counter",
+		APR_OFFSETOF(tCertWatchMetrics, m_shadowDropped)
+	);
+	certwatch_status_promCounter(
+		v_request, "certwatch_in_flight", "Requests in progress.",
+		"gauge", -1
+	);
+
+	/* Only the non-empty buckets are output, to keep the response small */
+	ap_rputs(
+		"# HELP certwatch_phase_duration_seconds Time spent in each "
+		"phase of a request.\n"
+		"# TYPE certwatch_phase_duration_seconds histogram\n",
+		v_request
+	);
+	for (i = 0; i < g_nMetrics; i++) {
+		if (apr_atomic_read32(&g_metrics[i].m_state)
+				!= C_METRICS_SLOT_READY)
+			continue;
+		for (t_phase = 0; t_phase < C_PHASE_COUNT; t_phase++) {
+			t_count = certwatch_status_snapshot(
+				&g_metrics[i].m_phases[t_phase], t_buckets
+			);
+			t_cumulative = 0;
+			for (j = 0; j < C_HISTOGRAM_BUCKETS; j++) {
+				if (!t_buckets[j])
+					continue;
+				t_cumulative += t_buckets[j];
+				ap_rprintf(
+					v_request,
+					"certwatch_phase_duration_seconds_bucket"
+					"{api=\"%s\",phase=\"%s\",le=\"%.6f\"} %"
+					APR_UINT64_T_FMT "\n",
+					g_metrics[i].m_apiName,
+					g_phaseName[t_phase],
+					certwatch_metrics_bucketLimit(j) / 1e6,
+					t_cumulative
+				);
+			}
+			ap_rprintf(
+				v_request,
+				"certwatch_phase_duration_seconds_bucket"
+				"{api=\"%s\",phase=\"%s\",le=\"+Inf\"} %"
+				APR_UINT64_T_FMT "\n"
+				"certwatch_phase_duration_seconds_sum"
+				"{api=\"%s\",phase=\"%s\"} %.6f\n"
+				"certwatch_phase_duration_seconds_count"
+				"{api=\"%s\",phase=\"%s\"} %"
+				APR_UINT64_T_FMT "\n",
+				g_metrics[i].m_apiName, g_phaseName[t_phase],
+				t_count,
+				g_metrics[i].m_apiName, g_phaseName[t_phase],
+				apr_atomic_read64(
+					&g_metrics[i].m_phases[t_phase].m_sum
+				) / 1e6,
+				g_metrics[i].m_apiName, g_phaseName[t_phase],
+				t_count
+			);
+		}
+	}
+}
+
+
+/******************************************************************************
+ * certwatch_status_json()                                                    *
+ *   Outputs the metrics as JSON.                                             *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ ******************************************************************************/
+static void certwatch_status_json(
+	request_rec* const v_request
+)
+{
+	apr_uint64_t t_buckets[C_HISTOGRAM_BUCKETS];
+	apr_uint64_t t_count;
+	const char* t_separator = "";
+	const char* t_bucketSeparator;
+	apr_size_t i;
+	unsigned int j;
+	int t_phase;
+
+	v_request->content_type = "application/json";
+
+	ap_rprintf(
+		v_request,
+		"{\"connect_failures\":%" APR_UINT64_T_FMT
+		",\"retries\":%" APR_UINT64_T_FMT ",\"apis\":{",
+		apr_atomic_read64(&g_metricsHeader->m_connectFailures),
+		apr_atomic_read64(&g_metricsHeader->m_retries)
+	);
+	for (i = 0; i < g_nMetrics; i++) {
+		if (apr_atomic_read32(&g_metrics[i].m_state)
+				!= C_METRICS_SLOT_READY)
+			continue;
+		ap_rprintf(
+			v_request,
+			"%s\"%s\":{\"requests\":%" APR_UINT64_T_FMT
+			",\"unavailable\":%" APR_UINT64_T_FMT
+			",\"rate_limited\":%" APR_UINT64_T_FMT
+			",\"bytes_out\":%" APR_UINT64_T_FMT
+			",\"shadow_failed\":%" APR_UINT64_T_FMT
+			",\"shadow_dropped\":%" APR_UINT64_T_FMT
+			",\"in_flight\":%u,\"phases\":{",
+			t_separator, g_metrics[i].m_apiName,
+			apr_atomic_read64(&g_metrics[i].m_requests),
+			apr_atomic_read64(&g_metrics[i].m_unavailable),
+			apr_atomic_read64(&g_metrics[i].m_rateLimited),
+			apr_atomic_read64(&g_metrics[i].m_bytesOut),
+			apr_atomic_read64(&g_metrics[i].m_shadowFailed),
+			apr_atomic_read64(&g_metrics[i].m_shadowDropped),
+			apr_atomic_read32(&g_metrics[i].m_inFlight)
+		);
+		t_separator = ",";
+
+		for (t_phase = 0; t_phase < C_PHASE_COUNT; t_phase++) {
+			t_count = certwatch_status_snapshot(
+				&g_metrics[i].m_phases[t_phase], t_buckets
+			);
+			ap_rprintf(
+				v_request,
+				"%s\"%s\":{\"count\":%" APR_UINT64_T_FMT
+				",\"sum_us\":%" APR_UINT64_T_FMT
+				",\"p50_us\":%" APR_UINT64_T_FMT
+				",\"p90_us\":%" APR_UINT64_T_FMT
+				",\"p99_us\":%" APR_UINT64_T_FMT
+				",\"buckets\":[",
+				t_phase ? "," : "", g_phaseName[t_phase],
+				t_count,
+				apr_atomic_read64(
+					&g_metrics[i].m_phases[t_phase].m_sum
+				),
+				certwatch_status_percentile(
+					t_buckets, t_count, 50
+				),
+				certwatch_status_percentile(
+					t_buckets, t_count, 90
+				),
+				certwatch_status_percentile(
+					t_buckets, t_count, 99
+				)
+			);
+
+			/* Each non-empty bucket is [upper limit (us), count] */
+			t_bucketSeparator = "";
+			for (j = 0; j < C_HISTOGRAM_BUCKETS; j++) {
+				if (!t_buckets[j])
+					continue;
+				ap_rprintf(
+					v_request,
+					"%s[%" APR_UINT64_T_FMT ",%"
+					APR_UINT64_T_FMT "]",
+					t_bucketSeparator,
+					certwatch_metrics_bucketLimit(j),
+					t_buckets[j]
+				);
+				t_bucketSeparator = ",";
+			}
+			ap_rputs("]}", v_request);
+		}
+		ap_rputs("}}", v_request);
+	}
+	ap_rputs("}}\n", v_request);
+}
+
+
+/******************************************************************************
+ * certwatch_statusHandler()                                                  *
+ *   Handle a request for the metrics, in the Prometheus text format or (if   *
+ * "?format=json" or "Accept: application/json") as JSON.                     *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	OK, DECLINED or some other Apache HTTP error code.            *
+ ******************************************************************************/
+static int certwatch_statusHandler(
+	request_rec* const v_request
+)
+{
+	const char* t_accept;
+
+	if (strcmp(v_request->handler, "certwatch-status"))
+		return DECLINED;
+	else if (v_request->method_number != M_GET)
+		return HTTP_METHOD_NOT_ALLOWED;
+	else if (!g_metrics)
+		return HTTP_NOT_FOUND;
+
+	apr_table_setn(v_request->headers_out, "Cache-Control", "no-store");
+	if (v_request->header_only)
+		return OK;
+
+	t_accept = apr_table_get(v_request->headers_in, "Accept");
+	if ((v_request->args
+				&& ap_strstr_c(v_request->args, "format=json"))
+			|| (t_accept && ap_strstr_c(
+				t_accept, "application/json")))
+		certwatch_status_json(v_request);
+	else
+		certwatch_status_prometheus(v_request);
+
+	return OK;
+}
+
+
+/******************************************************************************
+ * certwatch_capture_put32()                                                  *
+ *   Writes a 32-bit integer in big-endian order.                             *
+ *                                                                            *
+ * IN:	v_to - output position.                                               *
+ * 	v_value - the integer.                                                *
+ *                                                                            *
+ * Returns:	pointer to the byte after the integer.                        *
+ ******************************************************************************/
+static unsigned char* certwatch_capture_put32(
+	unsigned char* const v_to,
+	const apr_uint32_t v_value
+)
+{
+	v_to[0] = (unsigned char)(v_value >> 24);
+	v_to[1] = (unsigned char)(v_value >> 16);
+	v_to[2] = (unsigned char)(v_value >> 8);
+	v_to[3] = (unsigned char)v_value;
+
+	return v_to + 4;
+}
+
+
+/******************************************************************************
+ * certwatch_capture_put64()                                                  *
+ *   Writes a 64-bit integer in big-endian order.                             *
+ *                                                                            *
+ * IN:	v_to - output position.                                               *
+ * 	v_value - the integer.                                                *
+ *                                                                            *
+ * Returns:	pointer to the byte after the integer.                        *
+ ******************************************************************************/
+static unsigned char* certwatch_capture_put64(
+	unsigned char* const v_to,
+	const apr_uint64_t v_value
+)
+{
+	return certwatch_capture_put32(
+		certwatch_capture_put32(v_to, (apr_uint32_t)(v_value >> 32)),
+		(apr_uint32_t)v_value
+	);
+}
+
+
+/******************************************************************************
+ * certwatch_capture_enqueue()                                                *
+ *   Adds a sample of the web_apis() requests to this child's capture ring    *
+ * buffer, without blocking.  Records that don't fit (because the ring is     *
+ * full, or because they are too large) are counted and dropped.              *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_stats - the request's timings and parameters.                       *
+ ******************************************************************************/
+static void certwatch_capture_enqueue(
+	request_rec* const v_request,
+	const tCertWatchRequestStats* const v_stats
+)
+{
+	tCertWatchCaptureRing* t_ring = g_captureRing;
+	tCertWatchCaptureSlot* t_slot;
+	const char* t_string[C_CAPTURE_STRINGS];
+	apr_size_t t_stringLength[C_CAPTURE_STRINGS];
+	apr_size_t t_length = C_CAPTURE_FIXED_SIZE;
+	apr_time_t t_total = apr_time_now() - v_request->request_time;
+	apr_uint32_t t_pos;
+	apr_uint32_t t_previous;
+	apr_int32_t t_diff;
+	unsigned char* t_to;
+	int i;
+
+	if ((!t_ring) || (!v_stats->m_function)
+			|| ((apr_atomic_inc32(&t_ring->m_sampleCount)
+				% g_captureConfig->m_captureSample) != 0))
+		return;
+
+	t_string[C_CAPTURE_STRING_URI] = v_request->unparsed_uri;
+	t_string[C_CAPTURE_STRING_FUNCTION] = v_stats->m_function;
+	t_string[C_CAPTURE_STRING_NAMES] = v_stats->m_nameArray;
+	t_string[C_CAPTURE_STRING_VALUES] = v_stats->m_valueArray;
+	t_string[C_CAPTURE_STRING_ACCEPT] = apr_table_get(
+		v_request->headers_in, "Accept"
+	);
+	for (i = 0; i < C_CAPTURE_STRINGS; i++) {
+		t_stringLength[i] = t_string[i] ? strlen(t_string[i]) : 0;
+		t_length += 4 + t_stringLength[i];
+	}
+	if (t_length > C_CAPTURE_RECORD_MAX) {
+		apr_atomic_inc32(&t_ring->m_dropped);
+		return;
+	}
+
+	/* Claim the slot at the enqueue position, unless the writer thread
+	  hasn't emptied it yet */
+	t_pos = apr_atomic_read32(&t_ring->m_enqueuePos);
+	for (;;) {
+		t_slot = &t_ring->m_slots[t_pos & t_ring->m_mask];
+		t_diff = (apr_int32_t)(
+			apr_atomic_read32(&t_slot->m_sequence) - t_pos
+		);
+		if (t_diff == 0) {
+			t_previous = apr_atomic_cas32(
+				&t_ring->m_enqueuePos, t_pos + 1, t_pos
+			);
+			if (t_previous == t_pos)
+				break;
+			t_pos = t_previous;
+		}
+		else if (t_diff < 0) {
+			apr_atomic_inc32(&t_ring->m_dropped);
+			return;
+		}
+		else
+			t_pos = apr_atomic_read32(&t_ring->m_enqueuePos);
+	}
+
+	/* Write the record */
+	t_to = certwatch_capture_put32(t_slot->m_data, t_length - 4);
+	t_to = certwatch_capture_put64(t_to, v_request->request_time);
+	*(t_to++) = (v_request->method_number == M_POST)
+			? C_CAPTURE_METHOD_POST : C_CAPTURE_METHOD_GET;
+	*(t_to++) = 0;
+	*(t_to++) = (unsigned char)(v_request->status >> 8);
+	*(t_to++) = (unsigned char)v_request->status;
+	t_to = certwatch_capture_put64(
+		t_to, (v_request->bytes_sent > 0) ? v_request->bytes_sent : 0
+	);
+	for (i = 0; i < C_CAPTURE_PHASES; i++)
+		t_to = certwatch_capture_put32(
+			t_to, (i == C_PHASE_TOTAL)
+				? (apr_uint32_t)((t_total > 0) ? t_total : 0)
+				: (apr_uint32_t)v_stats->m_phases[i]
+		);
+	for (i = 0; i < C_CAPTURE_STRINGS; i++) {
+		t_to = certwatch_capture_put32(t_to, t_stringLength[i]);
+		if (t_stringLength[i] > 0)
+			memcpy(t_to, t_string[i], t_stringLength[i]);
+		t_to += t_stringLength[i];
+	}
+	t_slot->m_length = t_length;
+
+	/* Hand the slot to the writer thread */
+	apr_atomic_set32(&t_slot->m_sequence, t_pos + 1);
+}
+
+
+/******************************************************************************
+ * certwatch_capture_writer()                                                 *
+ *   This child's capture writer thread, which appends the buffered records   *
+ * to the capture file, a batch at a time, until it is asked to stop.        *
+ *                                                                            *
+ * IN:	v_thread - this thread.                                               *
+ * 	v_ring - this child's capture ring buffer.                            *
+ *                                                                            *
+ * Returns:	NULL.                                                         *
+ ******************************************************************************/
+static void* APR_THREAD_FUNC certwatch_capture_writer(
+	apr_thread_t* const v_thread,
+	void* const v_ring
+)
+{
+	tCertWatchCaptureRing* t_ring = (tCertWatchCaptureRing*)v_ring;
+	tCertWatchCaptureSlot* t_slot;
+	unsigned char* t_buffer = apr_palloc(
+		apr_thread_pool_get(v_thread), C_CAPTURE_WRITE_SIZE
+	);
+	apr_size_t t_length;
+	apr_status_t t_result;
+	int t_stopping;
+
+	for (;;) {
+		/* Having seen the stop flag, empty the ring one last time */
+		t_stopping = apr_atomic_read32(&t_ring->m_stop);
+
+		/* Gather as many records as fit into one write() call, which
+		  keeps each record intact when several children append to the
+		  file at once */
+		t_length = 0;
+		for (;;) {
+			t_slot = &t_ring->m_slots[
+				t_ring->m_dequeuePos & t_ring->m_mask
+			];
+			if (apr_atomic_read32(&t_slot->m_sequence)
+					!= (t_ring->m_dequeuePos + 1))
+				break;	/* Empty */
+			if ((t_length + t_slot->m_length)
+					> C_CAPTURE_WRITE_SIZE)
+				break;	/* Write this record next time */
+			memcpy(
+				t_buffer + t_length, t_slot->m_data,
+				t_slot->m_length
+			);
+			t_length += t_slot->m_length;
+			apr_atomic_set32(
+				&t_slot->m_sequence,
+				t_ring->m_dequeuePos + t_ring->m_mask + 1
+			);
+			t_ring->m_dequeuePos++;
+		}
+
+		if (t_length > 0) {
+			t_result = apr_file_write_full(
+				g_captureFile, t_buffer, t_length, NULL
+			);
+			if (t_result != APR_SUCCESS)
+				ap_log_error(
+					APLOG_MARK, APLOG_ERR, t_result,
+					t_ring->m_server,
+					"Unable to write to the capture file"
+				);
+		}
+		else if (t_stopping)
+			break;
+		else
+			apr_sleep(C_CAPTURE_IDLE_WAIT);
+	}
+
+	apr_thread_exit(v_thread, APR_SUCCESS);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_capture_stop()                                                   *
+ *   Stops this child's capture writer thread, once it has written the        *
+ * records that are still buffered.  Runs before the child's pool (and so the *
+ * thread's own pool) is destroyed.                                           *
+ ******************************************************************************/
+static apr_status_t certwatch_capture_stop(
+	void* const v_ring
+)
+{
+	tCertWatchCaptureRing* t_ring = (tCertWatchCaptureRing*)v_ring;
+	apr_status_t t_result;
+	apr_uint32_t t_dropped;
+
+	g_captureRing = NULL;
+	apr_atomic_set32(&t_ring->m_stop, 1);
+	(void)apr_thread_join(&t_result, t_ring->m_thread);
+
+	t_dropped = apr_atomic_read32(&t_ring->m_dropped);
+	if (t_dropped > 0)
+		ap_log_error(
+			APLOG_MARK, APLOG_NOTICE, 0, t_ring->m_server,
+			"%u captured requests were dropped (increase the "
+			"CertWatchCapture ring size, or sample fewer)",
+			t_dropped
+		);
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_capture_start()                                                  *
+ *   Creates this child's capture ring buffer and starts its writer thread.   *
+ *                                                                            *
+ * IN:	v_pool - the child process's pool.                                    *
+ * 	v_server - the server record.                                         *
+ ******************************************************************************/
+static void certwatch_capture_start(
+	apr_pool_t* const v_pool,
+	server_rec* const v_server
+)
+{
+	tCertWatchCaptureRing* t_ring;
+	apr_uint32_t t_nSlots = 2;
+	apr_uint32_t i;
+	apr_status_t t_result;
+
+	/* The slots are addressed by masking the position, so round their
+	  number up to a power of 2 (of at least 2, so that a full slot can be
+	  told apart from an empty one) */
+	while (t_nSlots < (apr_uint32_t)g_captureConfig->m_captureSlots)
+		t_nSlots <<= 1;
+
+	t_ring = apr_pcalloc(v_pool, sizeof(*t_ring));
+	t_ring->m_slots = apr_palloc(
+		v_pool, t_nSlots * sizeof(tCertWatchCaptureSlot)
+	);
+	for (i = 0; i < t_nSlots; i++)
+		t_ring->m_slots[i].m_sequence = i;
+	t_ring->m_mask = t_nSlots - 1;
+	t_ring->m_server = v_server;
+
+	t_result = apr_thread_create(
+		&t_ring->m_thread, NULL, certwatch_capture_writer, t_ring,
+		v_pool
+	);
+	if (t_result != APR_SUCCESS) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, t_result, v_server,
+			"Unable to start the capture writer thread"
+		);
+		return;
+	}
+
+	g_captureRing = t_ring;
+	apr_pool_pre_cleanup_register(v_pool, t_ring, certwatch_capture_stop);
+}
+
+
+/******************************************************************************
+ * certwatch_logTransaction()                                                 *
+ *   Makes a request's timings and response size available to the access log *
+ * (e.g. "%{certwatch_exec_us}n"), and captures a sample of the requests.    *
+ * Runs before mod_log_config logs it.                                        *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	DECLINED.                                                     *
+ ******************************************************************************/
+static int certwatch_logTransaction(
+	request_rec* const v_request
+)
+{
+	tCertWatchRequestStats* t_stats =
+		(tCertWatchRequestStats*)ap_get_module_config(
+			v_request->request_config, &certwatch_module
+		);
+	int t_phase;
+
+	if (!t_stats)
 		return DECLINED;
 
-	/* Process this request */
-	if (!strncmp(v_request->uri, "/test/", 6)) {
-		apr_table_set(
-			v_request->headers_out, "Location",
-			apr_psprintf(
-				v_request->pool, "https://%s/?%s",
-				v_request->hostname, v_request->args
-			)
+	for (t_phase = 0; t_phase < C_PHASE_COUNT; t_phase++)
+		if (g_phaseNote[t_phase]
+				&& (t_stats->m_recorded & (1 << t_phase)))
+			apr_table_setn(
+				v_request->notes, g_phaseNote[t_phase],
+				apr_psprintf(
+					v_request->pool, "%" APR_TIME_T_FMT,
+					t_stats->m_phases[t_phase]
+				)
+			);
+	apr_table_setn(
+		v_request->notes, "certwatch_bytes",
+		apr_off_t_toa(v_request->pool, v_request->bytes_sent)
+	);
+
+	certwatch_capture_enqueue(v_request, t_stats);
+
+	return DECLINED;
+}
+
+
+/******************************************************************************
+ * certwatch_setCache()                                                       *
+ *   Handles the CertWatchCache directive, which selects the socache provider *
+ * (e.g. "shmcb:/run/httpd/certwatch_cache(16777216)") for the response cache.*
+ ******************************************************************************/
+static const char* certwatch_setCache(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_arg
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
 		);
-		return HTTP_MOVED_TEMPORARILY;
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+	const char* t_separator;
+	const char* t_name;
+
+	if (t_error)
+		return t_error;
+
+	t_separator = ap_strchr_c(v_arg, ':');
+	t_name = t_separator ? apr_pstrmemdup(
+		v_cmd->pool, v_arg, t_separator - v_arg
+	) : v_arg;
+
+	t_certWatchServerConfig->m_cacheProvider = ap_lookup_provider(
+		AP_SOCACHE_PROVIDER_GROUP, t_name, AP_SOCACHE_PROVIDER_VERSION
+	);
+	if (!t_certWatchServerConfig->m_cacheProvider)
+		return apr_psprintf(
+			v_cmd->pool,
+			"Unknown socache provider '%s'.  Maybe you need to "
+			"load the appropriate socache module "
+			"(mod_socache_%s?)", t_name, t_name
+		);
+
+	t_error = t_certWatchServerConfig->m_cacheProvider->create(
+		&t_certWatchServerConfig->m_cacheInstance,
+		t_separator ? (t_separator + 1) : NULL, v_cmd->temp_pool,
+		v_cmd->pool
+	);
+	if (t_error)
+		return apr_psprintf(v_cmd->pool, "CertWatchCache: %s", t_error);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_setCoalesceSlots()                                               *
+ *   Handles the CertWatchCoalesceSlots directive.                            *
+ ******************************************************************************/
+static const char* certwatch_setCoalesceSlots(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_arg
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+
+	if (t_error)
+		return t_error;
+
+	t_certWatchServerConfig->m_coalesceSlots = atoi(v_arg);
+	if (t_certWatchServerConfig->m_coalesceSlots < 0)
+		return "CertWatchCoalesceSlots must not be negative";
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_setMetricsSlots()                                                *
+ *   Handles the CertWatchMetricsSlots directive.                             *
+ ******************************************************************************/
+static const char* certwatch_setMetricsSlots(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_arg
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+
+	if (t_error)
+		return t_error;
+
+	t_certWatchServerConfig->m_metricsSlots = atoi(v_arg);
+	if (t_certWatchServerConfig->m_metricsSlots < 0)
+		return "CertWatchMetricsSlots must not be negative";
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_addMetricsApi()                                                  *
+ *   Handles the CertWatchMetricsApis directive.                              *
+ ******************************************************************************/
+static const char* certwatch_addMetricsApi(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_apiName
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+	const char* t_char;
+
+	if (t_error)
+		return t_error;
+
+	/* Restrict API names to characters that need no escaping in the
+	  Prometheus or JSON output */
+	if (strlen(v_apiName) >= C_METRICS_NAME_SIZE)
+		return apr_psprintf(
+			v_cmd->pool, "CertWatchMetricsApis: \"%s\" is longer "
+			"than %d characters", v_apiName, C_METRICS_NAME_SIZE - 1
+		);
+	for (t_char = v_apiName; *t_char; t_char++)
+		if ((!apr_isalnum(*t_char)) && (*t_char != '-')
+				&& (*t_char != '.') && (*t_char != '_'))
+			return apr_psprintf(
+				v_cmd->pool, "CertWatchMetricsApis: \"%s\" may "
+				"only contain letters, digits, \"-\", \".\" and "
+				"\"_\"", v_apiName
+			);
+
+	if (!t_certWatchServerConfig->m_metricsApis)
+		t_certWatchServerConfig->m_metricsApis = apr_array_make(
+			v_cmd->pool, 16, sizeof(const char*)
+		);
+	APR_ARRAY_PUSH(t_certWatchServerConfig->m_metricsApis, const char*) =
+		v_apiName;
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_addAdmitLimit()                                                  *
+ *   Handles the CertWatchAdmissionLimit directive.                           *
+ ******************************************************************************/
+static const char* certwatch_addAdmitLimit(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_apiName,
+	const char* const v_maxActive,
+	const char* const v_maxQueued
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	tCertWatchAdmitLimit* t_limit;
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+	int t_maxActive = atoi(v_maxActive);
+	int t_maxQueued = v_maxQueued ? atoi(v_maxQueued) : 0;
+
+	if (t_error)
+		return t_error;
+	else if ((t_maxActive <= 0) || (t_maxQueued < 0))
+		return "CertWatchAdmissionLimit requires a positive number of "
+			"active queries and a non-negative queue length";
+
+	if (!t_certWatchServerConfig->m_admitLimits)
+		t_certWatchServerConfig->m_admitLimits = apr_array_make(
+			v_cmd->pool, 4, sizeof(tCertWatchAdmitLimit)
+		);
+	t_limit = apr_array_push(t_certWatchServerConfig->m_admitLimits);
+	t_limit->m_apiName = v_apiName;
+	t_limit->m_maxActive = t_maxActive;
+	t_limit->m_maxQueued = t_maxQueued;
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_setRateLimit()                                                   *
+ *   Handles the CertWatchRateLimit directive.                                *
+ ******************************************************************************/
+static const char* certwatch_setRateLimit(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_rate,
+	const char* const v_burst,
+	const char* const v_slots
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+	int t_rate = atoi(v_rate);
+	int t_burst = atoi(v_burst);
+	int t_slots = v_slots ? atoi(v_slots) : 65536;
+
+	if (t_error)
+		return t_error;
+	else if ((t_rate <= 0) || (t_burst <= 0)
+			|| (t_burst > C_RATE_MAX_BURST) || (t_slots < 0))
+		return apr_psprintf(
+			v_cmd->pool,
+			"CertWatchRateLimit requires a positive number of "
+			"tokens per second, a burst size of 1 to %d tokens "
+			"and a non-negative number of slots",
+			(int)C_RATE_MAX_BURST
+		);
+
+	t_certWatchServerConfig->m_rateRate = t_rate;
+	t_certWatchServerConfig->m_rateBurst = t_burst;
+	t_certWatchServerConfig->m_rateSlots = t_slots;
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_addRateCost()                                                    *
+ *   Handles the CertWatchRateLimitCost directive.                            *
+ ******************************************************************************/
+static const char* certwatch_addRateCost(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_apiName,
+	const char* const v_cost
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	tCertWatchRateCost* t_cost;
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+
+	if (t_error)
+		return t_error;
+	else if (atoi(v_cost) < 0)
+		return "CertWatchRateLimitCost must not be negative";
+
+	if (!t_certWatchServerConfig->m_rateCosts)
+		t_certWatchServerConfig->m_rateCosts = apr_array_make(
+			v_cmd->pool, 4, sizeof(tCertWatchRateCost)
+		);
+	t_cost = apr_array_push(t_certWatchServerConfig->m_rateCosts);
+	t_cost->m_apiName = v_apiName;
+	t_cost->m_cost = atoi(v_cost);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_setRatePrefix()                                                  *
+ *   Handles the CertWatchRateLimitPrefix directive.                          *
+ ******************************************************************************/
+static const char* certwatch_setRatePrefix(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_prefix4,
+	const char* const v_prefix6
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+	int t_prefix4 = atoi(v_prefix4);
+	int t_prefix6 = atoi(v_prefix6);
+
+	if (t_error)
+		return t_error;
+	else if ((t_prefix4 < 0) || (t_prefix4 > 32) || (t_prefix6 < 0)
+			|| (t_prefix6 > 128))
+		return "CertWatchRateLimitPrefix requires an IPv4 prefix length "
+			"of 0 to 32 and an IPv6 prefix length of 0 to 128";
+
+	t_certWatchServerConfig->m_ratePrefix4 = t_prefix4;
+	t_certWatchServerConfig->m_ratePrefix6 = t_prefix6;
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_setCapture()                                                     *
+ *   Handles the CertWatchCapture directive.                                  *
+ ******************************************************************************/
+static const char* certwatch_setCapture(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_file,
+	const char* const v_sample,
+	const char* const v_slots
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+	int t_sample = v_sample ? atoi(v_sample) : 1;
+	int t_slots = v_slots ? atoi(v_slots) : 256;
+
+	if (t_error)
+		return t_error;
+	else if ((t_sample <= 0) || (t_slots <= 0) || (t_slots > 65536))
+		return "CertWatchCapture requires a positive sampling interval "
+			"and a ring size of 1 to 65536 records";
+
+	t_certWatchServerConfig->m_captureFile = ap_server_root_relative(
+		v_cmd->pool, v_file
+	);
+	if (!t_certWatchServerConfig->m_captureFile)
+		return apr_pstrcat(
+			v_cmd->pool, "Invalid CertWatchCapture file ", v_file,
+			NULL
+		);
+	t_certWatchServerConfig->m_captureSample = t_sample;
+	t_certWatchServerConfig->m_captureSlots = t_slots;
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_setShadowWorkers()                                               *
+ *   Handles the CertWatchShadowWorkers directive.                            *
+ ******************************************************************************/
+static const char* certwatch_setShadowWorkers(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig_unused,
+	const char* const v_threads,
+	const char* const v_queue
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_cmd->server->module_config, &certwatch_module
+		);
+	const char* t_error = ap_check_cmd_context(v_cmd, GLOBAL_ONLY);
+	int t_threads = atoi(v_threads);
+	int t_queue = v_queue ? atoi(v_queue) : 64;
+
+	if (t_error)
+		return t_error;
+	else if ((t_threads < 0) || (t_queue <= 0))
+		return "CertWatchShadowWorkers requires a number of threads "
+			"and a positive queue length";
+
+	t_certWatchServerConfig->m_shadowThreads = t_threads;
+	t_certWatchServerConfig->m_shadowQueue = t_queue;
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * certwatch_addCompression()                                                 *
+ *   Handles the CertWatchCompression directive, each of whose arguments is a *
+ * content coding, optionally followed by "=" and a compression level.       *
+ ******************************************************************************/
+static const char* certwatch_addCompression(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig,
+	const char* const v_arg
+)
+{
+	tCertWatchDirConfig* t_certWatchDirConfig =
+		(tCertWatchDirConfig*)v_dirConfig;
+	const char* t_level = ap_strchr_c(v_arg, '=');
+	apr_size_t t_name_len = t_level ? (apr_size_t)(t_level - v_arg)
+					: strlen(v_arg);
+	int t_encoding;
+	int t_min;
+	int t_max;
+	int t_value;
+	int i;
+
+	for (t_encoding = C_ENCODING_GZIP; t_encoding < C_ENCODING_COUNT;
+			t_encoding++)
+		if ((strlen(g_encodingName[t_encoding]) == t_name_len)
+				&& !strncasecmp(
+					v_arg, g_encodingName[t_encoding],
+					t_name_len
+				))
+			break;
+
+	switch (t_encoding) {
+		case C_ENCODING_GZIP:
+			t_min = 1;
+			t_max = 9;
+			t_value = 6;
+			break;
+#ifdef HAVE_BROTLI
+		case C_ENCODING_BROTLI:
+			t_min = BROTLI_MIN_QUALITY;
+			t_max = BROTLI_MAX_QUALITY;
+			t_value = 5;
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case C_ENCODING_ZSTD:
+			/* Above level 19, the window can exceed the 8MB that
+			  browsers will decode */
+			t_min = 1;
+			t_max = 19;
+			t_value = 3;
+			break;
+#endif
+		default:
+			return apr_pstrcat(
+				v_cmd->pool, "CertWatchCompression: ", v_arg,
+				" is not a supported content coding (gzip"
+#ifdef HAVE_BROTLI
+				", br"
+#endif
+#ifdef HAVE_ZSTD
+				", zstd"
+#endif
+				")", NULL
+			);
 	}
-	else if (v_request->method_number == M_GET)
-		t_requestParams = v_request->args;
-	else if (v_request->method_number == M_POST) {
-		if (certwatch_read_body(v_request, &t_body_data, &t_body_size)
-				!= OK)
-			return DECLINED;
-		t_requestParams = (char*)t_body_data;
+
+	if (t_level) {
+		t_value = atoi(t_level + 1);
+		if ((!apr_isdigit(t_level[1])) || (t_value < t_min)
+				|| (t_value > t_max))
+			return apr_psprintf(
+				v_cmd->pool,
+				"CertWatchCompression: the %s level must be "
+				"from %d to %d",
+				g_encodingName[t_encoding], t_min, t_max
+			);
 	}
-	else
-		return DECLINED;
 
-	const char* t_accept = apr_table_get(v_request->headers_in, "Accept");
-	if (t_accept && (!strcmp(t_accept, "application/json")))
-		t_requestParams = apr_psprintf(
-			v_request->pool, "output=json&%s", t_requestParams
-		);
+	/* The codings are preferred in the order they're listed */
+	if (t_certWatchDirConfig->m_nCompress == C_DIRCONFIG_UNSET)
+		t_certWatchDirConfig->m_nCompress = 0;
+	for (i = 0; i < t_certWatchDirConfig->m_nCompress; i++)
+		if (t_certWatchDirConfig->m_compress[i] == t_encoding)
+			break;
+	if (i == t_certWatchDirConfig->m_nCompress)
+		t_certWatchDirConfig->m_compress[
+			t_certWatchDirConfig->m_nCompress++
+		] = t_encoding;
+	t_certWatchDirConfig->m_compressLevel[t_encoding] = t_value;
+
+	return NULL;
+}
 
-	certwatch_makeParamArrays(
-		v_request, t_requestParams, &t_nameArray, &t_valueArray
+
+/******************************************************************************
+ * certwatch_setArraySlot()                                                   *
+ *   Handles the directives that take a list of strings (e.g.                 *
+ * CertWatchCacheFunctions), or that may be repeated (ConnInfoReplica),       *
+ * appending each one to the array at the offset in v_cmd->info.              *
+ ******************************************************************************/
+static const char* certwatch_setArraySlot(
+	cmd_parms* const v_cmd,
+	void* const v_dirConfig,
+	const char* const v_arg
+)
+{
+	apr_array_header_t** t_array = (apr_array_header_t**)(
+		(char*)v_dirConfig + (apr_size_t)v_cmd->info
 	);
 
-	/* Open a connection to the PostgreSQL database.  No connection pooling
-	  is performed here, so use of a connection pooler such as PgBouncer is
-	  recommended */
-	time_t t_startTime = time(NULL);
-	t_PGconn = PQconnectdb(t_certWatchDirConfig->m_connInfo);
-	if (PQstatus(t_PGconn) != CONNECTION_OK) {
-		ap_log_error(
-			APLOG_MARK, APLOG_ERR, 0, NULL,
-			"PQconnectdb() failed"
+	if (!*t_array)
+		*t_array = apr_array_make(v_cmd->pool, 4, sizeof(const char*));
+	APR_ARRAY_PUSH(*t_array, const char*) = v_arg;
+
+	return NULL;
+}
+
+
+/*----------------------------------------------------------------------------
+  - Command Table                                                            -
+  ----------------------------------------------------------------------------*/
+static const command_rec certwatch_commandTable[] = {
+	AP_INIT_TAKE1(
+		"ConnInfo", ap_set_string_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_connInfo),
+		ACCESS_CONF, "PostgreSQL connection string"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchConnMin", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_connMin),
+		ACCESS_CONF, "Minimum number of pooled connections per child"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchConnMax", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_connMax),
+		ACCESS_CONF,
+		"Maximum number of pooled connections per child (0 = "
+		"ThreadsPerChild)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchConnIdleTTL", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_connIdleTTL),
+		ACCESS_CONF,
+		"Seconds after which an idle pooled connection is closed"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchMaxBodySize", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_maxBodySize),
+		ACCESS_CONF,
+		"Maximum POST request body size in bytes (0 = unlimited)"
+	),
+	AP_INIT_FLAG(
+		"CertWatchPreparedStatements", ap_set_flag_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_prepare),
+		ACCESS_CONF,
+		"Prepare statements once per connection (turn Off behind a "
+		"transaction-mode pooler)"
+	),
+	AP_INIT_FLAG(
+		"CertWatchStreaming", ap_set_flag_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_stream),
+		ACCESS_CONF,
+		"Stream responses from the set-returning web_apis_stream() "
+		"function"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchCache", certwatch_setCache, NULL, RSRC_CONF,
+		"Response cache storage, as socache provider[:arguments]"
+	),
+	AP_INIT_ITERATE(
+		"CertWatchCacheFunctions", certwatch_setArraySlot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_cacheFunctions),
+		ACCESS_CONF,
+		"Function or first parameter names whose responses may be "
+		"cached (default: all)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchCacheMaxObjectSize", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_cacheMaxObjectSize),
+		ACCESS_CONF, "Largest response that will be cached (in bytes)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchCacheMaxTTL", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_cacheMaxTTL),
+		ACCESS_CONF,
+		"Longest time that a response will be cached for (in "
+		"seconds; 0 = don't cache)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchCoalesceSlots", certwatch_setCoalesceSlots, NULL,
+		RSRC_CONF,
+		"Number of shared slots for coalescing identical concurrent "
+		"queries (0 = don't coalesce; requires CertWatchCache)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchCoalesceWait", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_coalesceWait),
+		ACCESS_CONF,
+		"Longest time to wait for an identical query to finish (in "
+		"milliseconds)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchQueryTimeout", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_queryTimeout),
+		ACCESS_CONF,
+		"Cancel queries that run for longer than this (in seconds; 0 "
+		"= no timeout)"
+	),
+	AP_INIT_TAKE23(
+		"CertWatchAdmissionLimit", certwatch_addAdmitLimit, NULL,
+		RSRC_CONF,
+		"Function or first parameter name (\"*\" = any other), "
+		"maximum concurrent queries across all children, and maximum "
+		"number of requests that may wait (default 0)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchAdmissionWait", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_admitWait),
+		ACCESS_CONF,
+		"Longest time that a queued request waits to run its query (in "
+		"milliseconds)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchAdmissionRetryAfter", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_admitRetryAfter),
+		ACCESS_CONF,
+		"Retry-After value sent with a shed request's 503 (in seconds)"
+	),
+	AP_INIT_TAKE23(
+		"CertWatchRateLimit", certwatch_setRateLimit, NULL, RSRC_CONF,
+		"Tokens added to each client's bucket per second, the bucket's "
+		"size, and the number of buckets shared by all children "
+		"(default 65536)"
+	),
+	AP_INIT_TAKE2(
+		"CertWatchRateLimitCost", certwatch_addRateCost, NULL,
+		RSRC_CONF,
+		"Function or first parameter name (\"*\" = any other), and "
+		"the number of tokens that a query for it costs (default 1)"
+	),
+	AP_INIT_TAKE2(
+		"CertWatchRateLimitPrefix", certwatch_setRatePrefix, NULL,
+		RSRC_CONF,
+		"Lengths of the IPv4 and IPv6 prefixes that share a bucket "
+		"(default 32 and 64; behind a proxy, use mod_remoteip to set "
+		"the client's address)"
+	),
+	/* A connection string contains spaces, so each replica has its own
+	  (quoted) directive */
+	AP_INIT_TAKE1(
+		"ConnInfoReplica", certwatch_setArraySlot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_replicaConnInfos),
+		ACCESS_CONF,
+		"PostgreSQL connection string for a read replica (quoted; "
+		"repeat the directive for each replica)"
+	),
+	AP_INIT_ITERATE(
+		"CertWatchPrimaryFunctions", certwatch_setArraySlot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_primaryFunctions),
+		ACCESS_CONF,
+		"Function or first parameter names whose queries always run "
+		"on the primary (ConnInfo)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchReplicaMaxLag", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_replicaMaxLag),
+		ACCESS_CONF,
+		"Take a read replica out of rotation when it's further behind "
+		"than this (in seconds)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchReplicaCheckInterval", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_replicaCheckInterval),
+		ACCESS_CONF,
+		"Minimum time between a child's checks of a read replica's "
+		"replication lag, which are made when a query is routed to it "
+		"(in seconds)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchMetricsSlots", certwatch_setMetricsSlots, NULL,
+		RSRC_CONF,
+		"Number of APIs to keep separate metrics for, including one "
+		"for all other APIs (0 = no metrics; default 64)"
+	),
+	AP_INIT_ITERATE(
+		"CertWatchMetricsApis", certwatch_addMetricsApi, NULL,
+		RSRC_CONF,
+		"Names of the APIs to keep separate metrics for (e.g. id "
+		"identity monitored-logs); all others are counted as _other"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchSpoolThreshold", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_spoolThreshold),
+		ACCESS_CONF,
+		"Spool responses larger than this to a temporary file, to "
+		"free their memory sooner (in bytes; 0 = don't spool)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchSpoolDir", ap_set_string_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_spoolDir),
+		ACCESS_CONF,
+		"Directory for spooled responses (default: the system "
+		"temporary directory)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchBatchMaxItems", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_batchMaxItems),
+		ACCESS_CONF,
+		"Maximum number of sub-requests in a certwatch-batch request"
+	),
+	AP_INIT_FLAG(
+		"CertWatchAsync", ap_set_flag_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_async),
+		ACCESS_CONF,
+		"Free the worker thread while a query runs, on an MPM that can "
+		"suspend requests (e.g. event; ignored with CertWatchStreaming)"
+	),
+	AP_INIT_TAKE123(
+		"CertWatchCapture", certwatch_setCapture, NULL, RSRC_CONF,
+		"File to append a sample of the requests to (for "
+		"certwatch_replay), optionally followed by the sampling "
+		"interval (1 = every request) and the number of records each "
+		"child buffers (default 256)"
+	),
+	AP_INIT_FLAG(
+		"CertWatchFraming", ap_set_flag_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_framed),
+		ACCESS_CONF,
+		"Call web_apis_framed(), which returns the headers and body "
+		"separately, in binary (ignored with CertWatchStreaming)"
+	),
+	AP_INIT_ITERATE(
+		"CertWatchCompression", certwatch_addCompression, NULL,
+		ACCESS_CONF,
+		"Content codings to compress responses with, in order of "
+		"preference, each optionally followed by =level (e.g. "
+		"\"zstd br=5 gzip=6\")"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchCompressionMinSize", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_compressMinSize),
+		ACCESS_CONF,
+		"Don't compress responses smaller than this (in bytes; "
+		"default 1024)"
+	),
+	AP_INIT_TAKE1(
+		"CertWatchShadow", ap_set_int_slot,
+		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_shadowSample),
+		ACCESS_CONF,
+		"Also run 1 in this many requests on the test function, after "
+		"responding, to compare their execution times (0 = none; "
+		"requires metrics; ignored with CertWatchStreaming)"
+	),
+	AP_INIT_TAKE12(
+		"CertWatchShadowWorkers", certwatch_setShadowWorkers, NULL,
+		RSRC_CONF,
+		"Number of threads each child runs shadow requests on "
+		"(default 2; 0 = none), optionally followed by the number "
+		"that may wait before more are dropped (default 64)"
+	),
+	{ NULL }
+};
+
+
+/******************************************************************************
+ * certwatch_cache_destroy()                                                  *
+ *   Destroys the response cache when the configuration is unloaded.          *
+ ******************************************************************************/
+static apr_status_t certwatch_cache_destroy(
+	void* const v_server
+)
+{
+	if (g_cacheInstance)
+		g_cacheProvider->destroy(
+			g_cacheInstance, (server_rec*)v_server
 		);
-		PQfinish(t_PGconn);
-		return DECLINED;
-	}
+	g_cacheProvider = NULL;
+	g_cacheInstance = NULL;
+	g_cacheMutex = NULL;
+	g_coalesceShm = NULL;
+	g_coalesceSlots = NULL;
+	g_nCoalesceSlots = 0;
 
-	/* Execute the required function */
-	t_paramValues[0] = strrchr(v_request->uri, '/') + 1;
-	t_paramValues[1] = t_nameArray;
-	t_paramValues[2] = t_valueArray;
-	const char* t_xForwardedFor = apr_table_get(
-		v_request->headers_in, "X-Forwarded-For"
-	);
-	t_PGresult = PQexecParams(
-		t_PGconn,
-		apr_psprintf(v_request->pool,
-			"SELECT web_apis%s($1,$2,$3) -- [%s] %s",
-			strncmp(v_request->uri, "/_ROB_IS_TESTING_/", 18)
-				? "" : "_test",
-			t_xForwardedFor ? t_xForwardedFor
-					: v_request->useragent_ip,
-			v_request->the_request
-		),
-		3, NULL, t_paramValues, NULL, NULL, 0
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_admit_destroy()                                                  *
+ *   Forgets the admission control counters when the configuration is         *
+ * unloaded.                                                                  *
+ ******************************************************************************/
+static apr_status_t certwatch_admit_destroy(
+	void* const v_unused
+)
+{
+	g_admitShm = NULL;
+	g_admitSlots = NULL;
+	g_admitLimits = NULL;
+	g_admitChildren = NULL;
+	g_admitChildSlots = NULL;
+	g_nAdmitChildren = 0;
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_rate_destroy()                                                   *
+ *   Forgets the rate limiting token buckets when the configuration is        *
+ * unloaded.                                                                  *
+ ******************************************************************************/
+static apr_status_t certwatch_rate_destroy(
+	void* const v_unused
+)
+{
+	g_rateShm = NULL;
+	g_rateSlots = NULL;
+	g_nRateSlots = 0;
+	g_rateConfig = NULL;
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_capture_destroy()                                                *
+ *   Forgets the capture file when the configuration is unloaded.             *
+ ******************************************************************************/
+static apr_status_t certwatch_capture_destroy(
+	void* const v_unused
+)
+{
+	g_captureFile = NULL;
+	g_captureConfig = NULL;
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_metrics_destroy()                                                *
+ *   Forgets the metrics when the configuration is unloaded.                  *
+ ******************************************************************************/
+static apr_status_t certwatch_metrics_destroy(
+	void* const v_unused
+)
+{
+	g_metricsShm = NULL;
+	g_metricsHeader = NULL;
+	g_metrics = NULL;
+	g_nMetrics = 0;
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * certwatch_preConfig()                                                      *
+ *   Registers the response cache's mutex type.                               *
+ ******************************************************************************/
+static int certwatch_preConfig(
+	apr_pool_t* const v_pconf,
+	apr_pool_t* const v_plog_unused,
+	apr_pool_t* const v_ptemp_unused
+)
+{
+	return ap_mutex_register(
+		v_pconf, C_CACHE_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0
 	);
+}
 
-	/* Close the connection to the PostgreSQL database */
-	PQfinish(t_PGconn);
 
-	/* Ensure that the SQL query was successful */
-	if (PQresultStatus(t_PGresult) != PGRES_TUPLES_OK) {
-		ap_log_error(
-			APLOG_MARK, APLOG_ERR, 0, NULL,
-			"PQexecParams() => %s",
-			PQresultErrorMessage(t_PGresult)
+/******************************************************************************
+ * certwatch_postConfig()                                                     *
+ *   Creates the metrics, the admission control counters, the rate limiting   *
+ * token buckets, the capture file and the response cache (and, if           *
+ * necessary, its mutex), which are shared by all children.                   *
+ ******************************************************************************/
+static int certwatch_postConfig(
+	apr_pool_t* const v_pconf,
+	apr_pool_t* const v_plog_unused,
+	apr_pool_t* const v_ptemp_unused,
+	server_rec* const v_server
+)
+{
+	tCertWatchServerConfig* t_certWatchServerConfig =
+		(tCertWatchServerConfig*)ap_get_module_config(
+			v_server->module_config, &certwatch_module
 		);
+	static const struct ap_socache_hints t_hints = {
+		256, 16384, 60
+	};
+	apr_status_t t_result;
+	int i;
 
-		/* Return a 503 with an error webpage */
-		time_t t_endTime = time(NULL);
-		struct tm t_tm;
-		gmtime_r(&t_endTime, &t_tm);
-		v_request->status = HTTP_SERVICE_UNAVAILABLE;
-		v_request->content_type = "text/html; charset=UTF-8";
-		t_response = apr_psprintf(
-			v_request->pool,
-"<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.0 Transitional//EN\"><HTML><HEAD><TITLE>crt.sh | ERROR!</TITLE><LINK href=\"//fonts.googleapis.com/css?family=Roboto+Mono|Roboto:400,400i,700,700i\" rel=\"stylesheet\"><STYLE type=\"text/css\">body{color:#888888;font:12pt Roboto,sans-serif;padding-top:10px;text-align:center} span{border-radius:10px} span.title{background-color:#00B373;color:#FFFFFF;font:bold 18pt Roboto,sans-serif;padding:0px 5px} span.whiteongrey{background-color:#D9D9D6;color:#FFFFFF;font:bold 18pt Roboto,sans-serif;padding:0px 5px} .copyright{font:8pt Roboto,sans-serif;color:#00B373}</STYLE></HEAD><BODY><A style=\"text-decoration:none\" href=\"/\"><SPAN class=\"title\">crt.sh</SPAN></A>&nbsp; <SPAN class=\"whiteongrey\">Certificate Search</SPAN><BR><BR><BR><BR>Sorry, something went wrong... :-(<BR><BR>Your request was terminated by the crt.sh database server after <B>%ld</B> second%s with the following messages:<BR><BR><TEXTAREA readonly rows=\"8\" cols=\"100\">%s</TEXTAREA><BR><BR>Unfortunately, searches that would produce many results may never succeed. For other requests, please try again later.<BR><BR><BR><P class=\"copyright\">&copy; Sectigo Limited 2015-%d. All rights reserved.</P><DIV><A href=\"https://sectigo.com/\"><IMG src=\"/sectigo_s.png\"></A>&nbsp;<A href=\"https://github.com/crtsh\"><IMG src=\"/GitHub-Mark-32px.png\"></A></DIV></BODY></HTML>",
-			(t_endTime - t_startTime), (((t_endTime - t_startTime) == 1) ? "": "s"),
-			PQresultErrorMessage(t_PGresult), (t_tm.tm_year + 1900)
+	/* Nothing needs to be created during the initial configuration
+	  check */
+	if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG)
+		return OK;
+
+	/* Create the metrics.  Anonymous shared memory is inherited by the
+	  children, and is destroyed along with v_pconf */
+	if (t_certWatchServerConfig->m_metricsSlots > 0) {
+		t_result = apr_shm_create(
+			&g_metricsShm,
+			sizeof(tCertWatchMetricsHeader)
+				+ (t_certWatchServerConfig->m_metricsSlots
+					* sizeof(tCertWatchMetrics)),
+			NULL, v_pconf
+		);
+		if (t_result != APR_SUCCESS) {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, t_result, v_server,
+				"Unable to create the metrics"
+			);
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+		g_metricsHeader = apr_shm_baseaddr_get(g_metricsShm);
+		memset(g_metricsHeader, 0, apr_shm_size_get(g_metricsShm));
+		g_metrics = (tCertWatchMetrics*)(g_metricsHeader + 1);
+		g_nMetrics = t_certWatchServerConfig->m_metricsSlots;
+		strcpy(g_metrics[0].m_apiName, "_other");
+		g_metrics[0].m_state = C_METRICS_SLOT_READY;
+		for (i = 0; t_certWatchServerConfig->m_metricsApis
+				&& (i < t_certWatchServerConfig->m_metricsApis
+					->nelts); i++) {
+			if ((apr_size_t)(i + 1) >= g_nMetrics) {
+				ap_log_error(
+					APLOG_MARK, APLOG_WARNING, 0, v_server,
+					"CertWatchMetricsSlots %d leaves no "
+					"room for %d of the CertWatchMetricsApis",
+					(int)g_nMetrics,
+					t_certWatchServerConfig->m_metricsApis
+						->nelts - i
+				);
+				break;
+			}
+			strcpy(g_metrics[i + 1].m_apiName, APR_ARRAY_IDX(
+				t_certWatchServerConfig->m_metricsApis, i,
+				const char*
+			));
+			g_metrics[i + 1].m_state = C_METRICS_SLOT_READY;
+		}
+		apr_pool_cleanup_register(
+			v_pconf, NULL, certwatch_metrics_destroy,
+			apr_pool_cleanup_null
 		);
-		t_response_len = strlen(t_response);
-		t_returnCode = OK;
-		goto label_outputResponse;
 	}
 
-	/* Does the function's response require any HTTP Response headers to be
-	  set or modified? */
-	t_response = PQgetvalue(t_PGresult, 0, 0);
-	t_response_len = PQgetlength(t_PGresult, 0, 0);
-	if (t_response_len == 0) {
-		t_returnCode = DECLINED;
-		goto label_return;
+	/* Create the admission control counters: the totals, then a row of
+	  counters for each child that may exist at once, then the PID of the
+	  child that owns each row */
+	if (t_certWatchServerConfig->m_admitLimits) {
+		int t_nLimits = t_certWatchServerConfig->m_admitLimits->nelts;
+		if ((ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &g_nAdmitChildren)
+					!= APR_SUCCESS)
+				|| (g_nAdmitChildren < 1))
+			g_nAdmitChildren = 1;
+		t_result = apr_shm_create(
+			&g_admitShm,
+			((1 + g_nAdmitChildren) * t_nLimits
+					* sizeof(tCertWatchAdmitSlot))
+				+ (g_nAdmitChildren * sizeof(apr_uint32_t)),
+			NULL, v_pconf
+		);
+		if (t_result != APR_SUCCESS) {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, t_result, v_server,
+				"Unable to create the admission control "
+				"counters"
+			);
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+		g_admitSlots = apr_shm_baseaddr_get(g_admitShm);
+		memset(g_admitSlots, 0, apr_shm_size_get(g_admitShm));
+		g_admitChildSlots = g_admitSlots + t_nLimits;
+		g_admitChildren = (volatile apr_uint32_t*)(
+			g_admitChildSlots + (g_nAdmitChildren * t_nLimits)
+		);
+		g_admitLimits = t_certWatchServerConfig->m_admitLimits;
+		apr_pool_cleanup_register(
+			v_pconf, NULL, certwatch_admit_destroy,
+			apr_pool_cleanup_null
+		);
 	}
-	#define C_HTTP_HEADERS		"[BEGIN_HEADERS]\n"
-	#define C_HTTP_HEADERS_CLOSE	"[END_HEADERS]\n"
-	if (!strncmp(t_response, C_HTTP_HEADERS, strlen(C_HTTP_HEADERS))) {
-		t_endOfHeaders = strstr(t_response, C_HTTP_HEADERS_CLOSE);
-		if (t_endOfHeaders) {
-			/* Customize the HTTP headers as requested by the
-			  function's response */
-			for (t_name = t_response + strlen(C_HTTP_HEADERS);
-					t_name < t_endOfHeaders;
-					t_name = t_next + 1) {
-				/* Isolate the header name */
-				t_value = strchr(t_name, ':');
-				if (!t_value)
-					break;
-				*(t_value++) = '\0';
-				while (apr_isspace(*t_value))
-					t_value++;
 
-				/* Isolate the header value */
-				t_next = strchr(t_value, '\n');
-				if (!t_next)
-					break;
-				*t_next = '\0';
+	/* Create the rate limiting token buckets */
+	if (t_certWatchServerConfig->m_rateSlots > 0) {
+		t_result = apr_shm_create(
+			&g_rateShm,
+			t_certWatchServerConfig->m_rateSlots
+				* sizeof(tCertWatchRateSlot),
+			NULL, v_pconf
+		);
+		if (t_result != APR_SUCCESS) {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, t_result, v_server,
+				"Unable to create the rate limiting token "
+				"buckets"
+			);
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+		g_rateSlots = apr_shm_baseaddr_get(g_rateShm);
+		memset(g_rateSlots, 0, apr_shm_size_get(g_rateShm));
+		g_nRateSlots = t_certWatchServerConfig->m_rateSlots;
+		g_rateConfig = t_certWatchServerConfig;
+		apr_pool_cleanup_register(
+			v_pconf, NULL, certwatch_rate_destroy,
+			apr_pool_cleanup_null
+		);
+	}
 
-				if (!strcasecmp(t_name, "Content-Type"))
-					v_request->content_type = apr_pstrdup(
-						v_request->pool, t_value
-					);
-				else
-					apr_table_set(
-						v_request->headers_out, t_name,
-						t_value
-					);
-			}
-			t_response_len -= (t_endOfHeaders - t_response);
-			t_response_len -= strlen(C_HTTP_HEADERS_CLOSE);
-			t_response += (t_endOfHeaders - t_response);
-			t_response += strlen(C_HTTP_HEADERS_CLOSE);
+	/* Open the capture file, which the children inherit and append to */
+	if (t_certWatchServerConfig->m_captureFile) {
+		apr_finfo_t t_finfo;
+		t_result = apr_file_open(
+			&g_captureFile, t_certWatchServerConfig->m_captureFile,
+			APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_APPEND
+				| APR_FOPEN_BINARY,
+			APR_FPROT_OS_DEFAULT, v_pconf
+		);
+		if ((t_result == APR_SUCCESS) && ((t_result = apr_file_info_get(
+				&t_finfo, APR_FINFO_SIZE, g_captureFile
+			)) == APR_SUCCESS) && (t_finfo.size == 0))
+			t_result = apr_file_write_full(
+				g_captureFile, C_CAPTURE_MAGIC,
+				C_CAPTURE_MAGIC_SIZE, NULL
+			);
+		if (t_result != APR_SUCCESS) {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, t_result, v_server,
+				"Unable to open the capture file %s",
+				t_certWatchServerConfig->m_captureFile
+			);
+			return HTTP_INTERNAL_SERVER_ERROR;
 		}
+		g_captureConfig = t_certWatchServerConfig;
+		apr_pool_cleanup_register(
+			v_pconf, NULL, certwatch_capture_destroy,
+			apr_pool_cleanup_null
+		);
 	}
 
-	/* If no HTTP header customization was requested, set some defaults */
-	if (!t_endOfHeaders)
-		v_request->content_type = "text/html; charset=UTF-8";
+	if (!t_certWatchServerConfig->m_cacheInstance) {
+		if (t_certWatchServerConfig->m_coalesceSlots > 0)
+			ap_log_error(
+				APLOG_MARK, APLOG_WARNING, 0, v_server,
+				"CertWatchCoalesceSlots has no effect without "
+				"CertWatchCache"
+			);
+		return OK;
+	}
 
-	t_returnCode = OK;
+	if (t_certWatchServerConfig->m_cacheProvider->flags
+			& AP_SOCACHE_FLAG_NOTMPSAFE) {
+		t_result = ap_global_mutex_create(
+			&g_cacheMutex, NULL, C_CACHE_MUTEX_TYPE, NULL,
+			v_server, v_pconf, 0
+		);
+		if (t_result != APR_SUCCESS)
+			return HTTP_INTERNAL_SERVER_ERROR;
+	}
 
-	/* Output the response */
-label_outputResponse:
-	ap_rwrite(t_response, t_response_len, v_request);
+	t_result = t_certWatchServerConfig->m_cacheProvider->init(
+		t_certWatchServerConfig->m_cacheInstance, C_CACHE_MUTEX_TYPE,
+		&t_hints, v_server, v_pconf
+	);
+	if (t_result != APR_SUCCESS) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, t_result, v_server,
+			"Unable to initialize the response cache"
+		);
+		return HTTP_INTERNAL_SERVER_ERROR;
+	}
 
-label_return:
-	if (t_PGresult)
-		PQclear(t_PGresult);
+	g_cacheProvider = t_certWatchServerConfig->m_cacheProvider;
+	g_cacheInstance = t_certWatchServerConfig->m_cacheInstance;
+	apr_pool_cleanup_register(
+		v_pconf, v_server, certwatch_cache_destroy,
+		apr_pool_cleanup_null
+	);
 
-	return t_returnCode;
+	/* Create the request coalescing slots.  Anonymous shared memory is
+	  inherited by the children, and is destroyed along with v_pconf */
+	if (t_certWatchServerConfig->m_coalesceSlots > 0) {
+		g_nCoalesceSlots = t_certWatchServerConfig->m_coalesceSlots;
+		t_result = apr_shm_create(
+			&g_coalesceShm,
+			g_nCoalesceSlots * sizeof(tCertWatchCoalesceSlot),
+			NULL, v_pconf
+		);
+		if (t_result != APR_SUCCESS) {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, t_result, v_server,
+				"Unable to create the request coalescing slots"
+			);
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+		g_coalesceSlots = apr_shm_baseaddr_get(g_coalesceShm);
+		memset(g_coalesceSlots, 0, apr_shm_size_get(g_coalesceShm));
+	}
+
+	return OK;
 }
 
 
-/*----------------------------------------------------------------------------
-  - Command Table                                                            -
-  ----------------------------------------------------------------------------*/
-static const command_rec certwatch_commandTable[] = {
-	AP_INIT_TAKE1(
-		"ConnInfo", ap_set_string_slot,
-		(void*)APR_OFFSETOF(tCertWatchDirConfig, m_connInfo),
-		ACCESS_CONF, "PostgreSQL connection string"
-	),
-	{ NULL }
-};
+/******************************************************************************
+ * certwatch_childInit()                                                      *
+ *   Prepares this child process's connection pools, response cache and      *
+ * capture writer thread.                                                     *
+ *                                                                            *
+ * IN:	v_pool - the child process's pool.                                    *
+ ******************************************************************************/
+static void certwatch_childInit(
+	apr_pool_t* const v_pool,
+	server_rec* const v_server
+)
+{
+	if (apr_thread_mutex_create(
+			&g_connPoolsMutex, APR_THREAD_MUTEX_DEFAULT, v_pool
+		) != APR_SUCCESS) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, v_server,
+			"apr_thread_mutex_create() failed"
+		);
+		return;
+	}
+
+	g_childPool = v_pool;
+	g_connPools = apr_hash_make(v_pool);
+
+#ifdef AP_MPMQ_CAN_POLL
+	int t_canSuspend = 0;
+	if ((ap_mpm_query(AP_MPMQ_CAN_SUSPEND, &t_canSuspend) != APR_SUCCESS)
+			|| (!t_canSuspend)
+			|| (ap_mpm_query(AP_MPMQ_CAN_POLL, &g_mpmCanPoll)
+				!= APR_SUCCESS))
+		g_mpmCanPoll = 0;
+#endif
+
+	/* Reattach to the response cache's mutex */
+	if (g_cacheMutex && (apr_global_mutex_child_init(
+			&g_cacheMutex, apr_global_mutex_lockfile(g_cacheMutex),
+			v_pool
+		) != APR_SUCCESS))
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, v_server,
+			"apr_global_mutex_child_init() failed"
+		);
+
+	if (g_admitChildren)
+		certwatch_admit_childInit(v_server);
+
+	if (g_captureFile)
+		certwatch_capture_start(v_pool, v_server);
+
+	/* Shadow requests are only compared via the metrics */
+	if (g_metrics)
+		certwatch_shadow_start(v_pool, v_server);
+}
 
 
 /******************************************************************************
@@ -568,11 +8272,38 @@ static void certwatch_registerHooks(
 	apr_pool_t* const v_pool_unused
 )
 {
+	/* Register configuration hooks - these run once per (re)load of the
+	  configuration */
+	ap_hook_pre_config(certwatch_preConfig, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_post_config(certwatch_postConfig, NULL, NULL, APR_HOOK_MIDDLE);
+
+	/* Register child initialization hook - this runs once for each child
+	  process */
+	ap_hook_child_init(certwatch_childInit, NULL, NULL, APR_HOOK_MIDDLE);
+
+	/* Register child status hook - this runs in the parent whenever a
+	  child process starts or exits */
+	ap_hook_child_status(
+		certwatch_childStatus, NULL, NULL, APR_HOOK_MIDDLE
+	);
+
 	/* Register HTTP(S) content handler - this runs once for each HTTP
 	  request */
 	ap_hook_handler(
 		certwatch_contentHandler, NULL, NULL, APR_HOOK_MIDDLE
 	);
+	ap_hook_handler(
+		certwatch_batchHandler, NULL, NULL, APR_HOOK_MIDDLE
+	);
+	ap_hook_handler(
+		certwatch_statusHandler, NULL, NULL, APR_HOOK_MIDDLE
+	);
+
+	/* Register logging hook - this runs once for each HTTP request, before
+	  mod_log_config writes the access log */
+	ap_hook_log_transaction(
+		certwatch_logTransaction, NULL, NULL, APR_HOOK_REALLY_FIRST
+	);
 }
 
 
@@ -582,8 +8313,8 @@ static void certwatch_registerHooks(
 module AP_MODULE_DECLARE_DATA certwatch_module = {
 	STANDARD20_MODULE_STUFF,
 	certwatch_dirConfig_create,	/* per-directory config creator       */
-	NULL,				/* per-directory config merger        */
-	NULL,				/* per-server config creator          */
+	certwatch_dirConfig_merge,	/* per-directory config merger        */
+	certwatch_serverConfig_create,	/* per-server config creator          */
 	NULL,				/* per-server config merger           */
 	certwatch_commandTable,		/* command table                      */
 	certwatch_registerHooks		/* register hooks                     */
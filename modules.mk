@@ -1,4 +1,4 @@
-mod_certwatch.la: mod_certwatch.slo
-	$(SH_LINK) -rpath $(libexecdir) -module -avoid-version mod_certwatch.lo
+mod_certwatch.la: mod_certwatch.slo certwatch_parse.slo
+	$(SH_LINK) -rpath $(libexecdir) -module -avoid-version mod_certwatch.lo certwatch_parse.lo
 DISTCLEAN_TARGETS = modules.mk
 shared =  mod_certwatch.la